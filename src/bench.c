@@ -0,0 +1,254 @@
+/*********************************************************************
+bench.c: time the hot paths of the editor engine.
+edbrowse -bench [lines [width [reps]]] builds a synthetic file of lines,
+of roughly width characters each, in the edbrowse temp directory;
+then reads it, searches it, runs g// and s///g, undoes,
+unfolds, writes, copies, and deletes, reps times over.
+Results are printed as json, the best and mean seconds for each step,
+so a script can track them from one release to the next.
+make bench runs this with the default sizes.
+edbrowse -bench page.html [reps] times the html scanner on a saved page
+instead, and reports megabytes per second, the time to walk the tree
+of tags, and the time to free them.
+The random generator is seeded the same way each time,
+so the buffer, and the work, is the same from run to run.
+*********************************************************************/
+
+#include "eb.h"
+
+#include <time.h>
+
+#define BENCHLINES 1000000
+#define BENCHWIDTH 60
+#define BENCHREPS 3
+
+// what is timed, the function it exercises, and the command if there is one
+static const struct benchStep {
+	const char *name, *command;
+} benchSteps[] = {
+	{"readFileArgv", 0},
+	{"search", "/haystack/ka"},
+	{"global", "g/needle/s//needle/"},
+	{"substitute", ",s/e/E/g"},
+	{"undo", "u"},
+	{"unfoldBuffer", 0},
+	{"writeFile", "w"},
+	{"addToMap", ",t$"},
+	{"delText", ",d"},
+	{0, 0}
+};
+
+#define NSTEPS (sizeof(benchSteps) / sizeof(benchSteps[0]) - 1)
+
+static unsigned benchSeed;
+static unsigned benchRand(void)
+{
+	benchSeed = benchSeed * 1103515245 + 12345;
+	return benchSeed >> 16;
+}
+
+// Lines of lowercase words, every hundredth line has the word needle,
+// and the last line has the word haystack, so the search runs the length of the buffer.
+static bool benchFile(const char *file, int lines, int width)
+{
+	FILE *f = fopen(file, "w");
+	int i, l, w;
+	if (!f) {
+		setError(MSG_NoCreate2, file);
+		return false;
+	}
+	benchSeed = 1;
+	for (i = 1; i <= lines; ++i) {
+		l = width / 2 + benchRand() % (width + 1);
+		if (i % 100 == 0)
+			fputs("needle ", f), l -= 7;
+		if (i == lines)
+			fputs("haystack ", f), l -= 9;
+		while (l > 0) {
+			w = 2 + benchRand() % 8;
+			if (w > l)
+				w = l;
+			l -= w + 1;
+			while (w--)
+				putc('a' + benchRand() % 26, f);
+			if (l > 0)
+				putc(' ', f);
+		}
+		putc('\n', f);
+	}
+	fclose(f);
+	return true;
+}
+
+static double benchNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// One step, the command is run from line 1, as a user would type it.
+static bool benchStep(int j, const char *file, const char *outfile)
+{
+	const struct benchStep *b = benchSteps + j;
+	char *data;
+	int len;
+	bool rc;
+
+	if (!b->command) {
+		if (stringEqual(b->name, "unfoldBuffer")) {
+			rc = unfoldBuffer(context, false, &data, &len);
+			if (rc)
+				nzFree(data);
+			return rc;
+		}
+		cf->fileName = cloneString(file);
+		rc = readFileArgv(file, 0, 0);
+		cw->undoable = cw->changeMode = false;
+		return rc;
+	}
+
+	cw->dot = 1;
+	if (stringEqual(b->command, "w")) {
+		char *w = allocMem(strlen(outfile) + 3);
+		sprintf(w, "w %s", outfile);
+		rc = runCommand(w);
+		nzFree(w);
+		return rc;
+	}
+	return runCommand(b->command);
+}
+
+// a walk of the tree, looking at each node the way the renderer does
+static int benchText;
+static void benchNode(Tag *t, bool opentag)
+{
+	if (opentag && t->action == TAGACT_TEXT && !t->deleted &&
+	    !(t->info->bits & TAG_INVISIBLE))
+		++benchText;
+}
+
+// The html scanner on a saved page, the page is not charset converted,
+// nor is there any rendering or javascript; this is just the parse.
+// Then walk the tree, as traverseAll() does for render and css.
+static void benchPage(const char *file, int reps)
+{
+	char *data;
+	int len, i, j, ntags = 0;
+	double best = 0, total = 0, t, freebest = 0, ft, walkbest = 0;
+
+	if (!fileIntoMemory(file, &data, &len, 0))
+		showErrorAbort();
+	debugLevel = 0;
+	cxSwitch(1, false);
+	for (i = 0; i < reps; ++i) {
+		initTagArray();
+		cf->hbase = cloneString(file);
+		t = benchNow();
+		htmlScanner(data, NULL, false);
+		t = benchNow() - t;
+		ntags = cw->numTags;
+		traverse_callback = benchNode;
+		for (j = 0; j < 10; ++j) {
+			benchText = 0;
+			ft = benchNow();
+			traverseAll();
+			ft = benchNow() - ft;
+			if ((!i && !j) || ft < walkbest)
+				walkbest = ft;
+		}
+		ft = benchNow();
+		freeTags(cw);
+		ft = benchNow() - ft;
+		if (!i || ft < freebest)
+			freebest = ft;
+		nzFree(cf->hbase);
+		cf->hbase = 0;
+		total += t;
+		if (!i || t < best)
+			best = t;
+	}
+
+	printf("{\n\"version\": \"%s\",\n", version);
+	printf("\"page\": \"%s\",\n\"bytes\": %d,\n\"tags\": %d,\n\"reps\": %d,\n",
+	       file, len, ntags, reps);
+	printf("\"best\": %.6f,\n\"mean\": %.6f,\n\"mbps\": %.2f,\n",
+	       best, total / reps, (best > 0 ? len / best / 1000000 : 0));
+	printf("\"traverse\": %.6f,\n\"free\": %.6f\n}\n", walkbest, freebest);
+	nzFree(data);
+	ebClose(0);
+}
+
+void benchMark(int argc, char **argv)
+{
+	int lines = BENCHLINES, width = BENCHWIDTH, reps = BENCHREPS;
+	double best[NSTEPS], total[NSTEPS], t;
+	char *file, *outfile;
+	int i, j;
+
+	if (argc > 0 && !isdigitByte(argv[0][0])) {
+		reps = (argc > 1 ? atoi(argv[1]) : BENCHREPS);
+		if (reps < 1)
+			i_printfExit(MSG_Usage);
+		benchPage(argv[0], reps);
+	}
+	if (argc > 0)
+		lines = atoi(argv[0]);
+	if (argc > 1)
+		width = atoi(argv[1]);
+	if (argc > 2)
+		reps = atoi(argv[2]);
+	if (lines < 100 || width < 10 || reps < 1)
+		i_printfExit(MSG_Usage);
+// no temp directory, and that message has already been printed
+	if (!ebUserDir)
+		ebClose(1);
+
+	file = allocMem(strlen(ebUserDir) + 16);
+	sprintf(file, "%s/bench.txt", ebUserDir);
+	outfile = allocMem(strlen(ebUserDir) + 16);
+	sprintf(outfile, "%s/bench.out", ebUserDir);
+	if (!benchFile(file, lines, width))
+		showErrorAbort();
+
+	debugLevel = 0;
+	cxSwitch(1, false);
+	for (j = 0; j < (int)NSTEPS; ++j)
+		best[j] = total[j] = 0;
+	for (i = 0; i < reps; ++i) {
+// each pass reads the file into a fresh session
+		if (i) {
+			cxQuit(context, 3);
+			cxSwitch(1, false);
+		}
+		for (j = 0; j < (int)NSTEPS; ++j) {
+			t = benchNow();
+			if (!benchStep(j, file, outfile))
+				showErrorAbort();
+			t = benchNow() - t;
+			total[j] += t;
+			if (!i || t < best[j])
+				best[j] = t;
+		}
+	}
+
+	printf("{\n\"version\": \"%s\",\n", version);
+	printf("\"lines\": %d,\n\"width\": %d,\n\"reps\": %d,\n",
+	       lines, width, reps);
+	printf("\"steps\": [\n");
+	for (j = 0; j < (int)NSTEPS; ++j) {
+		const struct benchStep *b = benchSteps + j;
+		printf("{\"name\": \"%s\", ", b->name);
+		if (b->command)
+			printf("\"command\": \"%s\", ", b->command);
+		printf("\"best\": %.6f, \"mean\": %.6f}%s\n",
+		       best[j], total[j] / reps, (j < (int)NSTEPS - 1 ? "," : ""));
+	}
+	printf("]\n}\n");
+
+	unlink(file);
+	unlink(outfile);
+	nzFree(file);
+	nzFree(outfile);
+	ebClose(0);
+}
@@ -4,6 +4,8 @@
 
 #include <libgen.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 /* If this include file is missing, you need the pcre package,
  * and the pcre-devel package. */
@@ -40,8 +42,6 @@ static const char spaceplus_cmd[] = "befrw";
 static const char nofollow_cmd[] = "aAcdDhHjlmnptuX=";
 // Commands that can be done after a g// global directive
 static const char global_cmd[] = "<!dDijJlmnprstwX=";
-static bool *gflag;
-static Window *gflag_w;
 
 static int startRange, endRange;	/* as in 57,89p */
 static int destLine;		/* as in 57,89m226 */
@@ -159,18 +159,17 @@ addchar:
 static pst fetchLineContext(int n, int show, int cx)
 {
 	Window *lw = sessionList[cx].lw;
-	struct lineMap *map, *t;
+	struct lineMap *t;
 	int dol;
 	pst p;			/* the resulting copy of the string */
 
 	if (!lw)
 		i_printfExit(MSG_InvalidSession, cx);
-	map = lw->map;
 	dol = lw->dol;
 	if (n <= 0 || n > dol)
 		i_printfExit(MSG_InvalidLineNb, n);
 
-	t = map + n;
+	t = mapLine(lw->map, n);
 	if (show < 0)
 		return t->text;
 	p = clonePstring(t->text);
@@ -184,10 +183,36 @@ pst fetchLine(int n, int show)
 	return fetchLineContext(n, show, context);
 }
 
-/* Display a line to the screen, with a limit on output length. */
-void displayLine(int n)
+/*********************************************************************
+Fetch a line for the regular expression engine.
+Searches and g// look at every line in the buffer, and copying each one,
+just to free it after one pcre2_match, is a malloc free pair per line.
+That adds up on a log file with millions of lines.
+So hand back the line in place, and only copy it if we are browsing,
+and the line actually contains hidden numbers that have to come out.
+len is the length of the subject, without the trailing newline.
+Set *copied if the caller is responsible for freeing the result.
+*********************************************************************/
+
+static pst fetchLineMatch(int n, int *len, bool *copied)
+{
+	const struct lineMap *t = mapLine(cw->map, n);
+	pst p = t->text;
+	int l = t->len;
+	*copied = false;
+	if (cw->browseMode && memchr(p, InternalCodeChar, l)) {
+		p = clonePstring(p);
+		removeHiddenNumbers(p, '\n');
+		l = pstLength(p);
+		*copied = true;
+	}
+	*len = l - 1;
+	return p;
+}
+
+/* Display line n, with text already in hand, with a limit on output length. */
+static void displayText(const pst line, int n)
 {
-	pst line = fetchLine(n, 1);
 	pst s = line;
 	int cnt = 0;
 	uchar c;
@@ -230,7 +255,7 @@ void displayLine(int n)
 	if (cw->dirMode) {
 		stringAndString(&output, &output_l, dirSuffix(n));
 		if (cw->r_map) {
-			s = cw->r_map[n].text;
+			s = mapLine(cw->r_map, n)->text;
 			if (*s) {
 				stringAndChar(&output, &output_l, ' ');
 				stringAndString(&output, &output_l, (char *)s);
@@ -240,9 +265,15 @@ void displayLine(int n)
 	if (endMarks && cmd == 'l')
 		stringAndChar(&output, &output_l, '$');
 	eb_puts(output);
+	nzFree(output);
+}
 
+/* Display a line to the screen */
+void displayLine(int n)
+{
+	pst line = fetchLine(n, 1);
+	displayText(line, n);
 	free(line);
-	nzFree(output);
 }
 
 void printDot(void)
@@ -786,139 +817,669 @@ static void print_pst(pst p)
 	} while (*p++ != '\n');
 }
 
-static void freeLine(struct lineMap *t)
+/*********************************************************************
+Lines that come in from a file, or any large block of text,
+are not allocated one at a time.
+A 5 gig file is a hundred million lines, and a hundred million mallocs,
+with all the overhead and fragmentation that goes with it.
+Instead, the lines are packed into slabs, a megabyte or so each.
+A slab counts the lines within it that are still in use,
+and when the last one is freed, the slab is freed.
+A line that is changed, by substitute or whatever, is a new allocation,
+or a line in a new slab if a substitute changes many lines at once,
+and the old line in the slab is freed when undo lets go of it.
+The slabs are kept in order by address, so a binary search tells us
+whether a line lives in a slab, or was allocated on its own.
+So free any line of text via freeLineText(), never free() directly.
+A very large file is not copied at all; it is mapped into memory,
+and the mapping is a slab, its lines point into the file.
+*********************************************************************/
+
+#define SLABSIZE 0x100000
+// Smaller blocks of text are not worth a slab.
+#define SLABMIN 0x4000
+
+struct lineSlab {
+	uchar *base;
+	size_t size;
+	int live;		// lines in this slab still in use
+	bool mapped;		// mmap of a file, rather than allocated
+	dev_t dev;		// the file that is mapped, if it is still mapped
+	ino_t ino;
+};
+static struct lineSlab *slabList;
+static int slabCount, slabAlloc;
+
+static struct lineSlab *slabFind(const uchar *p)
+{
+	int lo = 0, hi = slabCount - 1, mid;
+	struct lineSlab *s;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		s = slabList + mid;
+		if (p < s->base)
+			hi = mid - 1;
+		else if (p >= s->base + s->size)
+			lo = mid + 1;
+		else
+			return s;
+	}
+	return 0;
+}
+
+// Put a block of memory in the list of slabs, in address order.
+static struct lineSlab *slabInsert(uchar *base, size_t size)
+{
+	int lo = 0, hi = slabCount;
+	struct lineSlab *s;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (slabList[mid].base < base)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (slabCount == slabAlloc) {
+		slabAlloc = slabAlloc ? slabAlloc * 2 : 64;
+		slabList = slabList ?
+		    reallocMem(slabList, slabAlloc * sizeof(struct lineSlab)) :
+		    allocMem(slabAlloc * sizeof(struct lineSlab));
+	}
+	s = slabList + lo;
+	memmove(s + 1, s, (slabCount - lo) * sizeof(struct lineSlab));
+	++slabCount;
+	memset(s, 0, sizeof(struct lineSlab));
+	s->base = base, s->size = size;
+	debugPrint(7, "slab %lld bytes, %d slabs", (long long)size, slabCount);
+	return s;
+}
+
+static struct lineSlab *slabNew(size_t size)
+{
+	return slabInsert(allocMem(size), size);
+}
+
+static void slabRemove(struct lineSlab *s)
+{
+	if (s->mapped)
+		munmap(s->base, s->size);
+	else
+		free(s->base);
+	--slabCount;
+	memmove(s, s + 1, (slabList + slabCount - s) * sizeof(struct lineSlab));
+}
+
+/*********************************************************************
+Lines that point into a mapped file are only good as long as the file is.
+If we truncate that file, to write the buffer back out to it,
+the lines go away underneath us, and the next read is a bus error.
+So copy the mapping into anonymous memory, at the same address,
+so none of the pointers change.
+This goes 64 meg at a time, so we don't need another copy of the whole file.
+Some other program could truncate the file as well, and there isn't much
+we can do about that, except to say that a log file that is being
+rotated by truncation should not be edited in place.
+*********************************************************************/
+
+#define DETACHSTEP 0x4000000
+
+void unmapFile(const char *filename)
+{
+	struct stat st;
+	struct lineSlab *s;
+	uchar *tmp = 0;
+	if (stat(filename, &st))
+		return;
+	for (s = slabList; s < slabList + slabCount; ++s) {
+		size_t off, n;
+		if (!s->mapped || !s->ino || s->dev != st.st_dev
+		    || s->ino != st.st_ino)
+			continue;
+		debugPrint(3, "detach %lld bytes from %s", (long long)s->size,
+			   filename);
+		if (!tmp)
+			tmp = allocMem(DETACHSTEP);
+		for (off = 0; off < s->size; off += n) {
+			n = s->size - off;
+			if (n > DETACHSTEP)
+				n = DETACHSTEP;
+			memcpy(tmp, s->base + off, n);
+			if (mmap(s->base + off, n, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
+				 0) == MAP_FAILED)
+				i_printfExit(MSG_MemAllocError, n);
+			memcpy(s->base + off, tmp, n);
+		}
+		s->dev = 0, s->ino = 0;
+	}
+	nzFree(tmp);
+}
+
+/*********************************************************************
+A line of text can be referenced from more than one place,
+the same line twice in the buffer after a t command,
+or in the buffer and in an undo step.
+Almost every line has one reference, so rather than put a count in
+every line, lines with more than one reference are kept in a hash table,
+with their reference counts.
+shareLine() adds a reference, and freeLineText() drops one,
+only freeing the text when the last reference goes away.
+Text that is shared must not be changed in place;
+a substitute or join builds a new line, so that is not a problem.
+*********************************************************************/
+
+struct lineRef {
+	pst p;
+	int refs;
+};
+static struct lineRef *refTable;
+static int refCount, refAlloc;	// refAlloc is a power of 2
+
+static unsigned refHash(const uchar *p)
+{
+	return (unsigned)(((size_t) p >> 3) * 0x9e3779b1) & (refAlloc - 1);
+}
+
+static struct lineRef *refFind(const uchar *p)
+{
+	unsigned h = refHash(p);
+	while (refTable[h].p) {
+		if (refTable[h].p == p)
+			return refTable + h;
+		h = (h + 1) & (refAlloc - 1);
+	}
+	return refTable + h;
+}
+
+pst shareLine(pst p)
+{
+	struct lineRef *r;
+	if (p == (pst) emptyString)
+		return p;
+	if (refCount * 2 >= refAlloc) {
+		struct lineRef *old = refTable;
+		int j, oldAlloc = refAlloc;
+		refAlloc = refAlloc ? refAlloc * 2 : 1024;
+		refTable = allocZeroMem(refAlloc * sizeof(struct lineRef));
+		for (j = 0; j < oldAlloc; ++j)
+			if (old[j].p)
+				*refFind(old[j].p) = old[j];
+		nzFree(old);
+	}
+	r = refFind(p);
+	if (r->p)
+		++r->refs;
+	else
+		r->p = p, r->refs = 2, ++refCount;
+	return p;
+}
+
+// Drop a reference to a shared line, return false if the line was not shared.
+static bool unshareLine(const uchar *p)
+{
+	struct lineRef *r = refFind(p);
+	unsigned h, j;
+	if (!r->p)
+		return false;
+	if (--r->refs > 1)
+		return true;
+// down to one reference, take it out of the table, and close up the gap
+	--refCount;
+	h = r - refTable;
+	refTable[h].p = 0;
+	for (j = (h + 1) & (refAlloc - 1); refTable[j].p;
+	     j = (j + 1) & (refAlloc - 1)) {
+		struct lineRef e = refTable[j];
+		refTable[j].p = 0;
+		*refFind(e.p) = e;
+	}
+	return true;
+}
+
+void freeLineText(pst p)
+{
+	struct lineSlab *s;
+	if (!p || p == (pst) emptyString)
+		return;
+	if (refCount && unshareLine(p))
+		return;
+	if (slabCount && (s = slabFind(p))) {
+		if (--s->live)
+			return;
+		slabRemove(s);
+		return;
+	}
+	free(p);
+}
+
+static void freeLine(pst p)
 {
 	if (debugLevel >= 8) {
 		if (debugFile)
 			fprintf(debugFile, "free ");
 		else
 			printf("free ");
-		print_pst(t->text);
+		print_pst(p);
 	}
-	nzFree(t->text);
+	freeLineText(p);
+}
+
+/*********************************************************************
+The chunked map of lines, see struct bufMap in eb.h.
+A chunk grows to at most 2*MAPCHUNK lines, then it is split in two.
+A chunk that empties out is removed, and a small chunk is merged with
+its neighbor, so the chunks stay reasonably full.
+Lines are numbered from 1, as in the editor.
+None of these routines free the text of a line; that is up to the caller.
+The map keeps a running total of the bytes in its lines,
+so the size of a buffer is known without reading all the text.
+If you change the text of a line in place, go through mapSetText(),
+or call mapRecount() after rewriting many lines.
+Either one drops the trigram index of the lines that changed,
+see the trigram index below.
+*********************************************************************/
+
+#define MAPCHUNK 2048
+
+static void mapRenumber(struct bufMap *m, int k)
+{
+	struct mapChunk *c = m->chunks + k;
+	int start = (k ? c[-1].start + c[-1].count : 1);
+	for (; k < m->nchunks; ++k, ++c)
+		c->start = start, start += c->count;
 }
 
-static void freeWindowLines(struct lineMap *map)
+// Make room for n new chunks at position k.
+static struct mapChunk *mapOpenChunks(struct bufMap *m, int k, int n)
 {
-	struct lineMap *t;
-	int cnt = 0;
+	struct mapChunk *c;
+	if (m->nchunks + n > m->allocChunks) {
+		m->allocChunks = (m->nchunks + n) * 3 / 2 + 4;
+		m->chunks = m->chunks ?
+		    reallocMem(m->chunks, m->allocChunks * sizeof(struct mapChunk)) :
+		    allocMem(m->allocChunks * sizeof(struct mapChunk));
+	}
+	c = m->chunks + k;
+	memmove(c + n, c, (m->nchunks - k) * sizeof(struct mapChunk));
+	m->nchunks += n;
+	memset(c, 0, n * sizeof(struct mapChunk));
+	return c;
+}
 
-	if ((t = map)) {
-		for (++t; t->text; ++t) {
-			freeLine(t);
-			++cnt;
-		}
-		free(map);
+// The lines of this chunk have changed; its trigram index no longer applies.
+static void mapDirty(struct mapChunk *c)
+{
+	nzFree(c->tri);
+	c->tri = 0;
+}
+
+// Drop the trigram index of every chunk.
+static void mapUnindex(struct bufMap *m)
+{
+	int k;
+	if (m)
+		for (k = 0; k < m->nchunks; ++k)
+			mapDirty(m->chunks + k);
+}
+
+static void mapCloseChunk(struct bufMap *m, int k)
+{
+	struct mapChunk *c = m->chunks + k;
+	nzFree(c->lines);
+	nzFree(c->tri);
+	--m->nchunks;
+	memmove(c, c + 1, (m->nchunks - k) * sizeof(struct mapChunk));
+}
+
+// Find the chunk holding line n, 1 <= n <= lines.
+static int mapFind(struct bufMap *m, int n)
+{
+	int lo, hi, mid;
+	struct mapChunk *c = m->chunks + m->hint;
+	if (m->hint < m->nchunks && n >= c->start && n < c->start + c->count)
+		return m->hint;
+	++c;
+	if (m->hint + 1 < m->nchunks && n >= c->start
+	    && n < c->start + c->count)
+		return ++m->hint;
+	lo = 0, hi = m->nchunks - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (m->chunks[mid].start <= n)
+			lo = mid;
+		else
+			hi = mid - 1;
 	}
+	return (m->hint = lo);
+}
 
-	debugPrint(6, "freeWindowLines = %d", cnt);
+struct lineMap *mapLine(struct bufMap *m, int n)
+{
+	struct mapChunk *c;
+	if (!m || n <= 0 || n > m->lines)
+		i_printfExit(MSG_InvalidLineNb, n);
+	c = m->chunks + mapFind(m, n);
+	return c->lines + (n - c->start);
 }
 
-/*********************************************************************
-Garbage collection for text lines.
-There is an undo window that holds a snapshot of the buffer as it was before.
-not a copy of all the text, but a copy of map,
-and dot and dollar and some other things.
-This starts out with map = 0.
-The u command swaps undoWindow and current window (cw).
-Thus another u undoes your undo.
-You can step back through all your changes,
-popping a stack like a modern editor. Sorry.
-Just don't screw up more than once,
-and don't save your file til you're sure it's ok.
-No autosave feature here, I never liked that anyways.
-So at the start of every command not under g//, set madeChanges = false.
-If we're about to change something in the buffer, set madeChanges = true.
-But if madeChanges was false, i.e. this is the first change coming,
-call undoPush().
-This pushes the undo window off the cliff,
-and that means we have to free the text first.
-Call undoCompare().
-This finds any lines in the undo window that aren't in cw and frees them.
-That is a quicksort on both maps and then a comm -23.
-Then it frees undoWindow.map just to make sure we don't free things twice.
-Then undoPush copies cw onto undoWindow, ready for the u command.
-Return, and the calling function makes its change.
-But we call undoCompare at other times, like switching buffers,
-pop the window stack, browse, or quit.
-These make undo impossible, so free the lines in the undo window.
-*********************************************************************/
+// Put the lines of piece into new chunks at position k.
+static void mapFillChunks(struct bufMap *m, int k, const struct lineMap *piece,
+			  int n)
+{
+	struct mapChunk *c = mapOpenChunks(m, k, (n + MAPCHUNK - 1) / MAPCHUNK);
+	for (; n; ++c) {
+		int cnt = (n > MAPCHUNK ? MAPCHUNK : n);
+		c->alloc = MAPCHUNK;
+		c->lines = allocMem(MAPCHUNK * LMSIZE);
+		memcpy(c->lines, piece, cnt * LMSIZE);
+		c->count = cnt;
+		piece += cnt, n -= cnt;
+	}
+}
 
-static bool madeChanges;
-static Window undoWindow;
+static long long pieceBytes(const struct lineMap *piece, int n)
+{
+	long long bytes = 0;
+	while (n--)
+		bytes += piece++->len;
+	return bytes;
+}
 
-/* quick sort compare */
-static int qscmp(const void *s, const void *t)
+struct bufMap *mapCreate(const struct lineMap *piece, int n)
 {
-	return memcmp(s, t, sizeof(char *));
+	struct bufMap *m = allocZeroMem(sizeof(struct bufMap));
+	mapFillChunks(m, 0, piece, n);
+	m->lines = n;
+	m->bytes = pieceBytes(piece, n);
+	mapRenumber(m, 0);
+	return m;
 }
 
-/* Free undo lines not used by the current session. */
-static void undoCompare(void)
+// Insert n lines after line number after, and return the map.
+// An empty buffer has no map, so this could create the map.
+struct bufMap *mapInsert(struct bufMap *m, int after, const struct lineMap *piece,
+		     int n)
 {
-	const struct lineMap *cmap = cw->map;
-	struct lineMap *map = undoWindow.map;
-	struct lineMap *cmap2;
-	struct lineMap *s, *t;
-	int diff, cnt = 0;
+	int k, off;
+	struct mapChunk *c;
 
-	if (!cmap) {
-		debugPrint(6, "undoCompare no current map");
-		freeWindowLines(undoWindow.map);
-		undoWindow.map = 0;
-		return;
+	if (!m)
+		return mapCreate(piece, n);
+	if (!n)
+		return m;
+
+	if (after == m->lines) {
+		k = m->nchunks - 1;
+		off = m->chunks[k].count;
+	} else {
+		k = mapFind(m, after + 1);
+		off = after + 1 - m->chunks[k].start;
+	}
+	c = m->chunks + k;
+
+	if (c->count + n <= 2 * MAPCHUNK) {
+		if (c->count + n > c->alloc) {
+			c->alloc = 2 * MAPCHUNK;
+			c->lines = reallocMem(c->lines, c->alloc * LMSIZE);
+		}
+		memmove(c->lines + off + n, c->lines + off,
+			(c->count - off) * LMSIZE);
+		memcpy(c->lines + off, piece, n * LMSIZE);
+		c->count += n;
+		mapDirty(c);
+	} else {
+// Split this chunk at the insertion point, the new lines go in between.
+		int tail = c->count - off;
+		if (tail) {
+			struct mapChunk *c2 = mapOpenChunks(m, k + 1, 1);
+			c = c2 - 1;
+			c2->alloc = (tail > MAPCHUNK ? tail : MAPCHUNK);
+			c2->lines = allocMem(c2->alloc * LMSIZE);
+			memcpy(c2->lines, c->lines + off, tail * LMSIZE);
+			c2->count = tail;
+			c->count = off;
+			mapDirty(c);
+		}
+		mapFillChunks(m, k + 1, piece, n);
+		if (!off)
+			mapCloseChunk(m, k);
+	}
+
+	m->lines += n;
+	m->bytes += pieceBytes(piece, n);
+	mapRenumber(m, k);
+	return m;
+}
+
+// Remove lines start through end from the map.
+// By convention an empty buffer has no map, so this returns 0
+// if all the lines are gone.
+struct bufMap *mapDelete(struct bufMap *m, int start, int end)
+{
+	int k, k1, off, n;
+	struct mapChunk *c;
+
+	if (end < start)
+		return m;
+	if (start == 1 && end == m->lines) {
+		mapFree(m);
+		return 0;
+	}
+
+	k = k1 = mapFind(m, start);
+	n = end - start + 1;
+	while (n) {
+		int cnt;
+		c = m->chunks + k;
+		off = (start > c->start ? start - c->start : 0);
+		cnt = c->count - off;
+		if (cnt > n)
+			cnt = n;
+		m->bytes -= pieceBytes(c->lines + off, cnt);
+		memmove(c->lines + off, c->lines + off + cnt,
+			(c->count - off - cnt) * LMSIZE);
+		c->count -= cnt;
+		n -= cnt;
+		mapDirty(c);
+		if (c->count)
+			++k;
+		else
+			mapCloseChunk(m, k);
+	}
+	m->lines -= end - start + 1;
+
+// Merge a small chunk with the one after it.
+	if (k1 >= m->nchunks)
+		k1 = m->nchunks - 1;
+	c = m->chunks + k1;
+	if (k1 + 1 < m->nchunks && c->count + c[1].count <= MAPCHUNK) {
+		if (c->alloc < MAPCHUNK) {
+			c->alloc = MAPCHUNK;
+			c->lines = reallocMem(c->lines, c->alloc * LMSIZE);
+		}
+		memcpy(c->lines + c->count, c[1].lines, c[1].count * LMSIZE);
+		c->count += c[1].count;
+		mapDirty(c);
+		mapCloseChunk(m, k1 + 1);
+	}
+	if (k1 && c->count + c[-1].count <= MAPCHUNK) {
+		--k1, --c;
+		if (c->alloc < MAPCHUNK) {
+			c->alloc = MAPCHUNK;
+			c->lines = reallocMem(c->lines, c->alloc * LMSIZE);
+		}
+		memcpy(c->lines + c->count, c[1].lines, c[1].count * LMSIZE);
+		c->count += c[1].count;
+		mapDirty(c);
+		mapCloseChunk(m, k1 + 1);
+	}
+
+	m->hint = 0;
+	mapRenumber(m, k1);
+	return m;
+}
+
+// Copy lines start through end out of the map, into dest.
+void mapCopyOut(struct bufMap *m, int start, int end, struct lineMap *dest)
+{
+	while (start <= end) {
+		struct mapChunk *c = m->chunks + mapFind(m, start);
+		int off = start - c->start;
+		int cnt = c->count - off;
+		if (cnt > end - start + 1)
+			cnt = end - start + 1;
+		memcpy(dest, c->lines + off, cnt * LMSIZE);
+		dest += cnt, start += cnt;
 	}
+}
+
+// Line n has new text, perhaps a different length.
+void mapSetText(struct bufMap *m, int n, pst text, int len)
+{
+	struct lineMap *t = mapLine(m, n);
+	m->bytes += len - t->len;
+	t->text = text, t->len = len;
+// mapLine() leaves the hint on the chunk holding this line
+	mapDirty(m->chunks + m->hint);
+}
+
+// Add up the bytes again, after lines have been rewritten in place.
+// Any trigram index is stale too.
+void mapRecount(struct bufMap *m)
+{
+	int k;
+	if (!m)
+		return;
+	mapUnindex(m);
+	m->bytes = 0;
+	for (k = 0; k < m->nchunks; ++k)
+		m->bytes += pieceBytes(m->chunks[k].lines, m->chunks[k].count);
+}
 
-	if (!map) {
-		debugPrint(6, "undoCompare no undo map");
+// Free the map, but not the lines of text.
+void mapFree(struct bufMap *m)
+{
+	int k;
+	if (!m)
 		return;
+	for (k = 0; k < m->nchunks; ++k) {
+		free(m->chunks[k].lines);
+		nzFree(m->chunks[k].tri);
 	}
+	nzFree(m->chunks);
+	free(m);
+}
 
-/* sort both arrays, run comm, and find out which lines are not needed any more,
-then free them.
- * Use quick sort; some files are a million lines long.
- * I have to copy the second array, so I can sort it.
- * The first I can sort in place, cause it's going to get thrown away. */
-
-	cmap2 = allocMem((cw->dol + 2) * LMSIZE);
-	memcpy(cmap2, cmap, (cw->dol + 2) * LMSIZE);
-	debugPrint(8, "qsort %d %d", undoWindow.dol, cw->dol);
-	qsort(map + 1, undoWindow.dol, LMSIZE, qscmp);
-	qsort(cmap2 + 1, cw->dol, LMSIZE, qscmp);
-
-	s = map + 1;
-	t = cmap2 + 1;
-	while (s->text && t->text) {
-		diff = memcmp(s, t, sizeof(char *));
-		if (!diff) {
-			++s, ++t;
-			continue;
-		}
-		if (diff > 0) {
-			++t;
-			continue;
+static void freeWindowLines(struct bufMap *map)
+{
+	int k, i, cnt = 0;
+
+	if (map) {
+		for (k = 0; k < map->nchunks; ++k) {
+			struct mapChunk *c = map->chunks + k;
+			for (i = 0; i < c->count; ++i)
+				freeLine(c->lines[i].text);
+			cnt += c->count;
 		}
-		freeLine(s);
-		++s;
-		++cnt;
+		mapFree(map);
 	}
 
-	while (s->text) {
-		freeLine(s);
-		++s;
-		++cnt;
+	debugPrint(6, "freeWindowLines = %d", cnt);
+}
+
+/*********************************************************************
+Undo and redo.
+Every command that changes the buffer is recorded as an undo step,
+the dot and labels as they were before, and a list of splices.
+A splice says lines were taken out at a certain line number,
+and other lines put in their place.
+The lines taken out belong to the splice now, not to the buffer;
+the lines put in are only counted.
+A move just records where the block came from and where it went.
+So a step costs memory in proportion to the change, not to the buffer.
+Undo plays the splices of the last step backwards,
+and that builds the inverse step, which goes on the redo stack.
+Redo does the same thing the other way around.
+A new change throws the redo steps away.
+So at the start of every command not under g//, set madeChanges = false.
+If we're about to change something in the buffer, call undoPush().
+If madeChanges was false, i.e. this is the first change coming,
+this starts a new undo step.
+Then the routines that change the map record their splices.
+Call undoClear() at other times, like switching buffers,
+pop the window stack, browse, or quit.
+These make undo impossible, so free the lines held by the undo steps.
+*********************************************************************/
+
+#define UNDOLEVELS 100
+
+struct undoSplice {
+	int at;			// first line of the change
+	int nins, ndel;		// lines put in, lines taken out
+	struct lineMap *lines;	// the lines taken out
+	int moveto;		// for a move, the block goes after this line
+	int *perm;		// for a sort, where each line was before
+};
+
+struct undoStep {
+	int dot;
+	int labels[MARKLETTERS];
+	bool binMode, nlMode, dirMode, dnoMode;
+	struct undoSplice *splices;
+	int nsplices, allocSplices;
+};
+
+static bool madeChanges;
+static struct undoStep undoStack[UNDOLEVELS], redoStack[UNDOLEVELS];
+static int undoLevels, redoLevels;
+static struct undoStep *undoCur;	// step for the current command
+
+static void undoStepFree(struct undoStep *u)
+{
+	int j, i;
+	for (j = 0; j < u->nsplices; ++j) {
+		struct undoSplice *sp = u->splices + j;
+		nzFree(sp->perm);
+		if (sp->moveto >= 0 || sp->perm)
+			continue;
+		for (i = 0; i < sp->ndel; ++i)
+			freeLine(sp->lines[i].text);
+		nzFree(sp->lines);
 	}
+	nzFree(u->splices);
+	memset(u, 0, sizeof(struct undoStep));
+}
+
+static void redoClear(void)
+{
+	while (redoLevels)
+		undoStepFree(redoStack + --redoLevels);
+}
 
-	free(cmap2);
-	free(map);
-	undoWindow.map = 0;
-	debugPrint(6, "undoCompare strip %d", cnt);
+/* Free the undo and redo steps, and the lines they hold. */
+static void undoClear(void)
+{
+	int cnt = undoLevels + redoLevels;
+	while (undoLevels)
+		undoStepFree(undoStack + --undoLevels);
+	redoClear();
+	undoCur = 0;
+	debugPrint(6, "undoClear %d", cnt);
 }
 
-static void undoPush(void)
+// The state of the buffer around the lines, that undo puts back.
+static void undoStepModes(struct undoStep *u)
 {
-	Window *uw;
+	u->dot = cw->dot;
+	memcpy(u->labels, cw->labels, MARKLETTERS * sizeof(int));
+	u->binMode = cw->binMode;
+	u->nlMode = cw->nlMode;
+	u->dirMode = cw->dirMode;
+	u->dnoMode = cw->dnoMode;
+}
 
+static void undoPush(void)
+{
 // if in browse mode, we really shouldn't be here at all!
 // But we could if substituting on an input field, since substitute is also
 // a regular ed command.
@@ -929,30 +1490,190 @@ static void undoPush(void)
 	madeChanges = true;
 	debugPrint(6, "undoPush");
 
+// Something made undo impossible since the last change, like reading a file,
+// so the old steps don't apply to this buffer any more.
+	if (!cw->undoable)
+		undoClear();
 	cw->undoable = true;
 	if (!cw->quitMode)
 		cw->changeMode = true;
 
-	undoCompare();
+	redoClear();
+	if (undoLevels == UNDOLEVELS) {
+// drop the oldest step
+		undoStepFree(undoStack);
+		memmove(undoStack, undoStack + 1,
+			(UNDOLEVELS - 1) * sizeof(struct undoStep));
+		memset(undoStack + --undoLevels, 0, sizeof(struct undoStep));
+	}
+	undoCur = undoStack + undoLevels++;
+	undoStepModes(undoCur);
+}
+
+// Are changes to the current buffer being recorded?
+static bool undoRecording(void)
+{
+	return undoCur && madeChanges &&
+	    !(cw->browseMode | cw->sqlMode | cw->dirMode | cw->ircoMode);
+}
+
+static struct undoSplice *spliceAdd(struct undoStep *u)
+{
+	struct undoSplice *sp;
+	if (u->nsplices == u->allocSplices) {
+		u->allocSplices = u->allocSplices ? u->allocSplices * 2 : 4;
+		u->splices = u->splices ?
+		    reallocMem(u->splices,
+			       u->allocSplices * sizeof(struct undoSplice)) :
+		    allocMem(u->allocSplices * sizeof(struct undoSplice));
+	}
+	sp = u->splices + u->nsplices++;
+	memset(sp, 0, sizeof(struct undoSplice));
+	return sp;
+}
+
+/*********************************************************************
+Record a splice: nins lines were put in at line at,
+in place of the ndel lines passed in, which were taken out.
+The array of lines belongs to the undo step now.
+If we aren't recording, free the lines, nobody needs them.
+*********************************************************************/
+
+static void undoSplice(int at, int nins, struct lineMap *lines, int ndel)
+{
+	struct undoSplice *sp;
+	int i;
+	if (!undoRecording()) {
+		for (i = 0; i < ndel; ++i)
+			freeLine(lines[i].text);
+		nzFree(lines);
+		return;
+	}
+	sp = spliceAdd(undoCur);
+	sp->at = at, sp->nins = nins, sp->ndel = ndel, sp->lines = lines;
+	sp->moveto = -1;
+}
+
+// Lines at through at+n-1 were moved to just after line moveto,
+// counting lines after the block was taken out.
+static void undoMove(int at, int n, int moveto)
+{
+	struct undoSplice *sp;
+	if (!undoRecording())
+		return;
+	sp = spliceAdd(undoCur);
+	sp->at = at, sp->nins = sp->ndel = n;
+	sp->moveto = moveto;
+}
+
+// Lines at through at+n-1 were sorted; the line now at at+i
+// was at at+perm[i] before. The array belongs to the undo step now.
+static void undoPermute(int at, int n, int *perm)
+{
+	struct undoSplice *sp;
+	if (!undoRecording()) {
+		free(perm);
+		return;
+	}
+	sp = spliceAdd(undoCur);
+	sp->at = at, sp->nins = sp->ndel = n;
+	sp->moveto = -1, sp->perm = perm;
+}
+
+/* Take lines start through end out of the map, return them in an array. */
+static struct lineMap *mapTakeOut(int start, int end)
+{
+	struct lineMap *lines = 0;
+	if (end >= start) {
+		lines = allocMem((end - start + 1) * LMSIZE);
+		mapCopyOut(cw->map, start, end, lines);
+		cw->map = mapDelete(cw->map, start, end);
+	}
+	return lines;
+}
+
+/* Play a step backwards, building its inverse as we go. */
+static void undoApply(struct undoStep *u, struct undoStep *inv)
+{
+	int j;
+	undoStepModes(inv);
+	for (j = u->nsplices - 1; j >= 0; --j) {
+		struct undoSplice *sp = u->splices + j;
+		struct undoSplice *ip = spliceAdd(inv);
+		struct lineMap *lines;
+		if (sp->moveto >= 0) {
+			lines = mapTakeOut(sp->moveto + 1, sp->moveto + sp->nins);
+			cw->map = mapInsert(cw->map, sp->at - 1, lines, sp->nins);
+			free(lines);
+			ip->at = sp->moveto + 1, ip->moveto = sp->at - 1;
+			ip->nins = ip->ndel = sp->nins;
+			continue;
+		}
+		if (sp->perm) {
+			struct lineMap *back = allocMem(sp->nins * LMSIZE);
+			int *inverse = allocMem(sp->nins * sizeof(int));
+			int i;
+			lines = mapTakeOut(sp->at, sp->at + sp->nins - 1);
+			for (i = 0; i < sp->nins; ++i) {
+				back[sp->perm[i]] = lines[i];
+				inverse[sp->perm[i]] = i;
+			}
+			cw->map = mapInsert(cw->map, sp->at - 1, back, sp->nins);
+			free(back);
+			free(lines);
+			free(sp->perm);
+			ip->at = sp->at, ip->moveto = -1, ip->perm = inverse;
+			ip->nins = ip->ndel = sp->nins;
+			continue;
+		}
+		lines = mapTakeOut(sp->at, sp->at + sp->nins - 1);
+		if (sp->ndel)
+			cw->map = mapInsert(cw->map, sp->at - 1, sp->lines, sp->ndel);
+		nzFree(sp->lines);
+		ip->at = sp->at, ip->moveto = -1;
+		ip->nins = sp->ndel, ip->ndel = sp->nins, ip->lines = lines;
+	}
+	nzFree(u->splices);
+	cw->dol = (cw->map ? cw->map->lines : 0);
+	cw->dot = u->dot;
+	memcpy(cw->labels, u->labels, MARKLETTERS * sizeof(int));
+	cw->binMode = u->binMode;
+	cw->nlMode = u->nlMode;
+	cw->dirMode = u->dirMode;
+	cw->dnoMode = u->dnoMode;
+	memset(u, 0, sizeof(struct undoStep));
+}
 
-	uw = &undoWindow;
-	uw->dot = cw->dot;
-	uw->dol = cw->dol;
-	memcpy(uw->labels, cw->labels, MARKLETTERS * sizeof(int));
-	uw->binMode = cw->binMode;
-	uw->nlMode = cw->nlMode;
-	uw->dirMode = cw->dirMode;
-	uw->dnoMode = cw->dnoMode;
-	if (cw->map) {
-		uw->map = allocMem((cw->dol + 2) * LMSIZE);
-		memcpy(uw->map, cw->map, (cw->dol + 2) * LMSIZE);
+/* The u command, and redo. */
+static bool undoStep(bool redo)
+{
+	struct undoStep *u, *inv;
+	if (!cw->undoable || !(redo ? redoLevels : undoLevels)) {
+		setError(redo ? MSG_NoRedo : MSG_NoUndo);
+		return false;
+	}
+	if (redo) {
+		u = redoStack + --redoLevels;
+		inv = undoStack + undoLevels++;
+	} else {
+		u = undoStack + --undoLevels;
+		inv = redoStack + redoLevels++;
 	}
+	undoApply(u, inv);
+	debugPrint(6, "%s, %d undo %d redo", (redo ? "redo" : "undo"),
+		   undoLevels, redoLevels);
+	if (cw->dot > cw->dol)
+		cw->dot = cw->dol;
+	return true;
 }
 
+static void loadForget(const Window *w);
+
 static void freeWindow(Window *w)
 {
 	Frame *f, *fnext;
 	struct histLabel *label, *lnext;
+	loadForget(w);
 	freeTags(w);
 	for (f = &w->f0; f; f = fnext) {
 		fnext = f->next;
@@ -1101,7 +1822,7 @@ bool cxQuit(int cx, int action)
 
 	if (cx == context) {
 /* Don't need to retain the undo lines. */
-		undoCompare();
+		undoClear();
 	}
 
 	if (action == 2)
@@ -1135,7 +1856,7 @@ void cxSwitch(int cx, bool interactive)
 	}
 
 	if (cw) {
-		undoCompare();
+		undoClear();
 		cw->undoable = false;
 	}
 	cw = nw;
@@ -1163,15 +1884,80 @@ void cxSwitch(int cx, bool interactive)
 
 static struct lineMap *newpiece;
 
+/*********************************************************************
+The position index for input fields in browse mode.
+cw->tagLines[tagno] is the line where input field tagno begins,
+that is, the line holding InternalCodeChar tagno <,
+or 0 if the field is not in the buffer.
+It is built in one pass over the buffer the first time a field is looked up,
+then addToMap and delText shift it as lines come and go.
+infReplace rewrites a field on the line where it is, so that line doesn't move.
+The other ways lines move around aren't tracked,
+so the index is a hint; locateTagInBuffer checks the line,
+and builds the index again if the field isn't there.
+*********************************************************************/
+
+static void tagLineSet(int tagno, int ln)
+{
+	int n = cw->tagLinesSize;
+	if (tagno >= n) {
+		cw->tagLinesSize = tagno + 1;
+		if (cw->tagLinesSize < cw->numTags)
+			cw->tagLinesSize = cw->numTags;
+		if (cw->tagLines)
+			cw->tagLines = reallocMem(cw->tagLines, cw->tagLinesSize * sizeof(int));
+		else
+			cw->tagLines = allocMem(cw->tagLinesSize * sizeof(int));
+		memset(cw->tagLines + n, 0, (cw->tagLinesSize - n) * sizeof(int));
+	}
+	cw->tagLines[tagno] = ln;
+}
+
+// record the input fields that begin on this line
+static void tagLinesScan(const struct lineMap *t, int ln)
+{
+	const char *p = (const char *)t->text, *e = p + t->len;
+	char *q;
+	int tagno;
+	while ((p = memchr(p, InternalCodeChar, e - p))) {
+		++p;
+		if (!isdigitByte(*p))
+			continue;
+		tagno = strtol(p, &q, 10);
+		if (*q == '<')
+			tagLineSet(tagno, ln);
+		p = q;
+	}
+}
+
+static void tagLinesBuild(void)
+{
+	int ln;
+	nzFree(cw->tagLines);
+	cw->tagLines = 0;
+	cw->tagLinesSize = 0;
+	tagLineSet(0, 0);
+	for (ln = 1; ln <= cw->dol; ++ln)
+		tagLinesScan(mapLine(cw->map, ln), ln);
+}
+
+// lines start through end are gone, and the lines after them move by delta
+static void tagLinesShift(int start, int end, int delta)
+{
+	int j, ln;
+	for (j = 0; j < cw->tagLinesSize; ++j) {
+		if ((ln = cw->tagLines[j]) < start)
+			continue;
+		cw->tagLines[j] = (ln <= end ? 0 : ln + delta);
+	}
+}
+
 /* Adjust the map of line numbers -- we have inserted text.
  * Also shift the downstream labels.
  * Pass the string containing the new line numbers, and the dest line number. */
 static int *nextLabel(int *label);
 void addToMap(int nlines, int destl)
 {
-	struct lineMap *newmap;
-	bool *newg;
-	int svdol = cw->dol;
 	int *label = NULL;
 
 	if (nlines == 0)
@@ -1189,50 +1975,29 @@ void addToMap(int nlines, int destl)
 		if (*label > destl)
 			*label += nlines;
 	}
+	if (cw->tagLines) {
+		int i;
+		tagLinesShift(destl + 1, destl, nlines);
+		for (i = 0; i < nlines; ++i)
+			tagLinesScan(newpiece + i, destl + 1 + i);
+	}
 	cw->dol += nlines;
 	if(!cw->ircoMode)
 		cw->dot = destl + nlines;
 	else if(!cw->dot) cw->dot = 1;
 
-	newmap = allocMem((cw->dol + 2) * LMSIZE);
-	if (destl)
-		memcpy(newmap, cw->map, (destl + 1) * LMSIZE);
-	else
-		memset(newmap, 0, LMSIZE);
-// insert new piece here
-	memcpy(newmap + destl + 1, newpiece, nlines * LMSIZE);
-// put on the last piece
-	if (destl < svdol)
-		memcpy(newmap + destl + nlines + 1, cw->map + destl + 1,
-		       (svdol - destl + 1) * LMSIZE);
-	else
-		memset(newmap + destl + nlines + 1, 0, LMSIZE);
-
-	nzFree(cw->map);
-	cw->map = newmap;
+	cw->map = mapInsert(cw->map, destl, newpiece, nlines);
 	free(newpiece);
 	newpiece = 0;
-
-	if(!gflag) return;
-// Next line is for g/pattern/ .w2@.
-// We have switched to session 2 to write the line. Now in addToMap, session 2.
-// gflag is still there, but it is for session 1.
-	if(gflag_w != cw) return;
-
-	newg = allocMem(cw->dol + 1);
-	if (destl)
-		memcpy(newg, gflag, destl + 1);
-	memset(newg + destl + 1, 0, nlines);
-	if (destl < svdol)
-		memcpy(newg + destl + nlines + 1, gflag + destl + 1,
-		       (svdol - destl));
-	free(gflag), gflag = newg;
+	undoSplice(destl + 1, nlines, 0, 0);
 }
 
 static int text2linemap(const pst inbuf, int length, bool *nlflag)
 {
 	int i, j, lines = 0;
 	struct lineMap *t;
+	struct lineSlab *slab;
+	size_t slab_used;
 
 	*nlflag = false;
 	if (!length)		// nothing to add
@@ -1251,6 +2016,8 @@ static int text2linemap(const pst inbuf, int length, bool *nlflag)
 	}
 
 	newpiece = t = allocZeroMem(lines * LMSIZE);
+	if (length >= SLABMIN)
+		goto slabs;
 	i = 0;
 	while (i < length) {	// another line
 		j = i;
@@ -1259,23 +2026,89 @@ static int text2linemap(const pst inbuf, int length, bool *nlflag)
 				break;
 		if (inbuf[i - 1] == '\n') {
 // normal line
-			t->text = allocMem(i - j);
+			t->text = allocMem(t->len = i - j);
 		} else {
 // last line with no nl
-			t->text = allocMem(i - j + 1);
+			t->text = allocMem(t->len = i - j + 1);
 			t->text[i - j] = '\n';
 		}
 		memcpy(t->text, inbuf + j, i - j);
 		++t;
 	}			// loop breaking inbuf into lines
 	return lines;
-}
 
-// Add a block of text into the buffer; uses text2linemap() and addToMap().
-bool addTextToBuffer(const pst inbuf, int length, int destl, bool showtrail)
+slabs:
+// Same as above, but pack the lines into slabs.
+	slab = 0;
+	i = 0;
+	while (i < length) {
+		j = i;
+		while (i < length)
+			if (inbuf[i++] == '\n')
+				break;
+// room for the line, and a newline if it doesn't have one
+		if (!slab || slab_used + (i - j) + 1 > slab->size) {
+			size_t size = length - j + 1;
+			if (size > SLABSIZE)
+				size = SLABSIZE;
+			if (size < (size_t)(i - j) + 1)
+				size = i - j + 1;
+			slab = slabNew(size);
+			slab_used = 0;
+		}
+		t->text = slab->base + slab_used;
+		t->len = i - j;
+		memcpy(t->text, inbuf + j, i - j);
+		if (inbuf[i - 1] != '\n')
+			t->text[i - j] = '\n', ++slab_used, ++t->len;
+		slab_used += i - j;
+		++slab->live;
+		++t;
+	}
+	return lines;
+}
+
+// Lines of a mapped file point into the mapping, see the slabs above.
+// If the last line has no newline, it has to be copied, to put one on.
+static int mapped2linemap(const pst inbuf, int length, struct lineSlab *slab,
+			  bool *nlflag)
+{
+	int lines = 0;
+	const uchar *s, *end = inbuf + length, *nl;
+	struct lineMap *t;
+
+// count the lines first, so the map is allocated once, at the right size;
+// memchr is vectorized in any decent C library
+	for (s = inbuf; s < end && (nl = memchr(s, '\n', end - s)); s = nl + 1)
+		++lines;
+	if (s < end)
+		++lines;
+	if (lines + cw->dol > MAXLINES)
+		i_printfExit(MSG_LineLimit);
+
+	*nlflag = false;
+	newpiece = t = allocZeroMem(lines * LMSIZE);
+	for (s = inbuf; s < end; ++t) {
+		nl = memchr(s, '\n', end - s);
+		if (nl) {
+			t->text = (pst) s;
+			t->len = nl + 1 - s;
+			++slab->live;
+			s = nl + 1;
+		} else {
+			t->len = end - s + 1;
+			t->text = allocMem(t->len);
+			memcpy(t->text, s, t->len - 1);
+			t->text[t->len - 1] = '\n';
+			*nlflag = true;
+			s = end;
+		}
+	}
+	return lines;
+}
+
+static bool addLinesToBuffer(int lines, bool nlflag, int destl, bool showtrail)
 {
-	bool nlflag;
-	int lines = text2linemap(inbuf, length, &nlflag);
 	if(!lines) return true;
 	if (destl == cw->dol)
 		cw->nlMode = false;
@@ -1288,6 +2121,14 @@ bool addTextToBuffer(const pst inbuf, int length, int destl, bool showtrail)
 	return true;
 }
 
+// Add a block of text into the buffer; uses text2linemap() and addToMap().
+bool addTextToBuffer(const pst inbuf, int length, int destl, bool showtrail)
+{
+	bool nlflag;
+	int lines = text2linemap(inbuf, length, &nlflag);
+	return addLinesToBuffer(lines, nlflag, destl, showtrail);
+}
+
 // Pass input lines straight into the buffer until the user enters .
 
 static bool inputLinesIntoBuffer(void)
@@ -1323,6 +2164,7 @@ static bool inputLinesIntoBuffer(void)
 				line = (uchar*)cloneString(".\n");
 		} else line = clonePstring(line);
 		t->text = line;
+		t->len = pstLength(line);
 		++t, ++linecount;
 		if(!inscript) line = inputLine();
 		else line = (uchar *)getInputLineFromScript();
@@ -1414,25 +2256,20 @@ void delText(int start, int end)
 	int i, ln;
 	int *label = NULL;
 
-// browse / sql / irc has no undo command.
-	if (cw->browseMode | cw->sqlMode | cw->ircoMode) {
-		for (ln = start; ln <= end; ++ln)
-			nzFree(cw->map[ln].text);
-	} else {
+// browse / sql / irc has no undo command, undoSplice() frees the lines.
+	if (!(cw->browseMode | cw->sqlMode | cw->ircoMode))
 		undoPush();
-	}
 
 	if (end == cw->dol)
 		cw->nlMode = false;
 	i = end - start + 1;
-	memmove(cw->map + start, cw->map + end + 1,
-		(cw->dol - end + 1) * LMSIZE);
+// by convention an empty buffer has no map, mapDelete takes care of that
+	undoSplice(start, 0, mapTakeOut(start, end), i);
 
 	if (cw->dirMode && cw->r_map) {
 // if you are looking at directories with ls-s or some such,
 // we have to delete the corresponding stat information.
-		memmove(cw->r_map + start, cw->r_map + end + 1,
-			(cw->dol - end + 1) * LMSIZE);
+		cw->r_map = mapDelete(cw->r_map, start, end);
 	}
 
 	if (cw->dirMode && cw->dmap && end < cw->dol) {
@@ -1440,10 +2277,6 @@ void delText(int start, int end)
 			(cw->dol - end) * DTSIZE);
 	}
 
-	if(gflag && end < cw->dol) {
-	memmove(gflag + start, gflag + end + 1, cw->dol - end);
-	}
-
 /* move the labels */
 	while ((label = nextLabel(label))) {
 		if ((ln = *label) < start)
@@ -1454,6 +2287,8 @@ void delText(int start, int end)
 		}
 		*label -= i;
 	}
+	if (cw->tagLines)
+		tagLinesShift(start, end, -i);
 
 	cw->dol -= i;
 	cw->dot = start;
@@ -1461,12 +2296,6 @@ void delText(int start, int end)
 		cw->dot = cw->dol;
 // by convention an empty buffer has no map
 	if (!cw->dol) {
-		free(cw->map);
-		cw->map = 0;
-		if (cw->dirMode && cw->r_map) {
-			free(cw->r_map);
-			cw->r_map = 0;
-		}
 		if (cw->dirMode && cw->dmap) {
 			free(cw->dmap);
 			cw->dmap = 0;
@@ -1481,26 +2310,26 @@ void delText(int start, int end)
 // if we were running d on each marked line.
 static bool delTextG(char action, int n, int back)
 {
-	int i, j, k;
+	int i, j, k, dol = cw->dol;
 	int *label;
-	struct lineMap *t;
+	struct lineMap *t, *lines;
 	bool rc = true;
 
 	debugPrint(3, "mass delete %d %d", back, n);
 
-	 t = cw->map + 1;
-	for(i = j = 1; i <= cw->dol; ++i, ++t) {
-		if(gflag[i] && rc && j - back <= 0) {
+	for(i = j = 1; i <= cw->dol; ++i) {
+		t = mapLine(cw->map, i);
+		if(t->gflag && rc && j - back <= 0) {
 			cw->dot = j;
 			setError(j - back < 0 ? MSG_LineLow : MSG_AtLine0);
 			rc = false;
 		}
-		if(gflag[i] && rc && i + n > cw->dol) {
+		if(t->gflag && rc && i + n > cw->dol) {
 			cw->dot = j;
 			setError(MSG_LineHigh);
 			rc = false;
 		}
-		if(gflag[i] && rc && i + n <= cw->dol) { // goodbye
+		if(t->gflag && rc && i + n <= cw->dol) { // goodbye
 		if(cw->dirMode) {
 // mass delete in directory mode is only deleting a single line.
 // Honestly what other kind of global delete would you ever do
@@ -1510,7 +2339,7 @@ static bool delTextG(char action, int n, int back)
 			cw->dot = j;
 		}
 	}
-		if(gflag[i] && rc && i + n <= cw->dol) {
+		if(t->gflag && rc && i + n <= cw->dol) {
 // did these lines have a label?
 			label = NULL;
 			while ((label = nextLabel(label)))
@@ -1520,7 +2349,14 @@ static bool delTextG(char action, int n, int back)
 			undoPush();
 			if(i + n == cw->dol)
 				cw->nlMode = false;
-			j -= back, i += n, t += n;
+// lines j-back through j-1 are already in place, then i through i+n
+			lines = allocMem((back + n + 1) * LMSIZE);
+			for(k = 0; k < back; ++k)
+				lines[k] = *mapLine(cw->map, j - back + k);
+			for(k = 0; k <= n; ++k)
+				lines[back + k] = *mapLine(cw->map, i + k);
+			undoSplice(j - back, 0, lines, back + n + 1);
+			j -= back, i += n;
 			cw->dot = j;
 			if(action == 'd') continue;
 			k = i + 1;
@@ -1531,7 +2367,7 @@ static bool delTextG(char action, int n, int back)
 			continue;
 		}
 		if(i > j) {
-			cw->map[j] = *t;
+			*mapLine(cw->map, j) = *t;
 			label = NULL;
 			while ((label = nextLabel(label)))
 				if(*label == i)
@@ -1540,17 +2376,13 @@ static bool delTextG(char action, int n, int back)
 		++j;
 	}
 
-// map of lines has to null terminate
-	cw->map[j] = *t;
+// lines from j on have all moved down, or were deleted
+	cw->map = mapDelete(cw->map, j, dol);
+	mapRecount(cw->map);
 
 	cw->dol = j - 1;
 	if (cw->dot > cw->dol)
 		cw->dot = cw->dol;
-// by convention an empty buffer has no map
-	if (!cw->dol) {
-		free(cw->map);
-		cw->map = 0;
-	}
 	return rc;
 }
 
@@ -1561,13 +2393,8 @@ static bool moveCopy(void)
 	int sr = startRange;
 	int er = endRange + 1;
 	int dl = destLine + 1;
-	int i_sr = sr * LMSIZE;	/* indexes into map */
-	int i_er = er * LMSIZE;
-	int i_dl = dl * LMSIZE;
 	int n_lines = er - sr;
-	struct lineMap *map = cw->map;
-	struct lineMap *newmap, *t;
-	bool *newg;
+	struct lineMap *piece, *t;
 	int lowcut, highcut, diff, i, ln;
 	int *label = NULL;
 
@@ -1588,9 +2415,14 @@ static bool moveCopy(void)
 	undoPush();
 
 	if (cmd == 't') {
+// the copies share text with the original lines
 		newpiece = t = allocZeroMem(n_lines * LMSIZE);
-		for (i = sr; i < er; ++i, ++t)
-			t->text = fetchLine(i, 0);
+		for (i = sr; i < er; ++i, ++t) {
+			*t = *mapLine(cw->map, i);
+			t->text = shareLine(t->text);
+// a copy is a new line, not marked by g//
+			t->gflag = false;
+		}
 		addToMap(n_lines, destLine);
 		return true;
 	}
@@ -1599,32 +2431,14 @@ static bool moveCopy(void)
 		cw->nlMode = false;
 
 // All we really need do is rearrange the map.
-	newmap = allocMem((cw->dol + 2) * LMSIZE);
-	memcpy(newmap, map, (cw->dol + 2) * LMSIZE);
-	if (dl < sr) {
-		memcpy(newmap + dl, map + sr, i_er - i_sr);
-		memcpy(newmap + dl + er - sr, map + dl, i_sr - i_dl);
-	} else {
-		memcpy(newmap + sr, map + er, i_dl - i_er);
-		memcpy(newmap + sr + dl - er, map + sr, i_er - i_sr);
-	}
-	free(cw->map);
-	cw->map = newmap;
-
-	if(gflag) {
-		newg = allocMem(cw->dol + 1);
-		memcpy(newg, gflag, cw->dol + 1);
-		if (dl < sr) {
-			memcpy(newg + dl, gflag + sr, er - sr);
-			memcpy(newg + dl + er - sr, gflag + dl, sr - dl);
-		} else {
-			memcpy(newg + sr, gflag + er, dl - er);
-			memcpy(newg + sr + dl - er, gflag + sr, er - sr);
-		}
-		free(gflag);
-		gflag = newg;
-	}
-	
+// Pull the block out, and put it back in after the destination line,
+// which has moved up by n_lines if it was past the block.
+	i = (dl < sr ? destLine : destLine - n_lines);
+	piece = mapTakeOut(sr, er - 1);
+	cw->map = mapInsert(cw->map, i, piece, n_lines);
+	free(piece);
+	undoMove(sr, n_lines, i);
+
 /* now for the labels */
 	if (dl < sr) {
 		lowcut = dl;
@@ -1672,13 +2486,13 @@ static bool joinText(const char *fs)
 	size = 0;
 
 	for (j = startRange; j <= endRange; ++j)
-		size += pstLength(fetchLine(j, -1)) + fslen - 1;
+		size += mapLine(cw->map, j)->len + fslen - 1;
 
 	t = newline = allocMem(size);
 	for (j = startRange; j <= endRange; ++j) {
-		pst p = fetchLine(j, -1);
-		size = pstLength(p);
-		memcpy(t, p, size);
+		const struct lineMap *p = mapLine(cw->map, j);
+		size = p->len;
+		memcpy(t, p->text, size);
 		t += size;
 		if (j == endRange) break;
 		--t;
@@ -1690,6 +2504,7 @@ static bool joinText(const char *fs)
 
 	newpiece = allocZeroMem(LMSIZE);
 	newpiece->text = newline;
+	newpiece->len = t - newline;
 	addToMap(1, startRange - 1);
 
 	cw->dot = startRange;
@@ -1701,10 +2516,10 @@ static bool joinText(const char *fs)
 // n+1 is number of lines to join.
 static bool joinTextG(char action, int n, int back, const char *fs)
 {
-	int i, j, k, size;
+	int i, j, k, size, dol = cw->dol;
 	int fslen; // length of field separator
 	int *label;
-	struct lineMap *t;
+	struct lineMap *t, *lines;
 	pst p1, p2, newline;
 	bool rc = true;
 
@@ -1719,26 +2534,26 @@ static bool joinTextG(char action, int n, int back, const char *fs)
 	fslen = strlen(fs);
 	if(action == 'j') fslen = 1;
 
-	 t = cw->map + 1;
-	for(i = j = 1; i <= cw->dol; ++i, ++t) {
+	for(i = j = 1; i <= cw->dol; ++i) {
+		t = mapLine(cw->map, i);
 		if(i > j) {
-			cw->map[j] = *t;
+			*mapLine(cw->map, j) = *t;
 			label = NULL;
 			while ((label = nextLabel(label)))
 				if(*label == i)
 					*label = j;
 		}
-		if(gflag[i] && rc && j - back <= 0) {
+		if(t->gflag && rc && j - back <= 0) {
 			cw->dot = j;
 			setError(j - back < 0 ? MSG_LineLow : MSG_AtLine0);
 			rc = false;
 		}
-		if(gflag[i] && rc && i + n > cw->dol) {
+		if(t->gflag && rc && i + n > cw->dol) {
 			cw->dot = j;
 			setError(MSG_EndJoin);
 			rc = false;
 		}
-		if(gflag[i] && rc && i + n <= cw->dol) { // join
+		if(t->gflag && rc && i + n <= cw->dol) { // join
 // did the next lines have a label?
 			label = NULL;
 			while ((label = nextLabel(label)))
@@ -1747,13 +2562,13 @@ static bool joinTextG(char action, int n, int back, const char *fs)
 					*label = 0;
 			undoPush();
 			for(k = size = 0; k <= n; ++k)
-				size += pstLength(fetchLine(i + k, -1)) + fslen - 1;
+				size += mapLine(cw->map, i + k)->len + fslen - 1;
 			for(k = 1; k <= back; ++k)
-				size += pstLength(fetchLine(j - k, -1)) + fslen - 1;
+				size += mapLine(cw->map, j - k)->len + fslen - 1;
 			newline = p2 = allocMem(size);
 			for(k = back; k > 0; --k) {
-				p1 = fetchLine(j - k, -1);
-				size = pstLength(p1);
+				t = mapLine(cw->map, j - k);
+				p1 = t->text, size = t->len;
 				memcpy(p2, p1, size);
 				p2 += size;
 				--p2;
@@ -1761,8 +2576,8 @@ static bool joinTextG(char action, int n, int back, const char *fs)
 					memcpy(p2, fs, fslen), p2 += fslen;
 			}
 			for(k = 0; k <= n; ++k) {
-				p1 = fetchLine(i + k, -1);
-				size = pstLength(p1);
+				t = mapLine(cw->map, i + k);
+				p1 = t->text, size = t->len;
 				memcpy(p2, p1, size);
 				p2 += size;
 				if(k == n) break;
@@ -1770,16 +2585,24 @@ static bool joinTextG(char action, int n, int back, const char *fs)
 				if(action == 'J')
 					memcpy(p2, fs, fslen), p2 += fslen;
 			}
+			lines = allocMem((back + n + 1) * LMSIZE);
+			for(k = 0; k < back; ++k)
+				lines[k] = *mapLine(cw->map, j - back + k);
+			for(k = 0; k <= n; ++k)
+				lines[back + k] = *mapLine(cw->map, i + k);
 			j -= back;
-			cw->map[j].text = newline;
+			t = mapLine(cw->map, j);
+			t->text = newline, t->len = p2 - newline;
+			undoSplice(j, 1, lines, back + n + 1);
 			cw->dot = j;
-			i += n, t += n; // skip past joined lines
+			i += n; // skip past joined lines
 		}
 		++j;
 	}
 
-// map of lines has to null terminate
-	cw->map[j] = *t;
+// lines from j on have all moved down, or were joined
+	cw->map = mapDelete(cw->map, j, dol);
+	mapRecount(cw->map);
 
 	cw->dol = j - 1;
 	if (cw->dot > cw->dol)
@@ -1787,6 +2610,307 @@ static bool joinTextG(char action, int n, int back, const char *fs)
 	return rc;
 }
 
+#define MAPMIN 0x1000000
+#define MAPPART 0x800000
+
+/*********************************************************************
+A file read by e, at the keyboard, is loaded in the background.
+The first part goes into the buffer right away, and you have your prompt;
+the other parts are added to the end of the buffer while edbrowse waits
+for your next command, see loadBackground().
+You can print, and even change, the lines loaded so far.
+A command that needs the whole file, like w, or one that runs to the end
+of the buffer, like ,d, waits for it to finish, see loadNeeded().
+Interrupt stops the load, and the buffer holds what was loaded.
+That buffer is marked changed, and w won't write it back over the file.
+Lines loaded in the background don't move the dot, and can't be undone,
+any more than the lines read in by e can be undone.
+The undo steps are still good, because they are all above these lines.
+The load belongs to a window, and stops for a while if you go to another
+window or session, or for good if the window goes away.
+*********************************************************************/
+
+static struct mapLoad {
+	Window *w;		// the window being loaded
+	uchar *base;		// the mapping
+	size_t size, off;	// off is where the next part begins
+	bool first;		// first part, for the charset checks
+	bool dots;		// progress dots on the current line
+} mload;
+
+// Put the next part of the mapped file into the current buffer.
+// In the foreground it goes after destl, like any text that is read;
+// in the background it is appended, with no undo and no change of dot.
+static bool mapPart(int destl, bool background)
+{
+	uchar *base = mload.base;
+	char *part = (char *)base + mload.off;
+	int partSize, lines;
+	bool isAllocated = false, nlflag, rc = true;
+	size_t n = mload.size - mload.off;
+
+// end the part on a line boundary
+	if (n > MAPPART) {
+		const uchar *nl = memchr(base + mload.off + MAPPART, '\n', n - MAPPART);
+		if (nl)
+			n = nl + 1 - (base + mload.off);
+	}
+	if (n >= 0x7fffff00) {
+		setError(MSG_BigFile);
+		return false;
+	}
+	mload.off += n;
+	partSize = n;
+
+	if (!looksBinary((uchar *) part, partSize)) {
+		diagnoseAndConvert(&part, &isAllocated, &partSize, mload.first, true);
+	} else if (binaryDetect & !cw->binMode) {
+		if(debugLevel >= 1)
+			i_puts(MSG_BinaryData);
+		cw->binMode = true;
+	}
+	mload.first = false;
+	if (!partSize)
+		return true;
+
+	if (isAllocated) {
+		lines = text2linemap((pst) part, partSize, &nlflag);
+		nzFree(part);
+	} else {
+// other slabs may have come and gone, and moved this one in the list
+		struct lineSlab *slab = slabFind(base);
+		lines = mapped2linemap((pst) part, partSize, slab, &nlflag);
+	}
+	if (!background)
+		return addLinesToBuffer(lines, nlflag, destl, true);
+	if (!lines)
+		return rc;
+	if (lines > MAXLINES - cw->dol)
+		i_printfExit(MSG_LineLimit);
+	cw->map = mapInsert(cw->map, cw->dol, newpiece, lines);
+	free(newpiece);
+	newpiece = 0;
+	cw->dol += lines;
+	cw->nlMode = nlflag;
+	if (nlflag && !cw->binMode)
+		i_puts(MSG_NoTrailing);
+	return rc;
+}
+
+// Let go of the mapping; the lines that point into it keep it alive.
+static void loadStop(void)
+{
+	struct lineSlab *slab;
+	if (!mload.base)
+		return;
+	slab = slabFind(mload.base);
+// the load held one count of its own
+	if (!--slab->live)
+		slabRemove(slab);
+	if (mload.dots)
+		putchar('\n');
+	debugPrint(3, "load stops at %lld of %lld",
+		   (long long)mload.off, (long long)mload.size);
+	memset(&mload, 0, sizeof(mload));
+}
+
+// The window is going away, and its load with it.
+static void loadForget(const Window *w)
+{
+	if (w == mload.w)
+		loadStop();
+}
+
+// dots or counts, as in a download
+static void loadProgress(size_t before)
+{
+	size_t dots1 = before / CHUNKSIZE, dots2 = mload.off / CHUNKSIZE;
+	if (showProgress == 'q' || dots1 == dots2)
+		return;
+	if (showProgress == 'd') {
+		for (; dots1 < dots2; ++dots1)
+			putchar('.');
+		mload.dots = true;
+	}
+	if (showProgress == 'c')
+		printf("%lld/%lld\n", (long long)dots2,
+		       (long long)((mload.size + CHUNKSIZE - 1) / CHUNKSIZE));
+	fflush(stdout);
+}
+
+// The load stopped short, the buffer is not the whole file.
+// Mark it changed, so you are warned before you quit,
+// and w won't write it back over the file, see runCommand().
+static void loadBreak(void)
+{
+	mload.w->changeMode = mload.w->partLoad = true;
+	loadStop();
+}
+
+// load the next part in the background, and stop at the end
+static bool loadStep(void)
+{
+	size_t before = mload.off;
+	bool rc = mapPart(cw->dol, true);
+	loadProgress(before);
+	if (!rc) {
+		showError();
+		loadBreak();
+		return false;
+	}
+	if (mload.off == mload.size) {
+		loadStop();
+		return false;
+	}
+	return true;
+}
+
+// Is a command waiting on stdin?
+static bool inputWaiting(void)
+{
+	fd_set channels;
+	struct timeval tv;
+	memset(&channels, 0, sizeof(channels));
+	FD_SET(0, &channels);
+	tv.tv_sec = tv.tv_usec = 0;
+	return select(1, &channels, 0, 0, &tv) != 0;
+}
+
+// Load the current buffer, a part at a time, until there is a command to run.
+void loadBackground(void)
+{
+	if (!mload.w || mload.w != cw)
+		return;
+	intFlag = false;
+	while (!inputWaiting()) {
+		if (intFlag) {
+			loadBreak();
+			i_puts(MSG_Interrupted);
+			break;
+		}
+		if (!loadStep())
+			break;
+	}
+	intFlag = false;
+// the command and its output start on a line of their own
+	if (mload.dots)
+		putchar('\n');
+	mload.dots = false;
+}
+
+// Finish the load, for a command that needs the whole file.
+static bool loadFinish(void)
+{
+	if (!mload.w || mload.w != cw)
+		return true;
+	debugPrint(3, "finishing load");
+	while (loadStep()) {
+		if (intFlag) {
+			loadBreak();
+			setError(MSG_Interrupted);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*********************************************************************
+Does this command need the whole file?
+It does if it runs to the end of the buffer, with $ or , or ;,
+or searches it, with /re/ or ?re?, since a search wraps around.
+w v g = r and sort run over the whole buffer, or after the last line,
+if there is no range in front of them.
+Another command, with no range, runs at the dot,
+and might be e or b, leaving this buffer, so it doesn't wait.
+*********************************************************************/
+
+static bool loadNeeded(const char *line)
+{
+	char c = *line;
+	if (!mload.w || mload.w != cw)
+		return false;
+// hit return for the next line, at the last line loaded so far
+	if (!c)
+		return (cw->dot == cw->dol);
+	if (strchr("wvgr=", c) || !strncmp(line, "sort", 4))
+		return true;
+	if (isalphaByte(c))
+		return false;
+	return (strpbrk(line, "$,;/?") != 0);
+}
+
+/*********************************************************************
+Read a large file by mapping it into memory, rather than copying it in.
+The lines point into the mapping, and a line is only copied when it changes,
+like any other line that lives in a slab.
+The file is taken in parts, as fdIntoMemory() would, and each part
+goes through the same binary and charset checks.
+A part that has to be converted is converted into allocated memory,
+and read in the usual way; the mapping only holds text that is unchanged,
+or changed in place, as when crlf becomes lf.
+If stream is set, only the first part is read here, and the rest is
+loaded in the background, as described above.
+Return -1 if this file isn't a candidate, and the caller reads it as before,
+0 for an error, and 1 if the file is in the buffer.
+*********************************************************************/
+
+static int readMapped(const char *filename, bool stream)
+{
+	struct stat st;
+	struct lineSlab *slab;
+	uchar *base;
+	size_t size;
+	bool rc = true;
+	int fd = open(filename, O_RDONLY | O_BINARY);
+
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < MAPMIN) {
+		close(fd);
+		return -1;
+	}
+	size = st.st_size;
+	base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+// 16 or 32 bit characters have to be converted all at once, not in parts.
+	if (byteOrderMark(base, (size > 4 ? 4 : size))) {
+		munmap(base, size);
+		return -1;
+	}
+#ifdef MADV_SEQUENTIAL
+	madvise(base, size, MADV_SEQUENTIAL);
+#endif
+// one load at a time
+	loadStop();
+	slab = slabInsert(base, size);
+	slab->mapped = true;
+	slab->dev = st.st_dev, slab->ino = st.st_ino;
+// the load holds the slab until it is done
+	++slab->live;
+	debugPrint(3, "mapping %lld bytes", (long long)size);
+
+	fileSize = size;
+	mload.w = cw;
+	mload.base = base;
+	mload.size = size;
+	mload.off = 0;
+	mload.first = true;
+	while (mload.off < size && rc) {
+		rc = mapPart(endRange, false);
+		endRange = cw->dot;
+		if (stream && cw->dol)
+			break;
+	}
+
+	if (!rc || mload.off == size)
+		loadStop();
+	else
+		debugPrint(3, "loading in the background");
+	return rc;
+}
+
 // Read a file, or url, into the current buffer.
 static bool readFile(const char *filename, bool newwin,
 		     int fromframe, const char *fromthis, const char *orig_head)
@@ -2050,6 +3174,18 @@ badfile:
 		rbuf = findHash(nopound);
 		if (rbuf && !filetype)
 			*rbuf = 0;
+// A big file that we are going to edit can be mapped, rather than read.
+// From the keyboard, e loads it in the background.
+		if (!fromframe && cmd != 'b') {
+			int mrc = readMapped(nopound, (newwin && cmd == 'e'
+						       && isInteractive && !inscript));
+			if (mrc >= 0) {
+				free(nopound);
+				if (!mrc)
+					goto badfile;
+				return true;
+			}
+		}
 		inparts = 1, fileSize = 0;
 // set inparts to 0 if you don't want this feature or if it causes trouble
 nextpart:
@@ -2124,13 +3260,154 @@ static char *skipFileProtocol(const char *name)
 return (char *) name;
 }
 
+/*********************************************************************
+Write the buffer out a block at a time.
+Short lines are copied into a block, and the block goes out in one write.
+A long line is not copied; it goes to writev straight out of the buffer,
+along with the block before it.
+A line that is converted, to iso8859 or utf8 or utf16 or whatever,
+is copied into a block with the lines around it,
+and the block is converted all at once, in scratch space that is kept
+from one write to the next; lines end in newline, so converting a block
+is the same as converting its lines one by one.
+Text that doesn't stay put, like a directory suffix, is copied as well.
+*********************************************************************/
+
+#define WBLOCK 0x100000
+#define WIOV 256
+// lines at least this long are not copied
+#define WLONG 1024
+
+static struct fileWriter {
+	int fd;
+	char convert;		// 'i' to iso8859, 'u' to utf8, 'h' utf16 or utf32
+	bool bad;		// a write failed
+	int niov;
+	struct iovec iov[WIOV];
+	char *block;		// copied text, waiting to be written or converted
+	int blocklen, blocksize;
+	char *conv;		// the converted block
+	int convsize;
+} wr;
+
+static void wrOut(const char *p, size_t n)
+{
+	while (n && !wr.bad) {
+		ssize_t k = write(wr.fd, p, n);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k <= 0) {
+			wr.bad = true;
+			break;
+		}
+		p += k, n -= k;
+		fileSize += k;
+	}
+}
+
+static void wrFlush(void)
+{
+	struct iovec *v = wr.iov;
+	int n = wr.niov;
+
+	if (wr.convert && wr.blocklen) {
+		int need = wr.blocklen * (wr.convert == 'i' ? 1 : 4) + 1;
+		int len;
+		if (need > wr.convsize) {
+			nzFree(wr.conv);
+			wr.convsize = need;
+			wr.conv = allocMem(need);
+		}
+		if (wr.convert == 'i')
+			len = utf2isoTo((uchar *) wr.block, wr.blocklen,
+					(uchar *) wr.conv);
+		else if (wr.convert == 'u')
+			len = iso2utfTo((uchar *) wr.block, wr.blocklen,
+					(uchar *) wr.conv);
+		else
+			len = utfHighTo(wr.block, wr.blocklen, wr.conv,
+					cons_utf8, cw->utf32Mode, cw->bigMode);
+		wrOut(wr.conv, len);
+	}
+
+	while (n && !wr.bad) {
+		ssize_t k = writev(wr.fd, v, n);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k <= 0) {
+			wr.bad = true;
+			break;
+		}
+		fileSize += k;
+// skip past what was written, perhaps part way into an iovec
+		while (n && (size_t)k >= v->iov_len)
+			k -= v->iov_len, ++v, --n;
+		if (n)
+			v->iov_base = (char *)v->iov_base + k, v->iov_len -= k;
+	}
+	wr.niov = wr.blocklen = 0;
+}
+
+// Add text to the output; if it stays put until the write is done,
+// it need not be copied.
+static void wrAdd(const char *p, int len, bool stays)
+{
+	if (!len)
+		return;
+	if (wr.niov == WIOV)
+		wrFlush();
+	if (stays && !wr.convert && len >= WLONG) {
+		wr.iov[wr.niov].iov_base = (char *)p;
+		wr.iov[wr.niov].iov_len = len;
+		++wr.niov;
+		return;
+	}
+// copy it; the block can't move while iovecs point into it
+	if (wr.blocklen + len > wr.blocksize && wr.blocklen)
+		wrFlush();
+	if (len > wr.blocksize) {
+		nzFree(wr.block);
+		wr.blocksize = (len > WBLOCK ? len : WBLOCK);
+		wr.block = allocMem(wr.blocksize);
+	}
+	memcpy(wr.block + wr.blocklen, p, len);
+	if (!wr.convert) {
+// consecutive copies are one iovec
+		struct iovec *v = wr.iov + wr.niov - 1;
+		if (wr.niov && (char *)v->iov_base + v->iov_len ==
+		    wr.block + wr.blocklen)
+			v->iov_len += len;
+		else {
+			++v, ++wr.niov;
+			v->iov_base = wr.block + wr.blocklen;
+			v->iov_len = len;
+		}
+	}
+	wr.blocklen += len;
+}
+
+// Write to a temp file in the same directory, and rename it over the file
+// when it is complete. Only for a regular file, or a new file.
+static bool wrTempOk(const char *name, struct stat *st, bool *exists)
+{
+	*exists = false;
+	if (!lstat(name, st)) {
+		if (!S_ISREG(st->st_mode) || st->st_nlink > 1)
+			return false;
+		*exists = true;
+	} else if (errno != ENOENT)
+		return false;
+	return true;
+}
+
 /* Write a range to a file. */
 bool writeFile(const char *name, int mode)
 {
 	int i;
-	FILE *fh;
-	char *modeString;
-	int modeString_l;
+	int oflags = O_WRONLY | O_CREAT;
+	char *tempname = 0;
+	struct stat st;
+	bool exists;
 
 	fileSize = -1;
 
@@ -2162,48 +3439,66 @@ bool writeFile(const char *name, int mode)
 	}
 
 /* mode should be TRUNC or APPEND */
-	modeString = initString(&modeString_l);
-	if (mode & O_APPEND)
-		stringAndChar(&modeString, &modeString_l, 'a');
-	else
-		stringAndChar(&modeString, &modeString_l, 'w');
+	oflags |= (mode & O_APPEND) ? O_APPEND : O_TRUNC;
 	if (cw->binMode | cw->utf16Mode | cw->utf32Mode)
-		stringAndChar(&modeString, &modeString_l, 'b');
-
-	fh = fopen(name, modeString);
-	nzFree(modeString);
-	if (fh == NULL) {
-		setError(MSG_NoCreate2, name);
-		return false;
+		oflags |= O_BINARY;
+
+	wr.convert = 0, wr.bad = false;
+	wr.niov = wr.blocklen = 0;
+	if (writeTemp && !(mode & O_APPEND) && wrTempOk(name, &st, &exists)) {
+		int um;
+		tempname = allocMem(strlen(name) + 8);
+		sprintf(tempname, "%s.XXXXXX", name);
+		wr.fd = mkstemp(tempname);
+		if (wr.fd < 0) {
+			setError(MSG_NoCreate2, tempname);
+			nzFree(tempname);
+			return false;
+		}
+// mkstemp makes it private; give it the mode the file has, or would have
+		if (!exists) {
+			um = umask(0);
+			umask(um);
+			st.st_mode = 0666 & ~um;
+		}
+		fchmod(wr.fd, st.st_mode & 07777);
+	} else {
+// truncating a file that is mapped would pull the lines out from under us;
+// renaming a new file over it would not
+		if (!(mode & O_APPEND))
+			unmapFile(name);
+		wr.fd = open(name, oflags, MODE_rw);
+		if (wr.fd < 0) {
+			setError(MSG_NoCreate2, name);
+			return false;
+		}
 	}
+
 // If writing to the same file and converting, print message,
 // and perhaps write the byte order mark.
 	if (name == cf->fileName && iuConvert) {
-		if (cw->iso8859Mode && cons_utf8)
+		if (cw->iso8859Mode && cons_utf8) {
 			if (debugLevel >= 1)
 				i_puts(MSG_Conv8859);
-		if (cw->utf8Mode && !cons_utf8)
+			wr.convert = 'i';
+		}
+		if (cw->utf8Mode && !cons_utf8) {
 			if (debugLevel >= 1)
 				i_puts(MSG_ConvUtf8);
+			wr.convert = 'u';
+		}
 		if (cw->utf16Mode) {
 			if (debugLevel >= 1)
 				i_puts(MSG_ConvUtf16);
-			if (fwrite
-			    ((cw->bigMode ? "\xfe\xff" : "\xff\xfe"), 2, 1,
-			     fh) <= 0) {
-badwrite:
-				setError(MSG_NoWrite2, name);
-				fclose(fh);
-				return false;
-			}
+			wrOut((cw->bigMode ? "\xfe\xff" : "\xff\xfe"), 2);
+			wr.convert = 'h';
 		}
 		if (cw->utf32Mode) {
 			if (debugLevel >= 1)
 				i_puts(MSG_ConvUtf32);
-			if (fwrite
-			    ((cw->bigMode ? "\x00\x00\xfe\xff" :
-			      "\xff\xfe\x00\x00"), 4, 1, fh) <= 0)
-				goto badwrite;
+			wrOut((cw->bigMode ? "\x00\x00\xfe\xff" :
+			       "\xff\xfe\x00\x00"), 4);
+			wr.convert = 'h';
 		}
 		if (cw->dosMode && debugLevel >= 1)
 			i_puts(MSG_ConvDos);
@@ -2211,160 +3506,120 @@ badwrite:
 
 // special code for empty file
 	fileSize = 0;
-	if(startRange == 0) {
-		fclose(fh);
-		cw->changeMode = false;
-		return true;
-	}
+	if(startRange == 0 || wr.bad)
+		goto done;
 
-	for (i = startRange; i <= endRange; ++i) {
+	for (i = startRange; i <= endRange && !wr.bad; ++i) {
 		pst p = fetchLine(i, (cw->browseMode ? 1 : -1));
-		int len = pstLength(p);
-		char *suf = dirSuffix(i);
-		char *tp;
-		int tlen;
-		bool alloc_p = cw->browseMode;
-		bool rc = true;
+// browsing takes out the hidden numbers, and the length changes
+		int len = (cw->browseMode ? pstLength(p) : mapLine(cw->map, i)->len);
+// a browsed line is allocated, and gone as soon as we're done with it
+		bool stays = !cw->browseMode;
 
 		if (!cw->dirMode) {
 			if (i == cw->dol && cw->nlMode)
 				--len;
-
-			if (name == cf->fileName && iuConvert) {
-				if (cw->dosMode && len && p[len - 1] == '\n') {
 // dos mode should not be set with utf16 or utf32; I hope.
-					tp = allocMem(len + 2);
-					memcpy(tp, p, len - 1);
-					memcpy(tp + len - 1, "\r\n", 3);
-					if (alloc_p)
-						free(p);
-					alloc_p = true;
-					p = (pst) tp;
-					++len;
-				}
-
-				if (cw->iso8859Mode && cons_utf8) {
-					utf2iso((uchar *) p, len,
-						(uchar **) & tp, &tlen);
-					if (alloc_p)
-						free(p);
-					alloc_p = true;
-					p = (pst) tp;
-					if (fwrite(p, tlen, 1, fh) <= 0)
-						rc = false;
-					len = tlen;
-					goto endline;
-				}
-
-				if (cw->utf8Mode && !cons_utf8) {
-					iso2utf((uchar *) p, len,
-						(uchar **) & tp, &tlen);
-					if (alloc_p)
-						free(p);
-					alloc_p = true;
-					p = (pst) tp;
-					if (fwrite(p, tlen, 1, fh) <= 0)
-						rc = false;
-					len = tlen;
-					goto endline;
-				}
-
-				if (cw->utf16Mode || cw->utf32Mode) {
-					utfHigh((char *)p, len, &tp, &tlen,
-						cons_utf8, cw->utf32Mode,
-						cw->bigMode);
-					if (alloc_p)
-						free(p);
-					alloc_p = true;
-					p = (pst) tp;
-					if (fwrite(p, tlen, 1, fh) <= 0)
-						rc = false;
-					len = tlen;
-					goto endline;
-				}
-			}
-
-			if (fwrite(p, len, 1, fh) <= 0)
-				rc = false;
-			goto endline;
-		}
-
+			if (name == cf->fileName && iuConvert &&
+			    cw->dosMode && len && p[len - 1] == '\n') {
+				wrAdd((char *)p, len - 1, stays);
+				wrAdd("\r\n", 2, true);
+			} else
+				wrAdd((char *)p, len, stays);
+		} else {
 /* Write this line with directory suffix, and possibly attributes */
-		--len;
-		if (fwrite(p, len, 1, fh) <= 0) {
-badline:
-			rc = false;
-			goto endline;
-		}
-		fileSize += len;
-
-		if (cw->r_map) {
-			int l;
+			char *suf = dirSuffix(i);
+			wrAdd((char *)p, len - 1, stays);
+			wrAdd(suf, strlen(suf), false);
+			if (cw->r_map) {
 /* extra ls stats to write */
-			char *extra;
-			len = strlen(suf);
-			if (len && fwrite(suf, len, 1, fh) <= 0)
-				goto badline;
-			++len;	/* for nl */
-			extra = (char *)cw->r_map[i].text;
-			l = strlen(extra);
-			if (l) {
-				if (fwrite(" ", 1, 1, fh) <= 0)
-					goto badline;
-				++len;
-				if (fwrite(extra, l, 1, fh) <= 0)
-					goto badline;
-				len += l;
+				char *extra = (char *)mapLine(cw->r_map, i)->text;
+				if (*extra) {
+					wrAdd(" ", 1, true);
+					wrAdd(extra, strlen(extra), true);
+				}
 			}
-			if (fwrite("\n", 1, 1, fh) <= 0)
-				goto badline;
-			goto endline;
+			wrAdd("\n", 1, true);
 		}
-
-		strcat(suf, "\n");
-		len = strlen(suf);
-		if (fwrite(suf, len, 1, fh) <= 0)
-			goto badline;
-
-endline:
-		if (alloc_p)
+		if (!stays)
 			free(p);
-		if (!rc)
-			goto badwrite;
-		fileSize += len;
 	} // loop over lines
+	wrFlush();
 
-	fclose(fh);
+done:
+	if (tempname && !wr.bad && fsync(wr.fd))
+		wr.bad = true;
+	if (close(wr.fd))
+		wr.bad = true;
+	if (tempname) {
+		if (!wr.bad && rename(tempname, name)) {
+			setError(MSG_NoRename, name);
+			unlink(tempname);
+			nzFree(tempname);
+			return false;
+		}
+		if (wr.bad)
+			unlink(tempname);
+		nzFree(tempname);
+	}
+	if (wr.bad) {
+		setError(MSG_NoWrite2, name);
+		return false;
+	}
 /* This is not an undoable operation, nor does it change data.
  * In fact the data is "no longer modified" if we have written all of it. */
-	if (startRange == 1 && endRange == cw->dol)
+	if (startRange == 0 || (startRange == 1 && endRange == cw->dol))
 		cw->changeMode = false;
 	return true;
 }
 
-static int readContext0(int entry, int cx, int readLine1, int readLine2)
+/*********************************************************************
+Lines from through to of session cx, for another buffer, as in r 3 or w+2.
+The text is shared with the lines in session cx, see shareLine(),
+rather than copied, so reading in a large buffer costs a pointer per line.
+Neither side changes shared text in place; an edit builds a new line,
+so the line is copied when, and only if, one side changes it.
+A browse line with hidden numbers has to be copied, to take them out,
+and a directory line is built with its suffix.
+The bytes are added to fileSize.
+*********************************************************************/
+
+static void shareLines(int cx, int from, int to, struct lineMap *dest)
 {
 	Window *lw = sessionList[cx].lw;
-	int i, fardol = lw->dol, lines;
-	struct lineMap *t;
-	bool at_the_end = cw->dol == entry;
-	fileSize = 0;
-	if (!fardol)
-		return 0;
-	if(at_the_end)
-		cw->nlMode = false;
-	if(readLine1 < 0)
-		readLine1 = 1, readLine2 = fardol;
-	lines = readLine2 + 1 - readLine1;
-	newpiece = t = allocZeroMem(lines * LMSIZE);
-	for (i = readLine1; i <= readLine2; ++i, ++t) {
-		pst p = fetchLineContext(i, (lw->dirMode ? -1 : 1), cx);
-		int len = pstLength(p);
-		if (lw->dirMode) {
+	struct lineMap *t = dest;
+	int i, len;
+	pst p;
+
+	if (!lw->dirMode && !lw->browseMode) {
+		mapCopyOut(lw->map, from, to, dest);
+		for (i = from; i <= to; ++i, ++t) {
+			t->text = shareLine(t->text);
+			t->gflag = false;
+			fileSize += t->len;
+		}
+		return;
+	}
+
+	for (i = from; i <= to; ++i, ++t) {
+		const struct lineMap *s = mapLine(lw->map, i);
+		p = s->text, len = s->len;
+		if (lw->browseMode) {
+			if (memchr(p, InternalCodeChar, len)) {
+// the hidden numbers refer to the tags of that window
+				Window *save_cw = cw;
+				p = clonePstring(p);
+				cw = lw;
+				removeHiddenNumbers(p, '\n');
+				cw = save_cw;
+				len = pstLength(p);
+			} else
+				p = shareLine(p);
+		} else {
 			char *suf = dirSuffixContext(i, cx);
 			char *q;
 			if (lw->r_map) {
-				char *extra = (char *)lw->r_map[i].text;
+				char *extra = (char *)mapLine(lw->r_map, i)->text;
 				int elen = strlen(extra);
 				q = allocMem(len + 4 + elen);
 				memcpy(q, p, len);
@@ -2385,9 +3640,26 @@ static int readContext0(int entry, int cx, int readLine1, int readLine2)
 			len = strlen(q);
 			p = (pst) q;
 		}
-		t->text = p;
+		t->text = p, t->len = len;
 		fileSize += len;
-	}			// loop over lines in the other context
+	}
+}
+
+static int readContext0(int entry, int cx, int readLine1, int readLine2)
+{
+	Window *lw = sessionList[cx].lw;
+	int fardol = lw->dol, lines;
+	bool at_the_end = cw->dol == entry;
+	fileSize = 0;
+	if (!fardol)
+		return 0;
+	if(at_the_end)
+		cw->nlMode = false;
+	if(readLine1 < 0)
+		readLine1 = 1, readLine2 = fardol;
+	lines = readLine2 + 1 - readLine1;
+	newpiece = allocZeroMem(lines * LMSIZE);
+	shareLines(cx, readLine1, readLine2, newpiece);
 	if (lw->nlMode && readLine2 == lw->dol) {
 		--fileSize;
 		if (at_the_end)
@@ -2425,9 +3697,8 @@ static void readContextG(int cx, int readLine1, int readLine2)
 	debugPrint(3, "mass read  %d %d %d %d", cx, readLine1, readLine2, fardol);
 
 	g_count = g_last = 0;
-	 t = cw->map + 1;
-	for(i = 1; i <= cw->dol; ++i, ++t)
-		if(gflag[i]) ++g_count, g_last = i;
+	for(i = 1; i <= cw->dol; ++i)
+		if(mapLine(cw->map, i)->gflag) ++g_count, g_last = i;
 
 // reading from an empty buffer changes nothing
 	if(!fardol) {
@@ -2440,10 +3711,9 @@ static void readContextG(int cx, int readLine1, int readLine2)
 		readLine1 = 1, readLine2 = fardol;
 	lines = readLine2 + 1 - readLine1;
 
-	newmap = allocMem(LMSIZE * (cw->dol + 2 + lines * g_count));
-	 t = cw->map;
-	*newmap = *t++;
-	for(i = j = 1; i <= cw->dol; ++i, ++t) {
+	newmap = allocMem(LMSIZE * (cw->dol + 1 + lines * g_count));
+	for(i = j = 1; i <= cw->dol; ++i) {
+		t = mapLine(cw->map, i);
 		newmap[j] = *t;
 		if(i > j) {
 			label = NULL;
@@ -2451,29 +3721,27 @@ static void readContextG(int cx, int readLine1, int readLine2)
 				if(*label == i)
 					*label = j;
 		}
-		if(gflag[i]) { // read
+		if(t->gflag) { // read
 			undoPush();
 			readContext0(i, cx, readLine1, readLine2);
 			memcpy(newmap + j + 1, newpiece, LMSIZE*lines);
 			free(newpiece), newpiece = 0;
+			undoSplice(j + 1, lines, 0, 0);
 			j += lines;
 			cw->dot = j;
 		}
 		++j;
 	}
 
-// map of lines has to null terminate
-	newmap[j] = *t;
-	free(cw->map), cw->map = newmap;
+	mapFree(cw->map);
+	cw->map = mapCreate(newmap + 1, j - 1);
+	free(newmap);
 	cw->dol = j - 1;
 }
 
 static bool writeContext(int cx, int writeLine)
 {
 	Window *lw, *save_cw;
-	int i, len;
-	struct lineMap *t;
-	pst p;
 	int fardol = endRange - startRange + 1;
 	bool at_the_end, lost_nl;
 
@@ -2492,41 +3760,13 @@ static bool writeContext(int cx, int writeLine)
 	if (!startRange) {
 // just blowing away the buffer with emptiness.
 		lw->dot = lw->dol = 0;
+		freeWindowLines(lw->map);
+		lw->map = 0;
 		return true;
 	}
 
-	newpiece = t = allocZeroMem(fardol * LMSIZE);
-	for (i = startRange; i <= endRange; ++i, ++t) {
-		p = fetchLine(i, (cw->dirMode ? -1 : 1));
-		len = pstLength(p);
-		if (cw->dirMode) {
-			char *q;
-			char *suf = dirSuffix(i);
-			if (cw->r_map) {
-				char *extra = (char *)cw->r_map[i].text;
-				int elen = strlen(extra);
-				q = allocMem(len + 4 + elen);
-				memcpy(q, p, len);
-				--len;
-				strcpy(q + len, suf);
-				if (elen) {
-					strcat(q, " ");
-					strcat(q, extra);
-				}
-				strcat(q, "\n");
-			} else {
-				q = allocMem(len + 3);
-				memcpy(q, p, len);
-				--len;
-				strcat(suf, "\n");
-				strcpy(q + len, suf);
-			}
-			len = strlen(q);
-			p = (pst) q;
-		}
-		t->text = p;
-		fileSize += len;
-	}
+	newpiece = allocZeroMem(fardol * LMSIZE);
+	shareLines(context, startRange, endRange, newpiece);
 
 	fileSize -= lost_nl;
 
@@ -3050,6 +4290,208 @@ regexpCheck(const char *line, bool isleft,
 	return true;
 }
 
+/*********************************************************************
+The trigram index, turned on for a buffer by the tri command.
+Each chunk of the map can carry an index of the three byte sequences
+in its lines: the distinct trigrams in order, and for each one,
+the lines of the chunk that hold it, as offsets into the chunk.
+Offsets don't change when lines come and go in other chunks,
+so an edit only costs the index of the chunk it touches;
+the map code drops that index, see mapDirty(), and it is built again
+between commands, or by the next search that reaches it.
+Letters are folded to lower case, so one index serves caseless searches.
+A search finds the trigrams that a matching line must contain,
+see regexpTrigrams(), and only the lines that have them all go to pcre.
+Lines of TRILONG bytes or more are not indexed; they always go to pcre.
+A line that is passed over is not checked for bad utf8 either.
+*********************************************************************/
+
+#define TRILONG 4096
+#define TRILINES (2 * MAPCHUNK)	// the most lines in a chunk
+#define TRIPATTERN 12		// trigrams taken from a pattern
+
+struct triChunk {
+	int nkeys, nlong;
+	unsigned *keys;		// distinct trigrams, in order
+	int *start;		// keys[i] is in lines offs[start[i]] up to offs[start[i+1]]
+	ushort *offs;
+	ushort *longs;		// lines too long to index
+};
+
+#define triFold(c) ((c) >= 'A' && (c) <= 'Z' ? (c) | 0x20 : (c))
+
+static unsigned triKey(const uchar *s)
+{
+	return (unsigned)triFold(s[0]) << 16 | (unsigned)triFold(s[1]) << 8 |
+	    triFold(s[2]);
+}
+
+static void triBuild(struct mapChunk *c)
+{
+	static int cnt[0x1000];
+	unsigned long long *e, *e2, *swap;
+	struct triChunk *t;
+	int i, j, n = 0, nkeys = 0, npost = 0, nlong = 0, shift;
+
+	for (i = 0; i < c->count; ++i) {
+		int len = c->lines[i].len - 1;
+		if (len >= TRILONG)
+			++nlong;
+		else if (len >= 3)
+			n += len - 2;
+	}
+	e = allocMem((2 * n + 1) * sizeof(unsigned long long));
+	e2 = e + n;
+// trigram above, line below, so the entries start out in line order
+	for (i = n = 0; i < c->count; ++i) {
+		const uchar *s = c->lines[i].text;
+		int len = c->lines[i].len - 1;
+		if (len >= TRILONG)
+			continue;
+		for (j = 0; j + 3 <= len; ++j)
+			e[n++] = (unsigned long long)triKey(s + j) << 12 | i;
+	}
+// radix sort on the trigram, 12 bits at a time; being stable,
+// it leaves the lines in order under each trigram.
+	for (shift = 12; shift <= 24; shift += 12) {
+		int sum = 0;
+		memset(cnt, 0, sizeof(cnt));
+		for (j = 0; j < n; ++j)
+			++cnt[(e[j] >> shift) & 0xfff];
+		for (i = 0; i < 0x1000; ++i) {
+			int k = cnt[i];
+			cnt[i] = sum, sum += k;
+		}
+		for (j = 0; j < n; ++j)
+			e2[cnt[(e[j] >> shift) & 0xfff]++] = e[j];
+		swap = e, e = e2, e2 = swap;
+	}
+// two passes, so the result is back where it started
+
+	for (j = 0; j < n; ++j) {
+		if (j && e[j] == e[j - 1])
+			continue;
+		++npost;
+		if (!j || e[j] >> 12 != e[j - 1] >> 12)
+			++nkeys;
+	}
+	t = allocMem(sizeof(struct triChunk) + nkeys * sizeof(unsigned) +
+		     (nkeys + 1) * sizeof(int) +
+		     (npost + nlong) * sizeof(ushort));
+	t->nkeys = nkeys, t->nlong = nlong;
+	t->keys = (unsigned *)(t + 1);
+	t->start = (int *)(t->keys + nkeys);
+	t->offs = (ushort *)(t->start + nkeys + 1);
+	t->longs = t->offs + npost;
+	nkeys = npost = 0;
+	for (j = 0; j < n; ++j) {
+		if (j && e[j] == e[j - 1])
+			continue;
+		if (!j || e[j] >> 12 != e[j - 1] >> 12) {
+			t->keys[nkeys] = e[j] >> 12;
+			t->start[nkeys++] = npost;
+		}
+		t->offs[npost++] = e[j] & 0xfff;
+	}
+	t->start[nkeys] = npost;
+	for (i = nlong = 0; i < c->count; ++i)
+		if (c->lines[i].len - 1 >= TRILONG)
+			t->longs[nlong++] = i;
+	free(e);
+	nzFree(c->tri);
+	c->tri = t;
+}
+
+// Set a bit for each line of chunk c that has all ntri of these trigrams,
+// and return the number of lines so marked.
+// A chunk with no index, or no trigrams, can't rule anything out.
+static int triCandidates(const struct mapChunk *c, const unsigned *tri,
+			 int ntri, uchar *bits)
+{
+	const struct triChunk *t = c->tri;
+	const ushort *list[TRIPATTERN];
+	int len[TRIPATTERN];
+	ushort cand[TRILINES];
+	int i, j, k, nc = 0;
+
+	if (!t || ntri <= 0) {
+		memset(bits, 0xff, (c->count + 7) / 8);
+		return c->count;
+	}
+	memset(bits, 0, (c->count + 7) / 8);
+	for (i = k = 0; i < ntri; ++i) {
+		int lo = 0, hi = t->nkeys;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (t->keys[mid] < tri[i])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == t->nkeys || t->keys[lo] != tri[i])
+			goto longs;
+		list[i] = t->offs + t->start[lo];
+		len[i] = t->start[lo + 1] - t->start[lo];
+		if (len[i] < len[k])
+			k = i;
+	}
+
+// start with the shortest list and whittle it down
+	nc = len[k];
+	memcpy(cand, list[k], nc * sizeof(ushort));
+	for (i = 0; i < ntri && nc; ++i) {
+		int m = 0, p = 0;
+		if (i == k)
+			continue;
+		for (j = 0; j < nc; ++j) {
+			while (p < len[i] && list[i][p] < cand[j])
+				++p;
+			if (p == len[i])
+				break;
+			if (list[i][p] == cand[j])
+				cand[m++] = cand[j];
+		}
+		nc = m;
+	}
+	for (j = 0; j < nc; ++j)
+		bits[cand[j] >> 3] |= 1 << (cand[j] & 7);
+
+longs:
+	for (j = 0; j < t->nlong; ++j)
+		bits[t->longs[j] >> 3] |= 1 << (t->longs[j] & 7);
+	return nc + t->nlong;
+}
+
+// Index the chunks that hold lines from through to, if they aren't already.
+static void triReady(int from, int to)
+{
+	struct bufMap *m = cw->map;
+	int k;
+	for (k = mapFind(m, from); k < m->nchunks && m->chunks[k].start <= to;
+	     ++k)
+		if (!m->chunks[k].tri)
+			triBuild(m->chunks + k);
+}
+
+// Index the current buffer a chunk at a time, until there is a command to run.
+void indexBackground(void)
+{
+	struct bufMap *m = cw->map;
+	int k, built = 0;
+	if (!cw->triMode || cw->browseMode || !m || mload.w == cw)
+		return;
+	for (k = 0; k < m->nchunks; ++k) {
+		if (m->chunks[k].tri)
+			continue;
+		if (inputWaiting())
+			break;
+		triBuild(m->chunks + k);
+		++built;
+	}
+	if (built)
+		debugPrint(3, "trigram index %d chunks", built);
+}
+
 /* regexp variables */
 static int re_count;
 static PCRE2_SIZE *re_vector;
@@ -3057,6 +4499,302 @@ static pcre2_match_data *match_data;
 static pcre2_code *re_cc;	/* compiled */
 bool re_utf8 = true;
 
+/*********************************************************************
+Cache of compiled regular expressions.
+Scripts run the same handful of searches and substitutions thousands of times,
+and there is no point compiling the same pattern over and over again.
+Keep the last several compiled patterns, keyed on the pattern and the options,
+which are caseless and utf8, along with their match data.
+These are jit compiled, if pcre2 supports jit on this machine,
+so the matches run faster on a large buffer.
+re_cc and match_data point into this cache; don't free them,
+call regexpRelease() when you are done with the pattern.
+A pattern with no regular expression characters in it is also kept
+as a literal string, and regexpMatch() looks for that directly.
+*********************************************************************/
+
+#define RECACHESIZE 12
+static struct reCache {
+	char *pattern;
+	int opt;
+	pcre2_code *code;
+	pcre2_match_data *md;
+	uchar *lit;		// the literal string, or null
+	int litlen;
+	bool litci, litutf;
+	unsigned tri[TRIPATTERN];	// trigrams for the index
+	int ntri;
+	unsigned lastuse;
+} reCache[RECACHESIZE];
+static const struct reCache *re_lit;	// current pattern, if it is literal
+static const struct reCache *re_tri;	// current pattern, if it has trigrams
+static unsigned re_clock;
+static int re_hits, re_misses;
+
+static bool regexpCached(const char *re, int re_opt)
+{
+	struct reCache *r;
+	for (r = reCache; r < reCache + RECACHESIZE; ++r) {
+		if (!r->pattern || r->opt != re_opt || !stringEqual(r->pattern, re))
+			continue;
+		r->lastuse = ++re_clock;
+		re_cc = r->code, match_data = r->md;
+		re_lit = (r->lit ? r : 0);
+		re_tri = (r->ntri ? r : 0);
+		++re_hits;
+		debugPrint(4, "regexp cache hit, %d hits %d misses", re_hits, re_misses);
+		return true;
+	}
+	return false;
+}
+
+// If the pattern matches only itself, return the string it matches,
+// lower case if the match is caseless.
+// Backslash before punctuation is that punctuation, as in perl.
+// A caseless pattern has to be ascii; pcre knows the case rules beyond that.
+static uchar *regexpLiteral(const char *re, bool ci, int *lenp)
+{
+	uchar *lit, *t;
+	const uchar *s = (const uchar *)re;
+	uchar c;
+	if (!*s)
+		return 0;
+	t = lit = allocMem(strlen(re) + 1);
+	while ((c = *s++)) {
+		if (strchr("^$.[|()?*+{", c))
+			goto fail;
+		if (c == '\\') {
+			c = *s++;
+			if (!c || isalnumByte(c) || c >= 0x80)
+				goto fail;
+		}
+		if (ci) {
+			if (c >= 0x80)
+				goto fail;
+			if (isupperByte(c))
+				c = tolower(c);
+		}
+		*t++ = c;
+	}
+	*t = 0;
+	*lenp = t - lit;
+	return lit;
+fail:
+	free(lit);
+	return 0;
+}
+
+/*********************************************************************
+Find trigrams that any line matching this pattern has to contain,
+for the trigram index.
+They come from runs of literal characters that the pattern requires,
+outside of groups and character classes.
+Anything we aren't sure of ends the run, or if it could change the
+meaning of the rest of the pattern, gives up on the pattern altogether.
+A caseless pattern also stops a run at bytes past ascii, and at k and s,
+which pcre matches to the kelvin sign and the long s.
+Return the number of trigrams, at most TRIPATTERN.
+*********************************************************************/
+
+// the trigrams of one run, that aren't already in the list
+static int triRun(const uchar *run, int rl, unsigned *tri, int n)
+{
+	int i, j;
+	for (i = 0; i + 3 <= rl && n < TRIPATTERN; ++i) {
+		unsigned key = triKey(run + i);
+		for (j = 0; j < n; ++j)
+			if (tri[j] == key)
+				break;
+		if (j == n)
+			tri[n++] = key;
+	}
+	return n;
+}
+
+// skip past a character class; s is just after the [
+static const uchar *skipClass(const uchar *s)
+{
+	if (*s == '^')
+		++s;
+	if (*s == ']')
+		++s;
+	while (*s != ']') {
+		if (!*s)
+			return 0;
+		if (*s == '\\' && s[1])
+			s += 2;
+		else if (*s == '[' && s[1] == ':') {
+			const uchar *t = (const uchar *)strstr((const char *)s + 2, ":]");
+			if (!t)
+				return 0;
+			s = t + 2;
+		} else
+			++s;
+	}
+	return s + 1;
+}
+
+static int regexpTrigrams(const char *re, bool ci, unsigned *tri)
+{
+	const uchar *s = (const uchar *)re;
+	uchar *run = allocMem(strlen(re) + 1);
+	int n = 0, rl = 0, depth;
+	uchar c, d;
+
+// alternation, or options such as (?x), and we don't know what is required
+	if (strchr(re, '|') || strstr(re, "(?"))
+		goto fail;
+	while (true) {
+		c = *s++;
+		if (c == '\\') {
+			d = *s++;
+			if (!d || d >= 0x80)
+				goto fail;
+			if (isalnumByte(d)) {
+// escapes that stand alone, without anything after them
+				if (!strchr("dDwWsSbBhHvVRAzZGK", d))
+					goto fail;
+				goto end;
+			}
+			c = d;
+			goto literal;
+		}
+		if (!c || strchr(".^$", c))
+			goto end;
+		if (c == '[') {
+			if (!(s = skipClass(s)))
+				goto fail;
+			goto end;
+		}
+		if (c == '(') {
+			for (depth = 1; depth;) {
+				d = *s++;
+				if (!d)
+					goto fail;
+				if (d == '\\') {
+					if (!*s++)
+						goto fail;
+				} else if (d == '[') {
+					if (!(s = skipClass(s)))
+						goto fail;
+				} else if (d == '(')
+					++depth;
+				else if (d == ')')
+					--depth;
+			}
+			goto end;
+		}
+		if (c == '+')
+			goto end;
+		if (c == '{') {
+			if (!isdigitByte(*s))
+				goto fail;
+			depth = strtol((const char *)s, (char **)&s, 10);
+			if (*s == ',')
+				++s;
+			while (isdigitByte(*s))
+				++s;
+			if (*s++ != '}')
+				goto fail;
+			if (depth)
+				goto end;
+			c = '*';
+		}
+		if (c == '*' || c == '?') {
+// the character before this is optional, all the bytes of it
+			while (rl && (run[rl - 1] & 0xc0) == 0x80)
+				--rl;
+			if (rl)
+				--rl;
+			goto end;
+		}
+literal:
+		if (ci && (c >= 0x80 || strchr("kKsS", c)))
+			goto end;
+		run[rl++] = c;
+		continue;
+end:
+		n = triRun(run, rl, tri, n);
+		rl = 0;
+		if (!c)
+			break;
+	}
+	free(run);
+	return n;
+fail:
+	free(run);
+	return 0;
+}
+
+// Put a newly compiled pattern in the cache, bumping the least recently used.
+static void regexpCacheAdd(const char *re, int re_opt)
+{
+	struct reCache *r, *oldest = reCache;
+	for (r = reCache; r < reCache + RECACHESIZE; ++r) {
+		if (!r->pattern) {
+			oldest = r;
+			break;
+		}
+		if (r->lastuse < oldest->lastuse)
+			oldest = r;
+	}
+	r = oldest;
+	if (r->pattern) {
+		free(r->pattern);
+		nzFree(r->lit), r->lit = 0;
+		pcre2_match_data_free(r->md);
+		pcre2_code_free(r->code);
+	}
+// If jit isn't available, the interpreter runs the pattern, no harm done.
+	pcre2_jit_compile(re_cc, PCRE2_JIT_COMPLETE);
+	match_data = pcre2_match_data_create_from_pattern(re_cc, NULL);
+	r->pattern = cloneString(re);
+	r->opt = re_opt;
+	r->code = re_cc, r->md = match_data;
+	r->litci = ((re_opt & PCRE2_CASELESS) != 0);
+	r->litutf = ((re_opt & PCRE2_UTF) != 0);
+	r->lit = regexpLiteral(re, r->litci, &r->litlen);
+	re_lit = (r->lit ? r : 0);
+	r->ntri = regexpTrigrams(re, r->litci, r->tri);
+	re_tri = (r->ntri ? r : 0);
+	r->lastuse = ++re_clock;
+	++re_misses;
+	debugPrint(3, "regexp cache miss, %d hits %d misses", re_hits, re_misses);
+}
+
+// Done with the current pattern; it stays in the cache for next time.
+static void regexpRelease(void)
+{
+	re_cc = 0, match_data = 0, re_lit = 0, re_tri = 0;
+}
+
+/*********************************************************************
+Match the current pattern against subject, starting at offset,
+and return what pcre2_match() would return, with the match in md.
+A literal pattern doesn't need pcre at all,
+but in utf8 mode pcre checks the line for bad utf8,
+and a caseless k can match the kelvin sign, so a line with any byte
+above 127 still goes to pcre, to get exactly the same answer.
+md could belong to another thread, so this doesn't touch re_vector.
+*********************************************************************/
+
+static int regexpMatch(const uchar *subject, int len, int offset,
+		       pcre2_match_data *md)
+{
+	const struct reCache *r = re_lit;
+	if (r && !(r->litutf && memHighBytes(subject, len))) {
+		PCRE2_SIZE *v = pcre2_get_ovector_pointer(md);
+		const uchar *p = memSearch(subject + offset, len - offset,
+					   r->lit, r->litlen, r->litci);
+		if (!p)
+			return PCRE2_ERROR_NOMATCH;
+		v[0] = p - subject;
+		v[1] = v[0] + r->litlen;
+		return 1;
+	}
+	return pcre2_match(re_cc, subject, len, offset, 0, md, NULL);
+}
+
 static void regexpCompile(const char *re, bool ci)
 {
 	static signed char try8 = 0;	/* 1 is utf8 on, -1 is utf8 off */
@@ -3084,6 +4822,9 @@ top:
 		}
 	}
 
+	if (regexpCached(re, re_opt))
+		return;
+
 	re_cc = pcre2_compile((uchar*)re, PCRE2_ZERO_TERMINATED, re_opt, &re_error, &re_offset, 0);
 	if (!re_cc && try8 > 0 && re_error == PCRE2_ERROR_UTF_IS_DISABLED) {
 		i_puts(MSG_PcreUtf8);
@@ -3094,11 +4835,57 @@ top:
 		i_puts(MSG_BadUtf8String);
 	}
 
-	if (!re_cc)
-		setError(MSG_RexpError, "ERROR");
-	else
-// re_cc and match_data rise and fall together.
-		match_data = pcre2_match_data_create_from_pattern(re_cc, NULL);
+	if (!re_cc)
+		setError(MSG_RexpError, "ERROR");
+	else
+// re_cc and match_data rise and fall together.
+		regexpCacheAdd(re, re_opt);
+}
+
+// Can the trigram index help with the current pattern?
+static bool triActive(void)
+{
+	return re_tri && cw->triMode && !cw->browseMode && cw->map;
+}
+
+// The candidates in one chunk, for a search that goes line by line.
+static struct {
+	int k;			// the chunk, -1 for none yet
+	int seen, cand;		// lines asked about, and candidates among them
+	uchar bits[TRILINES / 8];
+} trs;
+
+static void triBegin(void)
+{
+	trs.k = -1;
+	trs.seen = trs.cand = 0;
+}
+
+// Could line ln match the current pattern?
+// This builds the index of its chunk, if there isn't one.
+static bool triMaybe(int ln)
+{
+	struct bufMap *m = cw->map;
+	int k = mapFind(m, ln);
+	struct mapChunk *c = m->chunks + k;
+	int off = ln - c->start;
+	if (k != trs.k) {
+		if (!c->tri)
+			triBuild(c);
+		triCandidates(c, re_tri->tri, re_tri->ntri, trs.bits);
+		trs.k = k;
+	}
+	++trs.seen;
+	if (!(trs.bits[off >> 3] & (1 << (off & 7))))
+		return false;
+	++trs.cand;
+	return true;
+}
+
+static void triReport(int seen, int cand)
+{
+	debugPrint(3, "trigram index: %d candidates of %d lines, dol %d",
+		   cand, seen, cw->dol);
 }
 
 /* Get the start or end of a range.
@@ -3131,6 +4918,7 @@ const char **split)
 		bool ci = caseInsensitive;
 		bool unmatch = false;
 		bool forget = false;
+		bool tri;
 		signed char incr;	/* forward or back */
 // Don't look through an empty buffer.
 		if (cw->dol == 0) {
@@ -3164,16 +4952,19 @@ const char **split)
 		regexpCompile(re, ci);
 		if (!re_cc)
 			return false;
+		tri = triActive();
+		triBegin();
 /* We should probably study the pattern, if the file is large.
  * But then again, it's probably not worth it,
  * since the expressions are simple, and the lines are short. */
 		incr = (first == '/' ? 1 : -1);
 		while (true) {
-			char *subject;
+			pst subject;
+			int sublen;
+			bool copied;
 			ln += incr;
 			if (!searchWrap && (ln == 0 || ln > cw->dol)) {
-				pcre2_match_data_free(match_data);
-				pcre2_code_free(re_cc);
+				regexpRelease();
 				setError(MSG_NotFound);
 				return false;
 			}
@@ -3181,33 +4972,38 @@ const char **split)
 				ln = 1;
 			if (ln == 0)
 				ln = cw->dol;
-			subject = (char *)fetchLine(ln, 1);
+			if (tri && !triMaybe(ln)) {
+				re_count = PCRE2_ERROR_NOMATCH;
+				goto matched;
+			}
+			subject = fetchLineMatch(ln, &sublen, &copied);
 			re_count =
-			    pcre2_match(re_cc, (uchar*)subject,
-				      pstLength((pst) subject) - 1, 0, 0,
-				      match_data, NULL);
+			    regexpMatch(subject, sublen, 0, match_data);
 //  {uchar snork[300]; pcre2_get_error_message(re_count, snork, 300); puts(snork); }
 			re_vector = pcre2_get_ovector_pointer(match_data);
-			free(subject);
+			if (copied)
+				free(subject);
 // An error in evaluation is treated like text not found.
 // This usually happens because this particular line has bad binary, not utf8.
 			if (re_count < -1 && pcre_utf8_error_stop) {
-				pcre2_match_data_free(match_data);
-				pcre2_code_free(re_cc);
+				regexpRelease();
 				setError(MSG_RexpError2, ln);
 				return (globSub = false);
 			}
+matched:
 			if ((re_count >= 0) ^ unmatch)
 				break;
 			if (ln == cw->dot) {
-				pcre2_match_data_free(match_data);
-				pcre2_code_free(re_cc);
+				if (tri)
+					triReport(trs.seen, trs.cand);
+				regexpRelease();
 				setError(MSG_NotFound);
 				return false;
 			}
 		}		/* loop over lines */
-		pcre2_match_data_free(match_data);
-		pcre2_code_free(re_cc);
+		if (tri)
+			triReport(trs.seen, trs.cand);
+		regexpRelease();
 /* and ln is the line that matches */
 	}
 	/* Now add or subtract from this number */
@@ -3233,6 +5029,155 @@ const char **split)
 	return true;
 }
 
+/*********************************************************************
+Mark the lines for g// or v// on several threads at once.
+The marking pass only reads the buffer, so the range is cut into slices,
+one slice per worker, and each worker has its own match data.
+Workers walk the chunks of the map directly; mapLine() moves the hint,
+and that is not something two threads can share.
+A slice is at least GSLICE lines, else the threads cost more than they save.
+*********************************************************************/
+
+#define GSLICE 20000
+#define GTHREADS 64
+
+// How many threads to put on span lines, with at least slice lines each.
+// gthreads in the config file sets the most, else one per cpu.
+static int workerThreads(int span, int slice)
+{
+	int nt = globalThreads;
+	if (nt <= 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nt = (ncpu > 0 ? ncpu : 1);
+	}
+	if (nt > span / slice)
+		nt = span / slice;
+	if (nt > GTHREADS)
+		nt = GTHREADS;
+	return (nt > 1 ? nt : 1);
+}
+
+struct gMark {
+	pthread_t tid;
+	struct bufMap *map;
+	int k;			// chunk holding the first line
+	int from, to;		// lines in this slice
+	bool browse, vflag;
+	bool running;		// on its own thread
+	bool tri;		// use the trigram index
+	pcre2_match_data *md;
+	int count;		// lines marked
+	int badline;		// first line with a utf8 error, or 0
+	int cand;		// candidates from the index
+	uchar bits[TRILINES / 8];	// candidates in the current chunk
+};
+
+static void *gMarkWorker(void *arg)
+{
+	struct gMark *g = arg;
+	struct mapChunk *c = g->map->chunks + g->k;
+	int i, rc;
+
+	if (g->tri)
+		triCandidates(c, re_tri->tri, re_tri->ntri, g->bits);
+	for (i = g->from; i <= g->to; ++i) {
+		struct lineMap *t;
+		pst subject;
+		int l, off;
+		bool copied = false;
+		while (i >= c->start + c->count) {
+			++c;
+			if (g->tri)
+				triCandidates(c, re_tri->tri, re_tri->ntri, g->bits);
+		}
+		off = i - c->start;
+		t = c->lines + off;
+		if (g->tri) {
+// a line that isn't a candidate doesn't match
+			if (!(g->bits[off >> 3] & (1 << (off & 7)))) {
+				if (g->vflag)
+					t->gflag = true, ++g->count;
+				continue;
+			}
+			++g->cand;
+		}
+		subject = t->text;
+		l = t->len;
+		if (g->browse && memchr(subject, InternalCodeChar, l)) {
+			subject = clonePstring(subject);
+			removeHiddenNumbers(subject, '\n');
+			l = pstLength(subject);
+			copied = true;
+		}
+		rc = regexpMatch(subject, l - 1, 0, g->md);
+		if (copied)
+			free(subject);
+		if (rc < -1 && pcre_utf8_error_stop) {
+			g->badline = i;
+			break;
+		}
+		if ((rc < 0) == g->vflag)
+			t->gflag = true, ++g->count;
+	}
+	return NULL;
+}
+
+// Returns the number of lines marked, or -1 if the range was too small,
+// or there is only one thread, and the caller should mark the lines itself.
+// A utf8 error leaves its line number in *badline.
+static int gMarkParallel(int *badline)
+{
+	int span = endRange - startRange + 1;
+	int nt = workerThreads(span, GSLICE);
+	int i, start, gcnt = 0, cand = 0;
+	bool tri = triActive();
+	struct gMark *workers;
+
+	*badline = 0;
+	if (nt <= 1)
+		return -1;
+// workers only read the index, so it has to be built first
+	if (tri)
+		triReady(startRange, endRange);
+
+	workers = allocZeroMem(nt * sizeof(struct gMark));
+	start = startRange;
+	for (i = 0; i < nt; ++i) {
+		struct gMark *g = workers + i;
+		g->map = cw->map;
+		g->from = start;
+		g->to = start + span / nt - 1 + (i < span % nt);
+		start = g->to + 1;
+// mapLine() sets the hint to the chunk holding this line
+		mapLine(cw->map, g->from);
+		g->k = cw->map->hint;
+		g->browse = cw->browseMode;
+		g->vflag = (cmd == 'v');
+		g->tri = tri;
+		g->md = pcre2_match_data_create_from_pattern(re_cc, NULL);
+// If a thread can't start, the main thread does its slice.
+		if (pthread_create(&g->tid, NULL, gMarkWorker, g) == 0)
+			g->running = true;
+		else
+			gMarkWorker(g);
+	}
+
+	for (i = 0; i < nt; ++i) {
+		struct gMark *g = workers + i;
+		if (g->running)
+			pthread_join(g->tid, NULL);
+		pcre2_match_data_free(g->md);
+		gcnt += g->count;
+		cand += g->cand;
+		if (g->badline && !*badline)
+			*badline = g->badline;
+	}
+	free(workers);
+	if (tri)
+		triReport(span, cand);
+	return gcnt;
+}
+
 /* Apply a regular expression to each line, and then execute
  * a command for each matching, or nonmatching, line.
  * This is the global feature, g/re/p, which gives us the word grep. */
@@ -3241,7 +5186,7 @@ static bool doGlobal(const char *line)
 	int gcnt = 0;		/* global count */
 	bool ci = caseInsensitive;
 	bool forget = false;
-	bool change;
+	bool change, tri;
 	char delim = *line;
 	char *re;		/* regular expression */
 	int i, origdot, yesdot, nodot;
@@ -3278,28 +5223,50 @@ static bool doGlobal(const char *line)
 	regexpCompile(re, ci);
 	if (!re_cc)
 		return false;
-	gflag = allocZeroMem(sizeof(char*) * (cw->dol+1));
-	gflag_w = cw;
+// The marks live in the lines themselves, so they move with the lines.
+// Clear any marks left over from the last g//.
+	for (i = 1; i <= cw->dol; ++i)
+		mapLine(cw->map, i)->gflag = false;
+	gcnt = gMarkParallel(&i);
+	if (i) {
+		regexpRelease();
+		setError(MSG_RexpError2, i);
+		return false;
+	}
+	if (gcnt >= 0)
+		goto marked;
+// one thread, mark the lines here
+	gcnt = 0;
+	tri = triActive();
+	triBegin();
 	for (i = startRange; i <= endRange; ++i) {
-		char *subject = (char *)fetchLine(i, 1);
-		re_count =
-		    pcre2_match(re_cc, (uchar*)subject, pstLength((pst) subject) - 1,
-			      0, 0, match_data, NULL);
+		int sublen;
+		bool copied;
+		pst subject;
+		if (tri && !triMaybe(i)) {
+			re_count = PCRE2_ERROR_NOMATCH;
+			goto matched;
+		}
+		subject = fetchLineMatch(i, &sublen, &copied);
+		re_count = regexpMatch(subject, sublen, 0, match_data);
 		re_vector = pcre2_get_ovector_pointer(match_data);
 
-		free(subject);
+		if (copied)
+			free(subject);
 		if (re_count < -1 && pcre_utf8_error_stop) {
-  			pcre2_match_data_free(match_data);
-			pcre2_code_free(re_cc);
+  			regexpRelease();
 			setError(MSG_RexpError2, i);
 			return false;
 		}
+matched:
 		if ((re_count < 0 && cmd == 'v')
 		    || (re_count >= 0 && cmd == 'g'))
-			gflag[i] = true, ++gcnt;
+			mapLine(cw->map, i)->gflag = true, ++gcnt;
 	}
-	pcre2_match_data_free(match_data);
-	pcre2_code_free(re_cc);
+	if (tri)
+		triReport(trs.seen, trs.cand);
+marked:
+	regexpRelease();
 
 	if (!gcnt) {
 		setError((cmd == 'v') + MSG_NoMatchG);
@@ -3401,11 +5368,12 @@ nomass:
 		change = false;	/* kinda like bubble sort */
 		for (i = 1; i <= cw->dol; ++i) {
 			int i2 = i;
-			if (!gflag[i]) continue;
+			struct lineMap *t = mapLine(cw->map, i);
+			if (!t->gflag) continue;
 			if (intFlag)
 				goto done;
 			change = true, --gcnt;
-			gflag[i] = false;
+			t->gflag = false;
 			cw->dot = i;	/* so we can run the command at this line */
 			if (runCommand(line)) {
 				yesdot = cw->dot;
@@ -3441,6 +5409,329 @@ done:
 	return (errorMsg[0] == 0);
 }
 
+/*********************************************************************
+The sort command, sorting a range of lines in the buffer.
+,sort sorts the buffer, 'a,'b sort sorts a block, and options follow:
+n numeric, i case insensitive, r reverse, u unique, that is,
+drop a line that compares equal to the line before it,
+kN sort on the Nth field, and tc for fields separated by c,
+rather than whitespace.
+So ,sort nrk3t, is sort -t, -k3,3 -nr.
+The order is by bytes, as in the C locale, and the sort is stable,
+lines that compare equal keep their order.
+The text of the lines is not touched, or even copied;
+we sort the indexes of the lines, and then put the lines back in the map
+in their new order.
+That order goes to undo as a permutation, which undo can invert,
+not as a copy of the lines.
+With u, the lines that are dropped go to the end of the range,
+and then come out of the buffer in one splice.
+The range is cut into slices that are sorted on separate threads,
+as in g//, and then the slices are merged, pairs at a time.
+*********************************************************************/
+
+#define SORTSLICE 50000
+
+static struct sortOpts {
+	bool numeric, ci, reverse, uniq;
+	int field;		// 0 for the whole line
+	char sep;		// 0 for whitespace
+	struct lineMap *lines;	// the lines of the range, in the old order
+	double *nums;		// the numeric keys
+} so;
+
+// The key of a line, the whole line or one field, without the newline.
+static const uchar *sortKey(int x, int *klen)
+{
+	const uchar *s = so.lines[x].text;
+	const uchar *end = s + so.lines[x].len - 1;
+	const uchar *t;
+	int f;
+	if (!so.field) {
+		*klen = end - s;
+		return s;
+	}
+	for (f = 1;; ++f) {
+		if (!so.sep)
+			while (s < end && isspaceByte(*s))
+				++s;
+		for (t = s; t < end; ++t)
+			if (so.sep ? *t == so.sep : isspaceByte(*t))
+				break;
+		if (f == so.field || t == end)
+			break;
+		s = t + 1;
+	}
+	if (f < so.field)
+		s = t = end;
+	*klen = t - s;
+	return s;
+}
+
+// Leading number of the key, as in sort -n, a key that isn't a number is 0.
+// Only sign, digits, and a decimal point; strtod would take nan and 0x.
+static double sortNumber(int x)
+{
+	char buf[64];
+	int klen, i = 0;
+	const uchar *k = sortKey(x, &klen);
+	while (klen && isspaceByte(*k))
+		++k, --klen;
+	if (klen && *k == '-')
+		buf[i++] = *k++, --klen;
+	while (klen && isdigitByte(*k) && i < (int)sizeof(buf) - 1)
+		buf[i++] = *k++, --klen;
+	if (klen && *k == '.' && i < (int)sizeof(buf) - 1)
+		buf[i++] = *k++, --klen;
+	while (klen && isdigitByte(*k) && i < (int)sizeof(buf) - 1)
+		buf[i++] = *k++, --klen;
+	buf[i] = 0;
+	return strtod(buf, 0);
+}
+
+static int sortCompare(int x, int y)
+{
+	int c, l1, l2, l;
+	const uchar *k1, *k2;
+	if (so.numeric) {
+		double d1 = so.nums[x], d2 = so.nums[y];
+		c = (d1 < d2 ? -1 : d1 > d2);
+	} else {
+		k1 = sortKey(x, &l1);
+		k2 = sortKey(y, &l2);
+		l = (l1 < l2 ? l1 : l2);
+		if (so.ci) {
+			int i;
+			for (i = 0, c = 0; i < l && !c; ++i)
+				c = (int)toupper(k1[i]) - (int)toupper(k2[i]);
+		} else
+			c = memcmp(k1, k2, l);
+		if (!c)
+			c = (l1 < l2 ? -1 : l1 > l2);
+	}
+	return so.reverse ? -c : c;
+}
+
+// merge a[0..n1-1] and a[n1..n-1] into out
+static void sortMerge(const int *a, int n1, int n, int *out)
+{
+	int i = 0, j = n1, k = 0;
+	while (i < n1 && j < n)
+		out[k++] = (sortCompare(a[j], a[i]) < 0 ? a[j++] : a[i++]);
+	while (i < n1)
+		out[k++] = a[i++];
+	while (j < n)
+		out[k++] = a[j++];
+}
+
+// Sort a[0..n-1], using tmp, the same size, as scratch space.
+static void sortRun(int *a, int *tmp, int n)
+{
+	int h = n / 2;
+	if (n <= 16) {
+// insertion sort
+		int i, j, x;
+		for (i = 1; i < n; ++i) {
+			x = a[i];
+			for (j = i; j && sortCompare(x, a[j - 1]) < 0; --j)
+				a[j] = a[j - 1];
+			a[j] = x;
+		}
+		return;
+	}
+	sortRun(a, tmp, h);
+	sortRun(a + h, tmp + h, n - h);
+// already in order; common enough to check
+	if (sortCompare(a[h], a[h - 1]) >= 0)
+		return;
+	sortMerge(a, h, n, tmp);
+	memcpy(a, tmp, n * sizeof(int));
+}
+
+struct sortSlice {
+	pthread_t tid;
+	int *a, *tmp;
+	int n, n1;		// n1 is the first run, when merging
+	bool running;
+};
+
+static void *sortWorker(void *arg)
+{
+	struct sortSlice *s = arg;
+	if (s->n1) {
+		sortMerge(s->a, s->n1, s->n, s->tmp);
+		memcpy(s->a, s->tmp, s->n * sizeof(int));
+	} else
+		sortRun(s->a, s->tmp, s->n);
+	return NULL;
+}
+
+// Run the slices on their own threads, or here if a thread won't start.
+static void sortSlices(struct sortSlice *sl, int nt)
+{
+	int i;
+	for (i = 0; i < nt; ++i) {
+		sl[i].running = false;
+		if (nt > 1 && pthread_create(&sl[i].tid, NULL, sortWorker, sl + i) == 0)
+			sl[i].running = true;
+		else
+			sortWorker(sl + i);
+	}
+	for (i = 0; i < nt; ++i)
+		if (sl[i].running)
+			pthread_join(sl[i].tid, NULL);
+}
+
+static void sortIndexes(int *a, int *tmp, int n)
+{
+	int nt = workerThreads(n, SORTSLICE);
+	int i, start, w;
+	struct sortSlice *sl = allocZeroMem(nt * sizeof(struct sortSlice));
+	int *bound = allocMem((nt + 1) * sizeof(int));
+
+	for (i = start = 0; i < nt; ++i) {
+		bound[i] = start;
+		start += n / nt + (i < n % nt);
+	}
+	bound[nt] = n;
+	for (i = 0; i < nt; ++i) {
+		sl[i].a = a + bound[i], sl[i].tmp = tmp + bound[i];
+		sl[i].n = bound[i + 1] - bound[i], sl[i].n1 = 0;
+	}
+	sortSlices(sl, nt);
+
+// merge pairs of runs, until there is one run
+	for (w = 1; w < nt; w *= 2) {
+		int m = 0;
+		for (i = 0; i + w < nt; i += 2 * w, ++m) {
+			int hi = (i + 2 * w < nt ? i + 2 * w : nt);
+			sl[m].a = a + bound[i], sl[m].tmp = tmp + bound[i];
+			sl[m].n = bound[hi] - bound[i];
+			sl[m].n1 = bound[i + w] - bound[i];
+		}
+		sortSlices(sl, m);
+	}
+	free(sl);
+	free(bound);
+}
+
+static bool sortRange(const char *line)
+{
+	int n;
+	int i, j, kept, *idx, *tmp, *where;
+	char c;
+	struct lineMap *out;
+
+	memset(&so, 0, sizeof(so));
+	skipWhite(&line);
+	while ((c = *line++)) {
+		if (c == ' ')
+			continue;
+		if (c == 'n') {
+			so.numeric = true;
+			continue;
+		}
+		if (c == 'i') {
+			so.ci = true;
+			continue;
+		}
+		if (c == 'r') {
+			so.reverse = true;
+			continue;
+		}
+		if (c == 'u') {
+			so.uniq = true;
+			continue;
+		}
+		if (c == 'k' && isdigitByte(*line)) {
+			so.field = strtol(line, (char **)&line, 10);
+			if (so.field)
+				continue;
+		}
+		if (c == 't' && *line && *line != '\n') {
+			so.sep = *line++;
+			continue;
+		}
+		setError(MSG_SortOption, c);
+		return false;
+	}
+
+	if (cw->browseMode | cw->dirMode | cw->sqlMode | cw->irciMode |
+	    cw->ircoMode | cw->binMode) {
+		setError(MSG_SortMode);
+		return false;
+	}
+// runCommand has finished any load, before it set the range
+	if (startRange == 0) {
+		setError(MSG_EmptyBuffer);
+		return false;
+	}
+	n = endRange - startRange + 1;
+	if (n == 1) {
+		cw->dot = endRange;
+		return true;
+	}
+
+	so.lines = allocMem(n * LMSIZE);
+	mapCopyOut(cw->map, startRange, endRange, so.lines);
+	if (so.numeric) {
+		so.nums = allocMem(n * sizeof(double));
+		for (i = 0; i < n; ++i)
+			so.nums[i] = sortNumber(i);
+	}
+	idx = allocMem(n * sizeof(int));
+	tmp = allocMem(n * sizeof(int));
+	for (i = 0; i < n; ++i)
+		idx[i] = i;
+	sortIndexes(idx, tmp, n);
+
+// with u, the duplicates go to the end, in the order they were in
+	kept = n;
+	if (so.uniq) {
+		for (i = j = 1; i < n; ++i)
+			if (sortCompare(idx[i], idx[j - 1]))
+				idx[j++] = idx[i];
+			else
+				tmp[i - j] = idx[i];
+		kept = j;
+		memcpy(idx + kept, tmp, (n - kept) * sizeof(int));
+	}
+	nzFree(so.nums);
+
+// labels go with their lines; a dropped line drops its label
+	where = tmp;
+	for (i = 0; i < n; ++i)
+		where[idx[i]] = i;
+	undoPush();
+	for (i = 0; i < MARKLETTERS; ++i) {
+		int l = cw->labels[i];
+		if (l < startRange || l > endRange)
+			continue;
+		j = where[l - startRange];
+		cw->labels[i] = (j < kept ? startRange + j : 0);
+	}
+	free(tmp);
+
+	out = allocMem(n * LMSIZE);
+	for (i = 0; i < n; ++i) {
+		out[i] = so.lines[idx[i]];
+		out[i].gflag = false;
+	}
+	free(so.lines);
+	cw->map = mapDelete(cw->map, startRange, endRange);
+	cw->map = mapInsert(cw->map, startRange - 1, out, n);
+	free(out);
+// undo owns the order now
+	undoPermute(startRange, n, idx);
+	if (kept < n) {
+		out = mapTakeOut(startRange + kept, endRange);
+		undoSplice(startRange + kept, 0, out, n - kept);
+		cw->dol -= n - kept;
+	}
+	cw->dot = startRange + kept - 1;
+	return true;
+}
+
 static void fieldNumProblem(int desc, char *c, int n, int nt, int nrt)
 {
 	if (!nrt) {
@@ -3466,27 +5757,49 @@ static char *replaceString;
 static int replaceStringLength;
 static char *replaceStringEnd;
 
+/* The replacement is built in scratch space that is used again for the next
+ * line; on a big range, a fresh string for each line was mostly realloc.
+ * Keep room for a byte past the end, the caller puts \n or 0 there. */
+static char *replaceScratch;
+static int replaceAlloc;
+
+static void replaceBytes(int *rlen, const char *t, int cnt)
+{
+	if (*rlen + cnt + 2 > replaceAlloc) {
+		replaceAlloc = (*rlen + cnt + 2) * 2;
+		if (replaceAlloc < 256)
+			replaceAlloc = 256;
+		replaceScratch = replaceScratch ?
+		    reallocMem(replaceScratch, replaceAlloc) :
+		    allocMem(replaceAlloc);
+	}
+	memcpy(replaceScratch + *rlen, t, cnt);
+	*rlen += cnt;
+	replaceScratch[*rlen] = 0;
+}
+
+static void replaceChar(int *rlen, char c)
+{
+	replaceBytes(rlen, &c, 1);
+}
+
 static int replaceText(const char *line, int len, const char *rhs,
 	    int nth, bool global, bool last, int ln)
 {
 	int offset = 0, lastoffset = -1, instance = 0;
 	int span;
-	char *r;
-	int rlen;
+	int rlen = 0;
 	const char *s = line, *s_end, *t;
 	char c, d;
 
-	r = initString(&rlen);
-
 	while (true) {
 // find the next match
 		re_count =
-		    pcre2_match(re_cc, (uchar*)line, len, offset, 0, match_data, NULL);
+		    regexpMatch((uchar*)line, len, offset, match_data);
 		re_vector = pcre2_get_ovector_pointer(match_data);
 		if (re_count < -1 &&
 		    (pcre_utf8_error_stop || startRange == endRange)) {
 			setError(MSG_RexpError2, ln);
-			nzFree(r);
 			return -1;
 		}
 
@@ -3503,7 +5816,6 @@ static int replaceText(const char *line, int len, const char *rhs,
 		offset = re_vector[1];	/* ready for next iteration */
 		if (offset == lastoffset && (nth > 1 || (global|last))) {
 			setError(MSG_ManyEmptyStrings);
-			nzFree(r);
 			return -1;
 		}
 
@@ -3515,7 +5827,7 @@ static int replaceText(const char *line, int len, const char *rhs,
 // copy up to the match point
 		s_end = line + re_vector[0];
 		span = s_end - s;
-		stringAndBytes(&r, &rlen, s, span);
+		replaceBytes(&rlen, s, span);
 		s = line + offset;
 
 // Now copy over the rhs
@@ -3524,8 +5836,8 @@ static int replaceText(const char *line, int len, const char *rhs,
 		    && rhs[1] == 'c' && rhs[2] == 0) {
 			int savelen = rlen;
 			span = re_vector[1] - re_vector[0];
-			stringAndBytes(&r, &rlen, line + re_vector[0], span);
-			caseShift(r + savelen, rhs[0]);
+			replaceBytes(&rlen, line + re_vector[0], span);
+			caseShift(replaceScratch + savelen, rhs[0]);
 			if (!global) break;
 			nth = 0;
 			continue;
@@ -3538,31 +5850,31 @@ static int replaceText(const char *line, int len, const char *rhs,
 			if (c == '\\') {
 				t += 2;
 				if (d == '$') {
-					stringAndChar(&r, &rlen, d);
+					replaceChar(&rlen, d);
 					continue;
 				}
 				if (d == 'n') {
-					stringAndChar(&r, &rlen, '\n');
+					replaceChar(&rlen, '\n');
 					continue;
 				}
 				if (d == 't') {
-					stringAndChar(&r, &rlen, '\t');
+					replaceChar(&rlen, '\t');
 					continue;
 				}
 				if (d == 'b') {
-					stringAndChar(&r, &rlen, '\b');
+					replaceChar(&rlen, '\b');
 					continue;
 				}
 				if (d == 'r') {
-					stringAndChar(&r, &rlen, '\r');
+					replaceChar(&rlen, '\r');
 					continue;
 				}
 				if (d == 'f') {
-					stringAndChar(&r, &rlen, '\f');
+					replaceChar(&rlen, '\f');
 					continue;
 				}
 				if (d == 'a') {
-					stringAndChar(&r, &rlen, '\a');
+					replaceChar(&rlen, '\a');
 					continue;
 				}
 				if (d >= '0' && d <= '7') {
@@ -3578,12 +5890,12 @@ static int replaceText(const char *line, int len, const char *rhs,
 							    8 * octal + d - '0';
 						}
 					}
-					stringAndChar(&r, &rlen, octal);
+					replaceChar(&rlen, octal);
 					continue;
 				}	/* octal */
 				if (!ebre)
-					stringAndChar(&r, &rlen, '\\');
-				stringAndChar(&r, &rlen, d);
+					replaceChar(&rlen, '\\');
+				replaceChar(&rlen, d);
 				continue;
 			}	// \ cases
 
@@ -3591,14 +5903,14 @@ static int replaceText(const char *line, int len, const char *rhs,
 				int y, z;
 				t += 2;
 				d -= '0';
-				if (d > re_count)
+				if (d >= re_count)
 					continue;
 				y = re_vector[2 * d];
 				z = re_vector[2 * d + 1];
 				if (y < 0)
 					continue;
 				span = z - y;
-				stringAndBytes(&r, &rlen, line + y, span);
+				replaceBytes(&rlen, line + y, span);
 				continue;
 			}
 
@@ -3606,12 +5918,12 @@ static int replaceText(const char *line, int len, const char *rhs,
 			    !strncmp(t + 2, "ine", 3) && !isalnum(t[5])) {
 				char numstring[12];
 				sprintf(numstring, "%d", ln);
-				stringAndString(&r, &rlen, numstring);
+				replaceBytes(&rlen, numstring, strlen(numstring));
 				t += 5;
 				continue;
 			}
 
-			stringAndChar(&r, &rlen, c);
+			replaceChar(&rlen, c);
 			++t;
 		}
 
@@ -3620,21 +5932,19 @@ static int replaceText(const char *line, int len, const char *rhs,
 	}			// loop matching the regular expression
 
 	if (!instance) {
-		nzFree(r);
 		return false;
 	}
 
 	if (!global &&instance < nth) {
-		nzFree(r);
 		return false;
 	}
 
 /* We got a match, copy the last span. */
 	s_end = line + len;
 	span = s_end - s;
-	stringAndBytes(&r, &rlen, s, span);
+	replaceBytes(&rlen, s, span);
 
-	replaceString = r;
+	replaceString = replaceScratch;
 	replaceStringLength = rlen;
 	undoSpecialClear();
 	return true;
@@ -3928,6 +6238,80 @@ directory or browse or sql mode.
 None of those should inject newlines anyways.
 *********************************************************************/
 
+/*********************************************************************
+A substitute over a range packs its new lines into slabs, rather than
+allocating each one, and records the lines it replaces in runs,
+one undo splice for a run of consecutive lines, rather than one per line.
+Undo is just the same; a run of n lines for n lines is what n splices of
+one line for one line would do.
+The slab is good for this command only; lines in it are not freed until
+the command is done, and then anything could happen to it.
+*********************************************************************/
+
+static uchar *subSlab;		// the slab we are filling
+static size_t subUsed, subSize;
+static int subLines;		// lines changed so far
+static struct lineMap *subRun;	// lines replaced, in a run
+static int subRunAt, subRunCount, subRunAlloc;
+
+// Text for a new line; rest is the number of lines left in the range.
+// The first line changed is allocated on its own, since it may be the only one,
+// as in ,s/unique/x/, and a slab lives as long as any line in it.
+// After that the slabs start small and double, as more lines change,
+// so they fit the lines that actually change, not the size of the range.
+static pst subText(const char *s, int len, int rest)
+{
+	struct lineSlab *slab;
+	pst p;
+	if (!subLines++ || (rest <= 1 && !subSlab)) {
+		p = allocMem(len);
+		memcpy(p, s, len);
+		return p;
+	}
+	if (!subSlab || subUsed + len > subSize) {
+		size_t size = (subSlab ? subSize * 2 : SLABMIN);
+		if (size > SLABSIZE)
+			size = SLABSIZE;
+		if (size > (size_t)rest * len && (size_t)rest * len >= SLABMIN)
+			size = (size_t)rest * len;
+		if (size < (size_t)len)
+			size = len;
+		slab = slabNew(size);
+		subSlab = slab->base, subSize = size, subUsed = 0;
+	} else
+		slab = slabFind(subSlab);
+	p = subSlab + subUsed;
+	memcpy(p, s, len);
+	subUsed += len;
+	++slab->live;
+	return p;
+}
+
+static void subRunFlush(void)
+{
+	if (!subRunCount)
+		return;
+	undoSplice(subRunAt, subRunCount, subRun, subRunCount);
+	subRun = 0;
+	subRunCount = subRunAlloc = 0;
+}
+
+// line at, the old line, was replaced by one new line
+static void subRunAdd(int at, const struct lineMap *old)
+{
+	if (subRunCount && at != subRunAt + subRunCount)
+		subRunFlush();
+	if (!subRunCount)
+		subRunAt = at;
+	if (subRunCount == subRunAlloc) {
+		subRunAlloc = subRunAlloc ? subRunAlloc * 2 : 16;
+		subRun = subRun ?
+		    reallocMem(subRun, subRunAlloc * LMSIZE) :
+		    allocMem(subRunAlloc * LMSIZE);
+	}
+	subRun[subRunCount++] = *old;
+}
+
 static int substituteText(const char *line)
 {
 	int whichField = 0;
@@ -3945,11 +6329,12 @@ static int substituteText(const char *line)
 	int dol2, alloc2;
 	int j, linecount, slashcount, nullcount, tagno, total, realtotal;
 	char lhs[MAXRE], rhs[MAXRE];
-	struct lineMap *mptr, *newmap = 0;
-	bool *newg = 0;
+	struct lineMap *mptr, *oldline, *newmap = 0;
 	bool hasMoved[MARKLETTERS];
 
 	replaceString = 0;
+	subSlab = 0;
+	subLines = 0;
 	memset(hasMoved, 0, sizeof(hasMoved));
 
 	re_cc = 0;
@@ -4045,8 +6430,7 @@ static int substituteText(const char *line)
 		int len;
 
 		if(newmap) {
-			newmap[ln2] = cw->map[ln];
-			if(newg) newg[ln2] = gflag[ln];
+			newmap[ln2] = *mapLine(cw->map, ln);
 			for(j = 0; j < MARKLETTERS; ++j)
 				if(cw->labels[j] == ln && !hasMoved[j])
 					cw->labels[j] = ln2, hasMoved[j] = true;
@@ -4056,8 +6440,9 @@ static int substituteText(const char *line)
 		if(intFlag) goto abort;
 		if(!ok) { ++ln2; continue; }
 
-		p = (char *)fetchLine(ln, -1);
-		len = pstLength((pst) p);
+		mptr = mapLine(cw->map, ln);
+		p = (char *)mptr->text;
+		len = mptr->len;
 
 		if (bl_mode) {
 			int newlen;
@@ -4195,7 +6580,7 @@ static int substituteText(const char *line)
 // We're managing our own printing, so leave notify = 0
 			if (!infReplace(tagno, replaceString, false))
 				goto abort;
-			undoCompare();
+			undoClear();
 			cw->undoable = false;
 		} else {
 
@@ -4204,14 +6589,25 @@ static int substituteText(const char *line)
 			*replaceStringEnd = '\n';
 			if (!linecount) {
 // normal substitute
-				mptr = newmap ? newmap + ln2 : cw->map + ln;
-				if(cw->sqlMode)
-					nzFree(mptr->text);
-				mptr->text = allocMem(replaceStringLength + 1);
-				memcpy(mptr->text, replaceString,
-				       replaceStringLength + 1);
-				if (cw->dirMode)
-					undoCompare(), cw->undoable = false;
+				struct lineMap old = *mapLine(cw->map, ln);
+				pst newtext = subText(replaceString,
+						      replaceStringLength + 1,
+						      endRange - ln + 1);
+				if (newmap) {
+					mptr = newmap + ln2;
+					mptr->text = newtext;
+					mptr->len = replaceStringLength + 1;
+				} else
+					mapSetText(cw->map, ln, newtext,
+						   replaceStringLength + 1);
+				if (cw->dirMode) {
+// in directory mode, this frees the old line
+					oldline = allocMem(LMSIZE);
+					*oldline = old;
+					undoSplice(ln, 1, oldline, 1);
+					undoClear(), cw->undoable = false;
+				} else
+					subRunAdd(newmap ? ln2 : ln, &old);
 				++ln2;
 			} else {
 // Becomes many lines, this is the tricky case.
@@ -4224,28 +6620,28 @@ static int substituteText(const char *line)
 					dol2 = cw->dol;
 					alloc2 = dol2 / 9 * 10 + 60;
 					newmap = allocMem(LMSIZE * alloc2);
-					memcpy(newmap, cw->map,LMSIZE*(ln2 = ln));
-					if(gflag) {
-						newg = allocMem(alloc2);
-						memcpy(newg, gflag, ln);
-					}
+					mapCopyOut(cw->map, 1, ln - 1, newmap + 1);
+					ln2 = ln;
 				}
 				dol2 += linecount;
 				if(dol2 + 2 > alloc2) {
 					alloc2 = dol2 / 9 * 10 + 20;
 					newmap = realloc(newmap, LMSIZE*alloc2);
-					if(newg) newg = realloc(newg, alloc2);
 				}
 				++linecount;
 				memcpy(newmap + ln2, newpiece, linecount*LMSIZE);
 				free(newpiece), newpiece = 0;
-				if(newg) memset(newg + ln2, 0, linecount);
+				oldline = allocMem(LMSIZE);
+				*oldline = *mapLine(cw->map, ln);
+				j = ln2;
 				ln2 += linecount;
 // There's a quirk when adding newline to the end of a buffer
 // that had no newline at the end before.
 				if (cw->nlMode && ln == cw->dol
 				    && replaceStringEnd[-1] == '\n')
 					--ln2, --dol2;
+				subRunFlush();
+				undoSplice(j, ln2 - j, oldline, 1);
 			}
 		}		// browse or not
 
@@ -4253,42 +6649,39 @@ static int substituteText(const char *line)
 			if(!newmap) {
 				displayLine(ln);
 			} else {
-// this is hinky as hell, swap newmap in just to display the line
-				mptr = cw->map, cw->map = newmap;
-				j = cw->dol, cw->dol = dol2;
-				displayLine(ln2 - 1);
-				cw->map = mptr, cw->dol = j;
+// the line is in newmap, not in the buffer yet
+				displayText(newmap[ln2 - 1].text, ln2 - 1);
 			}
 		}
 		lastSubst = newmap ? ln2 - 1 : ln;
-		nzFree(replaceString);
-// we may have just freed the result of a breakline command
+// the result of a breakline command is allocated, replaceText is not
+		if (bl_mode)
+			nzFree(replaceString);
 		breakLineResult = 0;
 		continue;
 
 abort:
 		if (re_cc) {
-			pcre2_match_data_free(match_data);
-			pcre2_code_free(re_cc);
+			regexpRelease();
 		}
-		nzFree(replaceString);
-	// we may have just freed the result of a breakline command
+		if (bl_mode)
+			nzFree(replaceString);
 		breakLineResult = 0;
 		ok = false;
 		++ln2;
 	}			// loop over lines in the range
+	subRunFlush();
 
 	if(newmap) { // close it out
 		for(; ln <= cw->dol; ++ln, ++ln2) {
-			newmap[ln2] = cw->map[ln];
-			if(newg) newg[ln2] = gflag[ln];
+			newmap[ln2] = *mapLine(cw->map, ln);
 			for(j = 0; j < MARKLETTERS; ++j)
 				if(cw->labels[j] == ln && !hasMoved[j])
 					cw->labels[j] = ln2, hasMoved[j] = true;
 		}
-		newmap[ln2] = cw->map[ln]; // null terminate
-		free(cw->map), cw->map = newmap;
-		if(newg) free(gflag), gflag = newg;
+		mapFree(cw->map);
+		cw->map = mapCreate(newmap + 1, ln2 - 1);
+		free(newmap);
 cw->dol = ln2 - 1;
 	}
 
@@ -4300,8 +6693,7 @@ cw->dol = ln2 - 1;
 	if(!ok) return -1;
 
 	if (re_cc) {
-		pcre2_match_data_free(match_data);
-		pcre2_code_free(re_cc);
+		regexpRelease();
 	}
 
 	if (!lastSubst) {
@@ -4459,6 +6851,228 @@ Tag *line2frame(int ln)
 	return 0;
 }
 
+/*********************************************************************
+Time the top level commands, dbtime.
+Each command records wall time, cpu time over all threads,
+and the calls and bytes through allocMem and friends.
+A line is printed after the command, and the totals are kept by command,
+for cmdlist.  Commands are grouped by their leading word if they have one,
+sort bflist e w s, else by the command letter, so 1,$d is d and /x/ is p.
+Functions count as one command; the commands within are part of it.
+*********************************************************************/
+
+static bool timeCommands;
+
+struct cmdStat {
+	char key[12];
+	int calls;
+	double wall, cpu;
+	long long allocs, bytes;
+};
+static struct cmdStat *cmdStats;
+static int cmdStatCount, cmdStatMax;
+
+struct cmdClock {
+	double wall, cpu;
+	long long allocs, bytes;
+};
+
+static void cmdClockRead(struct cmdClock *c)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	c->wall = ts.tv_sec + ts.tv_nsec / 1000000000.0;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	c->cpu = ts.tv_sec + ts.tv_nsec / 1000000000.0;
+	c->allocs = allocCalls, c->bytes = allocBytes;
+}
+
+static void cmdClockStop(const char *line, const struct cmdClock *start)
+{
+	struct cmdClock c;
+	struct cmdStat *st;
+	char key[12];
+	int j;
+
+	cmdClockRead(&c);
+	c.wall -= start->wall, c.cpu -= start->cpu;
+	c.allocs -= start->allocs, c.bytes -= start->bytes;
+	i_printf(MSG_CommandTime, c.wall, c.cpu, c.allocs, c.bytes);
+	nl();
+
+	for (j = 0; isalphaByte(line[j]) && j < (int)sizeof(key) - 1; ++j)
+		key[j] = line[j];
+	if (!j && (*line == '<' || *line == '!'))
+		key[j++] = *line;
+	if (!j)
+		key[j++] = cmd;
+	key[j] = 0;
+
+	for (j = 0; j < cmdStatCount; ++j)
+		if (stringEqual(cmdStats[j].key, key))
+			break;
+	if (j == cmdStatCount) {
+		if (cmdStatCount == cmdStatMax) {
+			cmdStatMax = (cmdStatMax ? cmdStatMax * 2 : 32);
+			cmdStats = (cmdStats ?
+				    reallocMem(cmdStats,
+					       cmdStatMax * sizeof(struct cmdStat)) :
+				    allocMem(cmdStatMax * sizeof(struct cmdStat)));
+		}
+		st = cmdStats + cmdStatCount++;
+		memset(st, 0, sizeof(struct cmdStat));
+		strcpy(st->key, key);
+	}
+	st = cmdStats + j;
+	++st->calls;
+	st->wall += c.wall, st->cpu += c.cpu;
+	st->allocs += c.allocs, st->bytes += c.bytes;
+}
+
+// most time first
+static int cmdStatCompare(const void *a, const void *b)
+{
+	const struct cmdStat *s = a, *t = b;
+	if (s->wall != t->wall)
+		return (s->wall < t->wall ? 1 : -1);
+	return strcmp(s->key, t->key);
+}
+
+static void cmdList(void)
+{
+	int j;
+	if (!cmdStatCount) {
+		i_puts(MSG_NoCommandTimes);
+		return;
+	}
+	qsort(cmdStats, cmdStatCount, sizeof(struct cmdStat), cmdStatCompare);
+	for (j = 0; j < cmdStatCount; ++j) {
+		const struct cmdStat *st = cmdStats + j;
+		i_printf(MSG_CommandStats, st->key, st->calls, st->wall,
+			 st->cpu, st->allocs, st->bytes);
+		nl();
+	}
+}
+
+/*********************************************************************
+Memory accounting, memlist.
+Walk every session, and every window on its stack, current window first,
+and add up what each one holds: the text of the lines,
+the maps that point to them, with any trigram index,
+the html tags with their strings and attributes, and the css descriptors.
+Shared lines are counted in every buffer that has them.
+Undo steps belong to the current window only, so they get their own line.
+Quickjs keeps its accounts by runtime, not by context,
+so js is one line for all the contexts, which are counted per window.
+*********************************************************************/
+
+static long long triMemory(const struct triChunk *t)
+{
+	if (!t)
+		return 0;
+	return sizeof(struct triChunk) + t->nkeys * sizeof(unsigned) +
+	    (t->nkeys + 1) * sizeof(int) +
+	    (t->start[t->nkeys] + t->nlong) * sizeof(ushort);
+}
+
+static long long mapMemory(const struct bufMap *m)
+{
+	long long n;
+	int k;
+	if (!m)
+		return 0;
+	n = sizeof(struct bufMap) + m->allocChunks * sizeof(struct mapChunk);
+	for (k = 0; k < m->nchunks; ++k)
+		n += m->chunks[k].alloc * LMSIZE + triMemory(m->chunks[k].tri);
+	return n;
+}
+
+static long long undoMemory(const struct undoStep *u, int levels)
+{
+	long long n = 0;
+	int i, j;
+	for (i = 0; i < levels; ++i, ++u) {
+		n += u->allocSplices * sizeof(struct undoSplice);
+		for (j = 0; j < u->nsplices; ++j) {
+			const struct undoSplice *sp = u->splices + j;
+			int k;
+			if (sp->perm)
+				n += sp->nins * sizeof(int);
+			if (!sp->lines)
+				continue;
+			n += sp->ndel * LMSIZE;
+			for (k = 0; k < sp->ndel; ++k)
+				if (sp->lines[k].text != (pst) emptyString)
+					n += sp->lines[k].len;
+		}
+	}
+	return n;
+}
+
+// returns the bytes held by the window, and prints them by category
+static long long windowMemory(int cx, int depth, const Window *w)
+{
+	long long text, maps, tagbytes = 0, cssbytes = 0, n;
+	int ntags = 0, ncss = 0, njs = 0;
+	const Frame *f;
+	const char *name;
+
+	text = (w->map ? w->map->bytes : 0) + (w->r_map ? w->r_map->bytes : 0);
+	maps = mapMemory(w->map) + mapMemory(w->r_map);
+	if (w->tags)
+		ntags = tagMemory(w, &tagbytes);
+	for (f = &w->f0; f; f = f->next) {
+		if (f->cssmaster) {
+			ncss += cssMemory(f, &n);
+			cssbytes += n;
+		}
+		if (f->cx)
+			++njs;
+	}
+	name = w->htmltitle;
+	if (!name)
+		name = w->f0.fileName;
+	if (!name)
+		name = emptyString;
+	i_printf(MSG_MemWindow, cx, depth, text, maps, ntags, tagbytes,
+		 ncss, cssbytes, njs, name);
+	nl();
+	return text + maps + tagbytes + cssbytes;
+}
+
+static void memList(void)
+{
+	long long n, sn, total = 0;
+	int cx, depth;
+	const Window *w;
+
+	for (cx = 1; cx <= maxSession; ++cx) {
+		const struct ebSession *s = sessionList + cx;
+		if (!s->lw)
+			continue;
+		sn = 0, depth = 0;
+		for (w = s->lw; w; w = w->prev)
+			sn += windowMemory(cx, ++depth, w);
+		for (w = s->lw2; w; w = w->prev)
+			sn += windowMemory(cx, ++depth, w);
+		i_printf(MSG_MemSession, cx, sn);
+		nl();
+		total += sn;
+	}
+
+	n = undoMemory(undoStack, undoLevels) +
+	    undoMemory(redoStack, redoLevels);
+	i_printf(MSG_MemUndo, context, n, undoLevels, redoLevels);
+	nl();
+	total += n;
+	n = jsMemory();
+	i_printf(MSG_MemJS, n);
+	nl();
+	total += n;
+	i_printf(MSG_MemTotal, total);
+	nl();
+}
+
 static char shortline[60];
 static int twoLetter(const char *line, const char **runThis)
 {
@@ -4521,7 +7135,7 @@ static int twoLetter(const char *line, const char **runThis)
 		}
 		if (!cxQuit(context, 0))
 			return false;
-		undoCompare();
+		undoClear();
 		cw->undoable = cw->changeMode = false;
 		undoSpecialClear();
 		cmd = 'e';
@@ -4679,7 +7293,7 @@ down_again:
 	}
 
 	if (stringEqual(line, "re") || stringEqual(line, "rea")) {
-		undoCompare();
+		undoClear();
 		cw->undoable = false;
 		cmd = 'e';	/* so error messages are printed */
 		rc = setupReply(line[2] == 'a');
@@ -4978,6 +7592,9 @@ pwd:
 		return true;
 	}
 
+	if (stringEqual(line, "redo"))
+		return undoStep(true);
+
 	if (stringEqual(line, "ub") || stringEqual(line, "et")) {
 		Frame *f, *fnext;
 		struct histLabel *label, *lnext;
@@ -4987,7 +7604,7 @@ pwd:
 			setError(MSG_NoBrowse);
 			return false;
 		}
-		undoCompare();
+		undoClear();
 		cw->undoable = false;
 		undoSpecialClear();
 		cw->browseMode = cf->browseMode = false;
@@ -5007,8 +7624,11 @@ pwd:
 		} else {
 et_go:
 			cw->f_dot = 0;
-			for (i = 1; i <= cw->dol; ++i)
-				removeHiddenNumbers(cw->map[i].text, '\n');
+			for (i = 1; i <= cw->dol; ++i) {
+				pst s = mapLine(cw->map, i)->text;
+				removeHiddenNumbers(s, '\n');
+				mapSetText(cw->map, i, s, pstLength(s));
+			}
 			freeWindowLines(cw->r_map);
 			cw->r_map = 0;
 		}
@@ -5296,6 +7916,11 @@ et_go:
 		return true;
 	}
 
+	if (stringEqual(line, "fnlist")) {
+		fnList();
+		return true;
+	}
+
 	if (stringEqual(line, "bflist")) {
 		for (n = 1; n <= maxSession; ++n) {
 			Window *lw = sessionList[n].lw;
@@ -5445,6 +8070,38 @@ et_go:
 		return true;
 	}
 
+	if (stringEqual(line, "wt")) {
+		writeTemp ^= 1;
+		if (helpMessagesOn || debugLevel >= 1)
+			i_puts(writeTemp + MSG_WriteInPlace);
+		return true;
+	}
+
+	if (stringEqual(line, "wt+") || stringEqual(line, "wt-")) {
+		writeTemp = (line[2] == '+');
+		if (helpMessagesOn)
+			i_puts(writeTemp + MSG_WriteInPlace);
+		return true;
+	}
+
+	if (stringEqual(line, "tri")) {
+		cw->triMode ^= 1;
+		if (!cw->triMode)
+			mapUnindex(cw->map), mapUnindex(cw->r_map);
+		if (helpMessagesOn || debugLevel >= 1)
+			i_puts(cw->triMode + MSG_TrigramOff);
+		return true;
+	}
+
+	if (stringEqual(line, "tri+") || stringEqual(line, "tri-")) {
+		cw->triMode = (line[3] == '+');
+		if (!cw->triMode)
+			mapUnindex(cw->map), mapUnindex(cw->r_map);
+		if (helpMessagesOn)
+			i_puts(cw->triMode + MSG_TrigramOff);
+		return true;
+	}
+
 	if (stringEqual(line, "rl")) {
 		inputReadLine ^= 1;
 		if (helpMessagesOn || debugLevel >= 1)
@@ -5654,6 +8311,30 @@ et_go:
 		return true;
 	}
 
+	if (stringEqual(line, "dbtime")) {
+		timeCommands ^= 1;
+		if (helpMessagesOn || debugLevel >= 1)
+			i_puts(timeCommands + MSG_TimeOff);
+		return true;
+	}
+
+	if (stringEqual(line, "dbtime+") || stringEqual(line, "dbtime-")) {
+		timeCommands = (line[6] == '+');
+		if (helpMessagesOn)
+			i_puts(timeCommands + MSG_TimeOff);
+		return true;
+	}
+
+	if (stringEqual(line, "memlist")) {
+		memList();
+		return true;
+	}
+
+	if (stringEqual(line, "cmdlist")) {
+		cmdList();
+		return true;
+	}
+
 	if (stringEqual(line, "tmlist")) {
 		showTimers();
 		return true;
@@ -5829,7 +8510,7 @@ et_go:
 		}
 		if (!cxQuit(context, 0))
 			return false;
-		undoCompare();
+		undoClear();
 		cw->undoable = cw->changeMode = false;
 		undoSpecialClear();
 		freeWindows(context, false);
@@ -5849,7 +8530,7 @@ et_go:
 		rc = ircSetup(p);
 		nzFree(p);
 		if(rc && cw->ircoMode) {
-			undoCompare();
+			undoClear();
 			cw->undoable = cw->changeMode = false;
 		}
 		return rc;
@@ -6186,6 +8867,10 @@ bool runCommand(const char *line)
 		line = newline;
 	}
 
+// finish the load before the range is set from the lines loaded so far
+	if (loadNeeded(line) && !loadFinish())
+		return (globSub = false);
+
 	startRange = endRange = cw->dot;	/* default range */
 /* Just hit return to read the next line. */
 	first = *line;
@@ -6229,7 +8914,8 @@ bool runCommand(const char *line)
 	if (first == 'w' || first == 'v' || (first == 'g' && line[1]
 					     && strchr(valid_delim, line[1])
 					     && !stringEqual(line, "g-")
-					     && !stringEqual(line, "g?"))) {
+					     && !stringEqual(line, "g?")) ||
+	    !strncmp(line, "sort", 4)) {
 		didRange = true;
 		startRange = 1;
 		if (cw->dol == 0)
@@ -6331,6 +9017,15 @@ range2:
 		line = "s`bl";
 	}
 
+	if (!strncmp(line, "sort", 4)) {
+		if (globSub) {
+			cmd = 'g';
+			setError(MSG_GlobalCommand2, "sort");
+			return false;
+		}
+		return sortRange(line + 4);
+	}
+
 expctr:
 /* special commands to expand and contract frames */
 	if (stringEqual(line, "exp") || stringEqual(line, "ctr")) {
@@ -6496,10 +9191,9 @@ replaceframe:
 		char *oldline = undoSpecial;
 		int len;
 		char src[ABSPATH], *dest, *t;
-		struct lineMap *mptr;
 		cw->dot = undo1line;
 		p = (char *)fetchLine(cw->dot, -1);
-		len = pstLength((pst) p);
+		len = mapLine(cw->map, cw->dot)->len;
 		p[len - 1] = 0;	/* temporary */
 		t = makeAbsPath(p);
 		p[len - 1] = '\n';
@@ -6520,14 +9214,19 @@ replaceframe:
 		p[len - 1] = 0;
 		undoSpecial = cloneString(p);
 		p[len - 1] = '\n';
-		mptr = cw->map + cw->dot;
 		len = strlen(oldline);
 		oldline[len] = '\n';
-		mptr->text = (pst)oldline;
+		mapSetText(cw->map, cw->dot, (pst)oldline, len + 1);
 		printDot();
 		return true;
 	}
 
+// write, read, or browse the current buffer, needs the whole file,
+// even if a range in front of it didn't
+	if ((cmd == 'w' || cmd == 'r' || (cmd == 'b' && !first)) &&
+	    !loadFinish())
+		return (globSub = false);
+
 	if (cw->dirMode && !strchr(dir_cmd, cmd)) {
 		setError(MSG_DirCommand, icmd);
 		return (globSub = false);
@@ -6625,7 +9324,7 @@ replaceframe:
 dest_ok:
 				cmd = 'e';
 				j = moveFiles(startRange, endRange, j, icmd, relative);
-				undoCompare();
+				undoClear();
 				cw->undoable = false;
 				undoSpecialClear();
 				return j;
@@ -6729,23 +9428,8 @@ if((cmd == 'e' || cmd == 'b') && (cw->irciMode | cw->ircoMode) && postSpace) {
 		return balanceLine(line, endRange);
 	}
 
-	if (cmd == 'u') {
-		Window *uw = &undoWindow;
-		struct lineMap *swapmap;
-		if (!cw->undoable) {
-			setError(MSG_NoUndo);
-			return false;
-		}
-/* swap, so we can undo our undo, if need be */
-		i = uw->dot, uw->dot = cw->dot, cw->dot = i;
-		i = uw->dol, uw->dol = cw->dol, cw->dol = i;
-		for (j = 0; j < MARKLETTERS; ++j) {
-			i = uw->labels[j], uw->labels[j] =
-			    cw->labels[j], cw->labels[j] = i;
-		}
-		swapmap = uw->map, uw->map = cw->map, cw->map = swapmap;
-		return true;
-	}
+	if (cmd == 'u')
+		return undoStep(false);
 
 	if (cmd == 'k') {
 		if (!islowerByte(first) || line[1]) {
@@ -6882,7 +9566,7 @@ if((cmd == 'e' || cmd == 'b') && (cw->irciMode | cw->ircoMode) && postSpace) {
 				if(i == 0) // empty buffer
 					continue;
 				pst s = fetchLine(i, (cw->browseMode ? 1 : -1));
-				int len = pstLength(s);
+				int len = (cw->browseMode ? pstLength(s) : mapLine(cw->map, i)->len);
 				if (i == cw->dol && cw->nlMode)
 					--len;
 				l += len;
@@ -6895,7 +9579,7 @@ if((cmd == 'e' || cmd == 'b') && (cw->irciMode | cw->ircoMode) && postSpace) {
 				if(i == 0) // empty buffer
 					continue;
 				pst s = fetchLine(i, (cw->browseMode ? 1 : -1));
-				int len = pstLength(s);
+				int len = (cw->browseMode ? pstLength(s) : mapLine(cw->map, i)->len);
 				if (i == cw->dol && cw->nlMode)
 					--len;
 // in directory mode we don't write the suffix or attribute information
@@ -6945,6 +9629,10 @@ if((cmd == 'e' || cmd == 'b') && (cw->irciMode | cw->ircoMode) && postSpace) {
 			setError(MSG_NoDBWrite);
 			return false;
 		}
+		if (cw->partLoad && stringEqual(line, cf->fileName)) {
+			setError(MSG_PartLoad);
+			return false;
+		}
 		return writeFile(line, writeMode);
 	}
 
@@ -7021,7 +9709,7 @@ if((cmd == 'e' || cmd == 'b') && (cw->irciMode | cw->ircoMode) && postSpace) {
 		if (cxActive(cx, false) && !cxQuit(cx, 2))
 			return false;
 // If changes were made to this buffer, they are undoable after the move
-		undoCompare();
+		undoClear();
 		cw->undoable = false;
 		undoSpecialClear();
 		if(!scx || debugLevel >= 1)
@@ -7043,7 +9731,7 @@ if((cmd == 'e' || cmd == 'b') && (cw->irciMode | cw->ircoMode) && postSpace) {
 			return false;
 		if (!(a = showLinks()))
 			return false;
-		undoCompare();
+		undoClear();
 		cw->undoable = cw->changeMode = false;
 		undoSpecialClear();
 		w = createWindow();
@@ -7078,7 +9766,7 @@ if((cmd == 'e' || cmd == 'b') && (cw->irciMode | cw->ircoMode) && postSpace) {
 		}
 		cw->dot = endRange;
 		p = (char *)fetchLine(endRange, -1);
-		j = pstLength((pst) p);
+		j = mapLine(cw->map, endRange)->len;
 		--j;
 		p[j] = 0;	/* temporary */
 		dirline = makeAbsPath(p);
@@ -7108,7 +9796,7 @@ if((cmd == 'e' || cmd == 'b') && (cw->irciMode | cw->ircoMode) && postSpace) {
 		char *dirline;
 		const struct MIMETYPE *gmt = 0;	/* the go mime type */
 		p = (char *)fetchLine(endRange, -1);
-		j = pstLength((pst) p);
+		j = mapLine(cw->map, endRange)->len;
 		--j;
 		for(i = 0; i < j; ++i)
 			if(!p[i])
@@ -7475,7 +10163,7 @@ rebrowse:
 // did you make changes that you didn't write?
 		if (!cxQuit(context, 0))
 			return false;
-		undoCompare();
+		undoClear();
 		cw->undoable = cw->changeMode = false;
 		undoSpecialClear();
 		startRange = endRange = 0;
@@ -7683,7 +10371,6 @@ redirect:
 	if (cmd == 'g' || cmd == 'v') {
 		undoSpecialClear();
 		rc =  doGlobal(line);
-		nzFree(gflag), gflag = 0;
 		return rc;
 	}
 
@@ -7718,14 +10405,14 @@ redirect:
 	if (cmd == 'd' || cmd == 'D') {
 		if (cw->dirMode) {
 			j = delFiles(startRange, endRange, true, icmd, &cmd);
-			undoCompare();
+			undoClear();
 			cw->undoable = false;
 			undoSpecialClear();
 			goto afterdelete;
 		}
 		if (cw->sqlMode) {
 			j = sqlDelRows(startRange, endRange);
-			undoCompare();
+			undoClear();
 			cw->undoable = false;
 			goto afterdelete;
 		}
@@ -7816,11 +10503,23 @@ afterdelete:
 bool edbrowseCommand(const char *line, bool script)
 {
 	bool rc;
+	static int depth;
+	bool timed = (timeCommands && !depth);
+	struct cmdClock start;
 	intFlag = false;
 	inscript = script;
 	fileSize = -1;
 	skipWhite(&line);
+	if (timed) {
+		cmdClockRead(&start);
+		allocCounting = true;
+	}
+	++depth;
 	rc = runCommand(line);
+	--depth;
+	if (timed && timeCommands)
+		cmdClockStop(line, &start);
+	allocCounting = timeCommands && depth;
 	if (fileSize >= 0)
 		debugPrint(1, "%lld", fileSize);
 	fileSize = -1;
@@ -7975,7 +10674,7 @@ bool browseCurrentBuffer(void)
 /* No harm in running this code in mail client, but no help either,
  * and it begs for bugs, so leave it out. */
 	if (!ismc) {
-		undoCompare();
+		undoClear();
 		cw->undoable = false;
 	}
 
@@ -8020,6 +10719,9 @@ bool browseCurrentBuffer(void)
 	cw->dot = cw->dol = 0;
 	cw->r_map = cw->map;
 	cw->map = 0;
+	nzFree(cw->tagLines);
+	cw->tagLines = 0;
+	cw->tagLinesSize = 0;
 	memcpy(cw->r_labels, cw->labels, sizeof(cw->labels));
 	memset(cw->labels, 0, sizeof(cw->labels));
 	j = strlen(newbuf);
@@ -8056,29 +10758,51 @@ char **p1_p, char **p2_p,
 char **s_p, char **t_p)
 {
 	int ln, n;
-	char *p, *s = 0, *t, c;
+	char *p, *s, *t, c;
 	char search[20];
 	char searchend[4];
+	bool built = false;
 
 	sprintf(search, "%c%d<", InternalCodeChar, tagno);
 	sprintf(searchend, "%c0>", InternalCodeChar);
 	n = strlen(search);
-	for (ln = 1; ln <= cw->dol; ++ln) {
+	if (!cw->tagLines)
+		tagLinesBuild(), built = true;
+
+// the index says where the field should be
+again:
+	ln = (tagno < cw->tagLinesSize ? cw->tagLines[tagno] : 0);
+	if (!ln)
+		return false;
+	s = 0;
+	if (ln <= cw->dol) {
 		p = (char *)fetchLine(ln, -1);
-		if(s) goto look4end;
 		for (s = p; (c = *s) != '\n'; ++s) {
 			if (c != InternalCodeChar)
 				continue;
 			if (!strncmp(s, search, n))
 				break;
 		}
-		if (c == '\n') { s = 0; continue; }
-		s = strchr(s, '<') + 1;
-		*ln1_p = ln;
-		*p1_p = p;
-		*s_p = s;
-look4end:
-		t = (ln == *ln1_p ? s : p);
+		if (c == '\n')
+			s = 0;
+	}
+	if (!s) {
+// the buffer changed in a way the index didn't see
+		if (built)
+			return false;
+		debugPrint(4, "rebuild tag lines for %d", tagno);
+		tagLinesBuild(), built = true;
+		goto again;
+	}
+	s = strchr(s, '<') + 1;
+	*ln1_p = ln;
+	*p1_p = p;
+	*s_p = s;
+
+// a textarea can run across lines
+	for (t = s; ln <= cw->dol; ++ln) {
+		if (ln > *ln1_p)
+			t = p = (char *)fetchLine(ln, -1);
 		for (; (c = *t) != '\n'; ++t)
 			if(!strncmp(t, searchend, 3)) break;
 		if(c == '\n') continue;
@@ -8111,7 +10835,7 @@ char *getFieldFromBuffer(int tagno, int ln0)
 	stringAndChar(&a, &len, '\n');
 	for(; ln1 < ln2; ++ln1) {
 		p1 = (char*)fetchLine(ln1, -1);
-		j = pstLength((pst)p1);
+		j = mapLine(cw->map, ln1)->len;
 		stringAndBytes(&a, &len, p1, j);
 		a[len-1] = '\r';
 	stringAndChar(&a, &len, '\n');
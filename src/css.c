@@ -1787,6 +1787,60 @@ void cssFree(Frame *f)
 	f->cssmaster = 0;
 }
 
+static long long chainMemory(const struct asel *asel)
+{
+	long long n = 0;
+	const struct mod *mod;
+	for (; asel; asel = asel->next) {
+		n += sizeof(struct asel);
+		if (asel->part)
+			n += strlen(asel->part) + 1;
+		if (asel->tag)
+			n += strlen(asel->tag) + 1;
+		for (mod = asel->modifiers; mod; mod = mod->next) {
+			n += sizeof(struct mod);
+			if (mod->part)
+				n += strlen(mod->part) + 1;
+			n += chainMemory(mod->notchain);
+		}
+	}
+	return n;
+}
+
+// Bytes held by the css of a frame, for memlist;
+// returns the number of descriptors.
+int cssMemory(const Frame *f, long long *bytes)
+{
+	const struct cssmaster *cm = f->cssmaster;
+	const struct desc *d;
+	const struct sel *sel;
+	const struct rule *r;
+	const struct shortcache *c;
+	long long n = 0;
+	int count = 0;
+	if (cm) {
+		n = sizeof(struct cssmaster);
+		for (d = cm->descriptors; d; d = d->next, ++count) {
+// lhs and rhs are pieces of the one base string
+			n += sizeof(struct desc) + strlen(d->lhs) + 1;
+			if (d->rhs)
+				n += strlen(d->rhs) + 1;
+			for (sel = d->selectors; sel; sel = sel->next)
+				n += sizeof(struct sel) + chainMemory(sel->chain);
+			for (r = d->rules; r; r = r->next) {
+				n += sizeof(struct rule) + strlen(r->atname) + 1;
+				if (r->atval)
+					n += strlen(r->atval) + 1;
+			}
+		}
+		for (c = cm->cache; c; c = c->next)
+			n += sizeof(struct shortcache) + strlen(c->url) + 1 +
+			    (c->data ? strlen(c->data) + 1 : 0);
+	}
+	*bytes = n;
+	return count;
+}
+
 // for debugging
 static FILE *cssfile;
 static void chainPrint(struct asel *asel)
@@ -3251,7 +3305,7 @@ static void hashBuild(void)
 		t = doclist[i];
 		if (!(t->nodeName && t->nodeName[0]))
 			continue;
-		h[j].key = t->nodeNameU;
+		h[j].key = (char *)t->nodeNameU;
 		h[j].t = t;
 		++j;
 	}
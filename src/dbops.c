@@ -1320,7 +1320,7 @@ void sql_unfold(int start, int end, char action)
 			((start <= ln && end >= ln) ||
 			(start <= ln + nc && end >= ln + nc) ||
 			(start > ln && end < ln + nc))) {
-				free((char*)s);
+				freeLineText((pst)s);
 // how many pipes do we need to escape?
 				len2 = 0;
 				for(j = 1; j <= nc; ++j) {
@@ -1340,15 +1340,19 @@ void sql_unfold(int start, int end, char action)
 						*w++ = *s;
 					}
 					*w++ = '|';
-					free((char*)s0);
+					freeLineText((pst)s0);
 				}
 				w[-1] = '\n';
 				cw->dot = ln2;
-				newmap[ln2++].text = (pst)v;
+				newmap[ln2].text = (pst)v;
+				newmap[ln2++].len = w - v;
 			} else {
 // no change, just copy
-				for(j = 0; j <= nc; ++j)
-					newmap[ln2 + j].text = cw->map[ln + j].text;
+				for(j = 0; j <= nc; ++j) {
+					const struct lineMap *t = mapLine(cw->map, ln + j);
+					newmap[ln2 + j].text = t->text;
+					newmap[ln2 + j].len = t->len;
+				}
 				ln2 += nc + 1;
 			}
 			ln += nc;
@@ -1357,7 +1361,8 @@ void sql_unfold(int start, int end, char action)
 		if((action == '+' || action == 0) &&
 		start <= ln && end >= ln) {
 			cw->dot = ln2;
-			newmap[ln2++].text = clonePstring((pst)RowStart);
+			newmap[ln2].text = clonePstring((pst)RowStart);
+			newmap[ln2++].len = pstLength((pst)RowStart);
 // I'm going to muck with the line, cause we're going to free it anyways.
 			intoFields((char*)s);
 			for(j = 0; j < nc; ++j) {
@@ -1373,17 +1378,21 @@ void sql_unfold(int start, int end, char action)
 				}
 				*w = '\n';
 				newmap[ln2 + j].text = (pst)v;
+				newmap[ln2 + j].len = w + 1 - v;
 			}
 			ln2 += nc;
-			free((char*)s);
+			freeLineText((pst)s);
 		} else {
 // no change, just copy
-			newmap[ln2++].text = cw->map[ln].text;
+			const struct lineMap *t = mapLine(cw->map, ln);
+			newmap[ln2].text = t->text;
+			newmap[ln2++].len = t->len;
 		}
 	}
 
-	free(cw->map);
-	cw->map = newmap;
+	mapFree(cw->map);
+	cw->map = mapCreate(newmap + 1, newdol);
+	free(newmap);
 	cw->dol = newdol;
 }
 
@@ -265,6 +265,8 @@ extern int debugLevel;		/* 0 to 9 */
 extern bool debugClone, debugEvent, debugThrow, debugCSS, dhs, debugLayout;
 extern bool demin; // deminimize javascript
 extern bool uvw; // trace points
+extern bool allocCounting; // count calls to allocMem and friends
+extern long long allocCalls, allocBytes;
 extern bool gotimers; // run javascript timers
 extern int timerspeed; // slowdown factor for javascript timers
 extern int rr_interval; // rerender the screen after this many seconds
@@ -300,6 +302,7 @@ extern bool isInteractive;
 extern volatile bool intFlag;	/* set this when interrupt signal is caught */
 extern time_t intStart;
 extern bool binaryDetect;
+extern bool writeTemp;
 extern bool inputReadLine;
 extern bool curlAuthNegotiate;  /* try curl negotiate (SPNEGO) auth */
 extern bool listNA;		/* list nonascii chars */
@@ -351,6 +354,7 @@ extern char *cookieFile;	/* persistent cookies */
 extern char *cacheDir;	/* directory for a persistent cache of http pages */
 extern int cacheSize; // in megabytes
 extern int cacheCount; // number of cache files
+extern int globalThreads; // threads for g// and sort, 0 for one per core
 
 // General link list. This is, interestingly, the same design
 // that Fabrice came up with for his quickjs project.
@@ -368,10 +372,40 @@ struct listHead {
 (e) = ((struct listHead *)e)->prev)
 
 // Point to the text of a line.
+// len is the length of the text with its newline, what pstLength() would say.
+// Whoever sets text sets len.
 struct lineMap {
 	pst text;
+	int len;
+	bool gflag;		// marked by g// or v//
 };
 #define LMSIZE sizeof(struct lineMap)
+
+/*********************************************************************
+The lines of a buffer are held in chunks of a few thousand lines each.
+Inserting or deleting lines only shifts the lines in one chunk,
+rather than copying the entire map, which could be 50 million lines.
+Each chunk knows the line number it starts at,
+so a binary search finds the chunk for any line.
+Don't index into the chunks; call mapLine(map, n) to reach line n.
+*********************************************************************/
+
+struct triChunk;
+
+struct mapChunk {
+	int start;		// line number of the first line in this chunk
+	int count, alloc;
+	struct lineMap *lines;
+	struct triChunk *tri;	// trigram index of these lines, or 0
+};
+
+struct bufMap {
+	struct mapChunk *chunks;
+	int nchunks, allocChunks;
+	int lines;
+	int hint;		// the last chunk we looked at, access is often sequential
+	long long bytes;	// sum of len over all the lines
+};
 #define DTSIZE 2 // size of directory type
 
 /* an edbrowse frame, as when there are many frames in an html page.
@@ -440,7 +474,7 @@ struct ebWindow {
 	char *saveURL;		// for the fu command
 	char *mailInfo;
 	char lhs[MAXRE], rhs[MAXRE];	/* remembered substitution strings */
-	struct lineMap *map, *r_map;
+	struct bufMap *map, *r_map;
 	struct listHead lines, r_lines;
 	char *dmap; // for directory listing
 /* The labels that you set with the k command, and access via 'x.
@@ -456,6 +490,13 @@ struct ebWindow {
  * and used thereafter for hyperlinks, fill-out forms, etc. */
 	struct htmlTag **tags;
 	int numTags, allocTags, deadTags;
+// the tags and their names live in these blocks, see tagArena() in html-tags.c
+	struct tagBlock *tagBlocks, *coldBlocks;
+	const char **tagNames; // interned tag and attribute names
+	int tagNamesSize, tagNamesUsed;
+// line of each input field in the buffer, see locateTagInBuffer() in buffers.c
+	int *tagLines;
+	int tagLinesSize;
 int ehsn;
 	struct htmlTag *scriptlist, *inputlist, *optlist, *linklist;
 	struct htmlTag *framelist;
@@ -468,6 +509,7 @@ int ehsn;
 	bool binMode:1;		/* binary file */
 	bool nlMode:1;		/* newline at the end */
 	bool rnlMode:1;
+	bool partLoad:1; // the background load stopped short of the end of the file
 /* Various text modes, these are incompatible with binMode */
 /* All modes convert to utf8, as that is what pcre understands. */
 	bool utf8Mode:1;
@@ -485,6 +527,7 @@ int ehsn;
 	bool sqlMode:1;		// accessing a table
 	bool irciMode:1;		// input irc
 	bool ircoMode:1;		// output irc
+	bool triMode:1;		// trigram index for searches
 	bool ircChannels:1; // show channel when displaying messages
 	bool ircSecure:1; // ssl connection
 	int irc_fd; // file descriptor for socket
@@ -536,6 +579,11 @@ struct tagInfo {
 	ushort bits;		/* a bunch of boolean attributes */
 };
 extern const struct tagInfo availableTags[];
+// perfect hash tables for tags and entities, generated into taghash.c
+extern const int tagHashBuckets, tagHashSize;
+extern const short tagHashDisp[], tagHashSlot[];
+extern const int andHashBuckets, andHashSize;
+extern const short andHashDisp[], andHashSlot[];
 
 // Information on tagInfo->bits
 // support innerHTML
@@ -548,30 +596,39 @@ extern const struct tagInfo availableTags[];
 /* The structure for an html tag.
  * These tags are at times linked with js objects,
  * or even created by js objects. */
-struct htmlTag {
-// maintain a tree structure
-	struct htmlTag *parent, *firstchild, *sibling;
-	struct htmlTag *same; // same action
-	struct ebFrame *f0; // frame that owns this tag
-	struct ebFrame *f1; // subordinate frame if this is a <frame> tag
-	jsobjtype jv;		// javascript value
-	int seqno; // tag sequence number in this window
-	int gsn; // global sequence number, for rooting
+/* Fields of a tag that are seldom used, kept out of the way of the tree walks.
+ * newTag() allocates this with the tag, in blocks of their own,
+ * so the tags themselves are packed together. */
+struct tagCold {
 	char *js_file;
-	int js_ln;			// line number of javascript
-	int lic;		// list item count, highly overloaded
-	int slic; /* start list item count */
-	int action;
-	const struct tagInfo *info;
-	char *textval;	/* for text tags only */
-	const char **attributes;
-	const char **atvals;
-/* the form that owns this input tag */
-	struct htmlTag *controller;
+	char *custom_h; // http headers for a frame or xhr tag
+	char *innerHTML; /* the html string under this tag */
+	const char *rvalue; /* for reset */
 	pthread_t loadthread;
 	long hcode;
 	bool loadsuccess;
+	int inner;		/* for inner html */
+};
+
+/* The fields that traverseAll, render, and the css matchers look at
+ * for every node come first, in one cache line:
+ * the tree, the kind of tag, and the flags. */
+struct htmlTag {
+// maintain a tree structure
+	struct htmlTag *parent, *firstchild, *sibling;
+	const struct tagInfo *info;
+	int action;
+	int seqno; // tag sequence number in this window
 	uchar step; // prerender, decorate, load script, runscript
+	char subsup;		/* span turned into sup or sub */
+	uchar itype;		// input type =
+	uchar itype_minor;
+#define DIS_INVISIBLE 1
+#define DIS_HOVER 2
+#define DIS_COLOR 3
+#define DIS_TRANSPARENT 4
+#define DIS_HOVERCOLOR 5
+	uchar disval; // displayable value for the node
 	bool slash:1;		/* as in </A> */
 	bool textin:1; /* <a> some text </a> */
 	bool deleted:1; /* deleted from the current buffer */
@@ -609,15 +666,19 @@ struct htmlTag {
 	bool iscolor:1;
 	bool ur:1;		// row unfolded, only for trf
 	bool inur:1;		// in ur command
-	char subsup;		/* span turned into sup or sub */
-	uchar itype;		// input type =
-	uchar itype_minor;
-#define DIS_INVISIBLE 1
-#define DIS_HOVER 2
-#define DIS_COLOR 3
-#define DIS_TRANSPARENT 4
-#define DIS_HOVERCOLOR 5
-	uchar disval; // displayable value for the node
+	struct htmlTag *same; // same action
+	struct ebFrame *f0; // frame that owns this tag
+	struct ebFrame *f1; // subordinate frame if this is a <frame> tag
+	jsobjtype jv;		// javascript value
+	int gsn; // global sequence number, for rooting
+	int js_ln;			// line number of javascript
+	int lic;		// list item count, highly overloaded
+	int slic; /* start list item count */
+	char *textval;	/* for text tags only */
+	const char **attributes;
+	const char **atvals;
+/* the form that owns this input tag */
+	struct htmlTag *controller;
 	int ninp;		/* number of nonhidden inputs */
 
 /*********************************************************************
@@ -627,7 +688,8 @@ Standard tags like p and div are case insensitive. </p> closes <P>
 p {rule} in css matches P, and so on.
 These tags become upper case in js Element.nodeName.
 t->nodeName holds the tag as written, t->nodeNameU is the upper case version.
-newTag() copies name into nodeName, then upshifts it for nodeNameU.
+newTag() points nodeName at name, and nodeNameU at its upper case,
+both interned in the window, and not to be changed or freed.
 These fields are not used to build dynamic tags, those made by running js.
 newTag() populates them always, but they are (primarily) used when parsing html,
 and doing the bulk match of css, before js runs.
@@ -653,14 +715,11 @@ and I'm sure they don't agree, and I'm sure neither is complete.
 We need to review all this some day.
 *********************************************************************/
 
-	char *nodeName, *nodeNameU;
+	const char *nodeName, *nodeNameU;
 // class is reserved word in c++, so use jclass for javascript class
 	char *name, *id, *jclass, *value, *href;
-	const char *rvalue; /* for reset */
-	char *custom_h; // http headers for a frame or xhr tag
-	char *innerHTML; /* the html string under this tag */
-	int inner;		/* for inner html */
 	int highspec; // specificity of a selector that matches this node
+	struct tagCold *cold;
 };
 
 typedef struct htmlTag Tag;
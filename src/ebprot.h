@@ -10,6 +10,9 @@ we need to indicate that all the other functions are straight C.
 extern "C" {
 #endif
 
+// sourcefile=bench.c
+void benchMark(int argc, char **argv);
+
 // sourcefile=buffers.c
 void setHistcontrol(void);
 void undoSpecialClear(void);
@@ -19,6 +22,17 @@ void displayLine(int n);
 void printDot(void);
 void initializeReadline(void);
 pst inputLine(void);
+void unmapFile(const char *filename);
+pst shareLine(pst p);
+void freeLineText(pst p);
+struct lineMap *mapLine(struct bufMap *m, int n);
+struct bufMap *mapCreate(const struct lineMap *piece, int n);
+struct bufMap *mapInsert(struct bufMap *m, int after, const struct lineMap *piece, int n);
+struct bufMap *mapDelete(struct bufMap *m, int start, int end);
+void mapCopyOut(struct bufMap *m, int start, int end, struct lineMap *dest);
+void mapSetText(struct bufMap *m, int n, pst text, int len);
+void mapRecount(struct bufMap *m);
+void mapFree(struct bufMap *m);
 bool cxCompare(int cx) ;
 bool cxActive(int cx, bool error);
 bool cxQuit(int cx, int action) ;
@@ -26,8 +40,10 @@ void cxSwitch(int cx, bool interactive) ;
 void addToMap(int nlines, int destl);
 bool addTextToBuffer(const pst inbuf, int length, int destl, bool showtrail) ;
 void delText(int start, int end) ;
+void loadBackground(void);
 bool readFileArgv(const char *filename, int fromframe, const char *orig_head);
 bool writeFile(const char *name, int mode);
+void indexBackground(void);
 Tag *line2frame(int ln);
 bool jump2anchor(const Tag *jumptag, const char *newhash);
 bool runCommand(const char *line);
@@ -80,10 +96,13 @@ bool isEmailAddress(const char *s);
 int byteOrderMark(const uchar *buf, int buflen);
 bool looksBinary(const unsigned char *buf, int buflen);
 void looks_8859_utf8(const uchar *buf, int buflen, bool * iso_p, bool * utf8_p);
+int iso2utfTo(const uchar *inbuf, int inbuflen, uchar *outbuf);
 void iso2utf(const uchar *inbuf, int inbuflen, uchar **outbuf_p, int *outbuflen_p);
+int utf2isoTo(const uchar *inbuf, int inbuflen, uchar *outbuf);
 void utf2iso(const uchar *inbuf, int inbuflen, uchar **outbuf_p, int *outbuflen_p);
 void utf2iso1(char *s, size_t *lenp);
 char *iso12utf(const char *t1, const char *t2, int *lenp);
+int utfHighTo(const char *inbuf, int inbuflen, char *outbuf, bool inutf8, bool out32, bool outbig);
 void utfHigh(const char *inbuf, int inbuflen, char **outbuf_p, int *outbuflen_p, bool inutf8, bool out32, bool outbig);
 char *uni2utf8(unsigned int unichar);
 void utfLow(const char *inbuf, int inbuflen, char **outbuf_p, int *outbuflen_p, int bom);
@@ -162,8 +181,10 @@ void htmlScanner(const char *htmltext, Tag *above, bool isgen);
 void setTagAttr(Tag *t, const char *name, char *val);
 const char *attribVal(const Tag *t, const char *name);
 bool attribPresent(const Tag *t, const char *name);
+const struct tagInfo *findTagInfo(const char *name);
 Tag *newTag(const Frame *f, const char *tagname);
 void freeTags(struct ebWindow *w);
+int tagMemory(const Window *w, long long *bytes);
 void initTagArray(void);
 void traverseAll(void);
 Tag *findOpenTag(Tag *t, int action);
@@ -209,6 +230,7 @@ const char *findAgentForURL(const char *url);
 const char *mailRedirect(const char *to, const char *from, const char *reply, const char *subj);
 int runEbFunction(const char *line);
 const char *getInputLineFromScript(void);
+void fnList(void);
 struct DBTABLE *findTableDescriptor(const char *sn);
 struct DBTABLE *newTableDescriptor(const char *name);
 bool readConfigFile(void);
@@ -261,6 +283,12 @@ int stringIsNum(const char *s) ;
 bool stringIsDate(const char *s) ;
 bool stringIsFloat(const char *s, double *dp) ;
 bool memEqualCI(const char *s, const char *t, int len) ;
+const uchar *memSearch(const uchar *text, int tlen, const uchar *needle, int nlen, bool ci) ;
+bool memHighBytes(const uchar *s, int len) ;
+int memAsciiSpan(const uchar *s, int len) ;
+void asciiWiden16(const uchar *s, int len, uchar *out, bool big) ;
+int memScanSet(const uchar *s, int len, const char *set) ;
+int memCountByte(const uchar *s, int len, uchar c) ;
 const char *stringInBufLine(const char *s, const char *t);
 bool stringEqual(const char *s, const char *t) ;
 bool stringEqualCI(const char *s, const char *t) ;
@@ -398,6 +426,7 @@ void writeShortCache(void);
 bool matchMedia(char *t);
 void cssDocLoad(int frameNumber, char *s, bool pageload);
 void cssFree(Frame *f);
+int cssMemory(const Frame *f, long long *bytes);
 Tag **querySelectorAll(const char *selstring, Tag *top);
 Tag *querySelector(const char *selstring, Tag *top);
 bool querySelector0(const char *selstring, Tag *top);
@@ -420,6 +449,7 @@ void delPendings(const Frame *f);
 void js_main(void);
 void createJSContext(Frame *f);
 void freeJSContext(Frame *f);
+long long jsMemory(void);
 void run_ontimer(const Frame *f, const char *backlink);
 int run_function_onearg_t(const Tag *t, const char *name, const Tag *t2);
 int run_function_onearg_win(const Frame *f, const char *name, const Tag *t2);
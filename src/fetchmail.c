@@ -3287,13 +3287,10 @@ nextline:
 	repln = strchr(linetype, 'r') - linetype;
 	subln = strchr(linetype, 's') - linetype;
 	if (repln != 1) {
-		struct lineMap *map = cw->map;
-		struct lineMap swap;
-		struct lineMap *q1 = map + 1;
-		struct lineMap *q2 = map + repln;
-		swap = *q1;
-		*q1 = *q2;
-		*q2 = swap;
+		struct lineMap q1 = *mapLine(cw->map, 1);
+		struct lineMap q2 = *mapLine(cw->map, repln);
+		mapSetText(cw->map, 1, q2.text, q2.len);
+		mapSetText(cw->map, repln, q1.text, q1.len);
 		if (subln == 1)
 			subln = repln;
 		repln = 1;
@@ -3301,13 +3298,10 @@ nextline:
 
 	j = strlen(linetype) - 1;
 	if (j != subln) {
-		struct lineMap *map = cw->map;
-		struct lineMap swap;
-		struct lineMap *q1 = map + j;
-		struct lineMap *q2 = map + subln;
-		swap = *q1;
-		*q1 = *q2;
-		*q2 = swap;
+		struct lineMap q1 = *mapLine(cw->map, j);
+		struct lineMap q2 = *mapLine(cw->map, subln);
+		mapSetText(cw->map, j, q2.text, q2.len);
+		mapSetText(cw->map, subln, q1.text, q1.len);
 	}
 
 	readReplyInfo();
@@ -1517,10 +1517,41 @@ I'm gonna go with those, and hope I'm right more often than wrong.
 	 0xfa, 0x171, 0xfc, 0xfd, 0x163, 0x2d9},
 };
 
+/*********************************************************************
+The conversions below come in two flavors.
+iso2utf() and the like allocate the result, for a line or a string.
+iso2utfTo() and the like write into a buffer that the caller provides,
+for writing a file a block at a time, with the space used again and again.
+iso2utfTo needs 3 bytes out for each byte in, plus 1,
+utf2isoTo needs 1 for 1, plus 1, and utfHighTo needs 4 for 1.
+Each returns the length of the result.
+Runs of ascii are copied or widened whole, see memAsciiSpan().
+*********************************************************************/
+
+int iso2utfTo(const uchar * inbuf, int inbuflen, uchar * outbuf)
+{
+	int i, j, n;
+	const unsigned int *isoarray = iso_unicodes[type8859 - 1];
+	char *s;
+
+	for (i = j = 0; i < inbuflen; ++i) {
+		n = memAsciiSpan(inbuf + i, inbuflen - i);
+		memcpy(outbuf + j, inbuf + i, n);
+		i += n, j += n;
+		if (i == inbuflen)
+			break;
+		s = uni2utf8(isoarray[inbuf[i] & 0x7f]);
+		strcpy((char *)outbuf + j, s);
+		j += strlen(s);
+	}
+	outbuf[j] = 0;
+	return j;
+}
+
 void iso2utf(const uchar * inbuf, int inbuflen, uchar ** outbuf_p,
 	     int *outbuflen_p)
 {
-	int i, j;
+	int i;
 	int nacount = 0;
 	uchar c;
 	uchar *outbuf;
@@ -1545,52 +1576,35 @@ void iso2utf(const uchar * inbuf, int inbuflen, uchar ** outbuf_p,
 	}
 
 	outbuf = allocMem(inbuflen + nacount + 1);
-
-	for (i = j = 0; i < inbuflen; ++i) {
-		c = inbuf[i];
-		if (c < 0x80) {
-			outbuf[j++] = c;
-			continue;
-		}
-		ucode = isoarray[c & 0x7f];
-		s = uni2utf8(ucode);
-		strcpy((char *)outbuf + j, s);
-		j += strlen(s);
-	}
-	outbuf[j] = 0;
-
+	*outbuflen_p = iso2utfTo(inbuf, inbuflen, outbuf);
 	*outbuf_p = outbuf;
-	*outbuflen_p = j;
 }
 
-void utf2iso(const uchar * inbuf, int inbuflen, uchar ** outbuf_p,
-	     int *outbuflen_p)
+int utf2isoTo(const uchar * inbuf, int inbuflen, uchar * outbuf)
 {
-	int i, j, k;
+	int i, j, k, n;
 	uchar c;
-	uchar *outbuf;
 	const unsigned int *isoarray = iso_unicodes[type8859 - 1];
 	unsigned int ucode;
 
-	if (!inbuflen) {
-		*outbuf_p = (uchar *) emptyString;
-		*outbuflen_p = 0;
-		return;
-	}
-
-	outbuf = allocMem(inbuflen + 1);
 	for (i = j = 0; i < inbuflen; ++i) {
+		n = memAsciiSpan(inbuf + i, inbuflen - i);
+		memcpy(outbuf + j, inbuf + i, n);
+		i += n, j += n;
+		if (i == inbuflen)
+			break;
 		c = inbuf[i];
 
-/* regular chars and nonascii chars that aren't utf8 pass through. */
-/* There shouldn't be any of the latter */
+/* nonascii chars that aren't utf8 pass through. */
+/* There shouldn't be any of these */
 		if ((c & 0xc0) != 0xc0) {
 			outbuf[j++] = c;
 			continue;
 		}
 
 /* Convertable into 11 bit */
-		if ((c & 0xe0) == 0xc0 && (inbuf[i + 1] & 0xc0) == 0x80) {
+		if ((c & 0xe0) == 0xc0 && i + 1 < inbuflen &&
+		    (inbuf[i + 1] & 0xc0) == 0x80) {
 			ucode = c & 0x1f;
 			ucode <<= 6;
 			ucode |= (inbuf[i + 1] & 0x3f);
@@ -1605,7 +1619,7 @@ void utf2iso(const uchar * inbuf, int inbuflen, uchar ** outbuf_p,
 		}
 
 /* Convertable into 16 bit */
-		if ((c & 0xf0) == 0xe0 &&
+		if ((c & 0xf0) == 0xe0 && i + 2 < inbuflen &&
 		    (inbuf[i + 1] & 0xc0) == 0x80 &&
 		    (inbuf[i + 2] & 0xc0) == 0x80) {
 			ucode = c & 0xf;
@@ -1626,17 +1640,31 @@ void utf2iso(const uchar * inbuf, int inbuflen, uchar ** outbuf_p,
 /* unicodes not found in our iso class are converted into stars */
 		c <<= 1;
 		++i;
-		for (++i; c&0x80; ++i, c <<= 1) {
-			if ((outbuf[i] & 0xc0) != 0x80)
+		for (++i; i < inbuflen && (c & 0x80); ++i, c <<= 1) {
+			if ((inbuf[i] & 0xc0) != 0x80)
 				break;
 		}
 		outbuf[j++] = '*';
 		--i;
 	}
 	outbuf[j] = 0;
+	return j;
+}
 
+void utf2iso(const uchar * inbuf, int inbuflen, uchar ** outbuf_p,
+	     int *outbuflen_p)
+{
+	uchar *outbuf;
+
+	if (!inbuflen) {
+		*outbuf_p = (uchar *) emptyString;
+		*outbuflen_p = 0;
+		return;
+	}
+
+	outbuf = allocMem(inbuflen + 1);
+	*outbuflen_p = utf2isoTo(inbuf, inbuflen, outbuf);
 	*outbuf_p = outbuf;
-	*outbuflen_p = j;
 }
 
 // like the above, but always iso8859-1, and the change is made inline
@@ -1687,28 +1715,29 @@ char *iso12utf(const char *t1, const char *t2, int *lenp)
 /*********************************************************************
 Convert the current line in buffer, which is either iso8859-1 or utf8,
 into utf16 or utf32, big or little endian.
-The returned string is allocated, though not really a string,
+The result is not really a string,
 since it will contain nulls, plenty of them in the case of utf32.
+utfHigh() allocates it, utfHighTo() puts it in the buffer passed in.
 *********************************************************************/
 
-void utfHigh(const char *inbuf, int inbuflen, char **outbuf_p, int *outbuflen_p,
-	     bool inutf8, bool out32, bool outbig)
+int utfHighTo(const char *inbuf, int inbuflen, char *outbuf0,
+	      bool inutf8, bool out32, bool outbig)
 {
-	uchar *outbuf;
+	uchar *outbuf = (uchar *) outbuf0;
 	unsigned int unicode;
 	uchar c;
-	int i, j;
-
-	if (!inbuflen) {
-		*outbuf_p = emptyString;
-		*outbuflen_p = 0;
-		return;
-	}
-
-	outbuf = allocMem(inbuflen * 4);	// worst case
+	int i, j, n;
 
 	i = j = 0;
 	while (i < inbuflen) {
+// runs of ascii, the usual case
+		if (!out32) {
+			n = memAsciiSpan((const uchar *)inbuf + i, inbuflen - i);
+			asciiWiden16((const uchar *)inbuf + i, n, outbuf + j, outbig);
+			i += n, j += 2 * n;
+			if (i == inbuflen)
+				break;
+		}
 		c = (uchar) inbuf[i];
 		if (!inutf8 || ((c & 0xc0) != 0xc0 && (c & 0xfe) != 0xfe)) {
 			unicode = c;	// that was easy
@@ -1780,8 +1809,23 @@ void utfHigh(const char *inbuf, int inbuflen, char **outbuf_p, int *outbuflen_p,
 
 	}
 
-	*outbuf_p = (char *)outbuf;
-	*outbuflen_p = j;
+	return j;
+}
+
+void utfHigh(const char *inbuf, int inbuflen, char **outbuf_p, int *outbuflen_p,
+	     bool inutf8, bool out32, bool outbig)
+{
+	char *outbuf;
+
+	if (!inbuflen) {
+		*outbuf_p = emptyString;
+		*outbuflen_p = 0;
+		return;
+	}
+
+	outbuf = allocMem(inbuflen * 4);	// worst case
+	*outbuflen_p = utfHighTo(inbuf, inbuflen, outbuf, inutf8, out32, outbig);
+	*outbuf_p = outbuf;
 }
 
 // convert a 32 bit unicode character into utf8
@@ -57,6 +57,7 @@ static struct opentag {
 	char lowname[MAXTAGNAME];
 	const char *start; // for innerHTML
 	Tag *t;
+	Tag *lastchild; // so we don't march across the siblings for each new child
 } *stack;
 
 static struct opentag *balance(const char *name)
@@ -223,13 +224,16 @@ static void makeTag(const char *name, const char *lowname, bool slash, const cha
 			goto skiplink;
 		t->parent = parent = stack ? stack->t : overnode;
 		if(parent) {
-			if(!(c =     parent->firstchild))
-				parent->firstchild = t;
-			else {
+			c = stack ? stack->lastchild : 0;
+			if(!c && (c = parent->firstchild))
 				while (c->sibling)
 					c = c->sibling;
+			if(c)
 				c->sibling = t;
-			}
+			else
+				parent->firstchild = t;
+			if(stack)
+				stack->lastchild = t;
 		}
 skiplink:
 
@@ -237,6 +241,7 @@ skiplink:
 		strcpy(k->name, name);
 		strcpy(k->lowname, lowname);
 		k->t = t;
+		k->lastchild = 0;
 		k->start = mark;
 		k->next = stack, stack = k;
 
@@ -282,36 +287,187 @@ skiplink:
 		stack = k->next;
 // set up for innerHTML
 		if(k->t->info->bits & TAG_INNERHTML && k->start && mark)
-			k->t->innerHTML = pullString(k->start, mark - k->start);
+			k->t->cold->innerHTML = pullString(k->start, mark - k->start);
 		free(k);
 	}
 }
 
+/*********************************************************************
+Tags and entities are found by perfect hash, in tables built from
+availableTags[] and andlist[] by tools/buildtaghash.pl, into taghash.c.
+The hash here has to match the hash in that script.
+fnv1a over the bytes picks a bucket, the bucket's displacement
+is mixed in to pick the slot, and the slot is the index into the list.
+A word that isn't in the list lands on some slot anyway,
+so one compare at the end makes sure.
+*********************************************************************/
+
+#define FNV_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+static int hashSlot(unsigned h, const short *disp, int nb,
+const short *slot, int size)
+{
+	unsigned x = h + disp[h % nb];
+	x ^= x >> 16;
+	x *= 0x45d9f3b;
+	x ^= x >> 16;
+	x *= 0x45d9f3b;
+	x ^= x >> 16;
+	return slot[x & (size - 1)];
+}
+
+// Tag names are case insensitive, and lower case in the table.
+const struct tagInfo *findTagInfo(const char *name)
+{
+	char low[MAXTAGNAME];
+	unsigned h = FNV_BASIS;
+	uchar c;
+	int i;
+	for (i = 0; (c = name[i]); ++i) {
+		if (i == MAXTAGNAME - 1)
+			return 0;
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		low[i] = c;
+		h = (h ^ c) * FNV_PRIME;
+	}
+	low[i] = 0;
+	i = hashSlot(h, tagHashDisp, tagHashBuckets, tagHashSlot, tagHashSize);
+	if (i < 0 || strcmp(availableTags[i].name, low))
+		return 0;
+	return availableTags + i;
+}
+
+/*********************************************************************
+The Tag structures, and the tag and attribute names they point to,
+are carved out of large blocks that belong to the window,
+and freeTags() releases the blocks all at once.
+The cold part of each tag, see struct tagCold, comes from a second
+chain of blocks, so the tags themselves sit close together.
+Names are interned, so the thousands of div tags on a page share one "div".
+Values, id class href and so on, are changed by javascript,
+and are still allocated one at a time.
+A tag is built, and its attributes set, while its window is cw,
+since javascript runs with cw set to the window of the running frame.
+*********************************************************************/
+
+#define TAGBLOCKSIZE 65536
+
+struct tagBlock {
+	struct tagBlock *next;
+	int used, size;
+	char data[];
+};
+
+static void *blockAlloc(struct tagBlock **chain, int n)
+{
+	struct tagBlock *b = *chain;
+	void *p;
+	n = (n + 7) & ~7;
+	if (!b || b->used + n > b->size) {
+		int size = (n > TAGBLOCKSIZE / 4 ? n : TAGBLOCKSIZE);
+		b = allocMem(sizeof(struct tagBlock) + size);
+		b->used = 0, b->size = size;
+// a large piece gets its own block, behind the one we are filling
+		if (size == n && *chain) {
+			b->next = (*chain)->next;
+			(*chain)->next = b;
+		} else {
+			b->next = *chain;
+			*chain = b;
+		}
+	}
+	p = b->data + b->used;
+	b->used += n;
+	memset(p, 0, n);
+	return p;
+}
+
+static void *tagArena(Window *w, int n)
+{
+	return blockAlloc(&w->tagBlocks, n);
+}
+
+static void freeBlocks(struct tagBlock **chain)
+{
+	struct tagBlock *b;
+	while ((b = *chain)) {
+		*chain = b->next;
+		free(b);
+	}
+}
+
+static unsigned nameHash(const char *s)
+{
+	unsigned h = FNV_BASIS;
+	for (; *s; ++s)
+		h = (h ^ (uchar)*s) * FNV_PRIME;
+	return h;
+}
+
+// Names are case sensitive here; the table is open hashing, at most half full.
+static const char *internName(Window *w, const char *s)
+{
+	const char **a;
+	int i, j, mask;
+	char *p;
+
+	if (w->tagNamesUsed * 2 >= w->tagNamesSize) {
+		int size = (w->tagNamesSize ? w->tagNamesSize * 2 : 256);
+		a = allocZeroMem(size * sizeof(char *));
+		for (j = 0; j < w->tagNamesSize; ++j) {
+			if (!(p = (char *)w->tagNames[j]))
+				continue;
+			for (i = nameHash(p) & (size - 1); a[i]; i = (i + 1) & (size - 1)) ;
+			a[i] = p;
+		}
+		nzFree(w->tagNames);
+		w->tagNames = a, w->tagNamesSize = size;
+	}
+
+	mask = w->tagNamesSize - 1;
+	for (i = nameHash(s) & mask; w->tagNames[i]; i = (i + 1) & mask)
+		if (stringEqual(w->tagNames[i], s))
+			return w->tagNames[i];
+	p = tagArena(w, strlen(s) + 1);
+	strcpy(p, s);
+	++w->tagNamesUsed;
+	return w->tagNames[i] = p;
+}
+
 static void pushTag(Tag *t);
 Tag *newTag(const Frame *f, const char *name)
 {
 	Tag *t, *t1, *t2 = 0;
 	const struct tagInfo *ti;
 	static int gsn = 0;
+	char upname[MAXTAGNAME];
+	char *u;
 
-	for (ti = availableTags; ti->name[0]; ++ti)
-		if (stringEqualCI(ti->name, name))
-			break;
-
-	if (!ti->name[0]) {
+	if (!(ti = findTagInfo(name))) {
 		debugPrint(4, "warning, created node %s reverts to generic", name);
 		ti = availableTags;
 	}
 
-	t = (Tag *)allocZeroMem(sizeof(Tag));
+	t = (Tag *)tagArena(cw, sizeof(Tag));
+	t->cold = blockAlloc(&cw->coldBlocks, sizeof(struct tagCold));
 	t->action = ti->action;
 	t->f0 = (Frame *) f;		/* set owning frame */
 	t->info = ti;
 	t->seqno = cw->numTags;
 	t->gsn = ++gsn;
-	t->nodeName = cloneString(name);
-	t->nodeNameU = cloneString(name);
-	caseShift(t->nodeNameU, 'u');
+	t->nodeName = internName(cw, name);
+	if (strlen(name) < sizeof(upname)) {
+		strcpy(upname, name);
+		caseShift(upname, 'u');
+		t->nodeNameU = internName(cw, upname);
+	} else {
+		u = cloneString(name);
+		caseShift(u, 'u');
+		t->nodeNameU = internName(cw, u);
+		nzFree(u);
+	}
 	pushTag(t);
 	if (t->action == TAGACT_SCRIPT) {
 		for (t1 = cw->scriptlist; t1; t1 = t1->same)
@@ -399,6 +555,7 @@ static void pushTag(Tag *t)
 // first one has to be the unknown.
 // Whitespace: open nl, open para, close nl, close para.
 // Bits: innerHTML,text is invisible, closing tag is insignificant.
+// tools/buildtaghash.pl reads this table, one tag per line, to build taghash.c
 const struct tagInfo availableTags[] = {
 	{"unknown0", "an html entity", TAGACT_UNKNOWN, 5, 1},
 	{"doctype", "doctype", TAGACT_DOCTYPE, 0, 0},
@@ -524,23 +681,14 @@ static void freeTag(Tag *t)
 	nzFree(t->name);
 	nzFree(t->id);
 	nzFree(t->jclass);
-	nzFree(t->nodeName);
-	nzFree(t->nodeNameU);
 	nzFree(t->value);
-	cnzFree(t->rvalue);
+	cnzFree(t->cold->rvalue);
 	nzFree(t->href);
-	nzFree(t->js_file);
-	nzFree(t->innerHTML);
-	nzFree(t->custom_h);
-
-	a = (char **)t->attributes;
-	if (a) {
-		while (*a) {
-			nzFree(*a);
-			++a;
-		}
-		free(t->attributes);
-	}
+	nzFree(t->cold->js_file);
+	nzFree(t->cold->innerHTML);
+	nzFree(t->cold->custom_h);
+// attribute names, like the tag itself, belong to the window
+	nzFree(t->attributes);
 
 	a = (char **)t->atvals;
 	if (a) {
@@ -550,8 +698,6 @@ static void freeTag(Tag *t)
 		}
 		free(t->atvals);
 	}
-
-	free(t);
 }
 
 void freeTags(Window *w)
@@ -559,6 +705,10 @@ void freeTags(Window *w)
 	int i, n;
 	Tag *t, **e;
 
+	nzFree(w->tagLines);
+	w->tagLines = 0;
+	w->tagLinesSize = 0;
+
 /* if not browsing ... */
 	if (!(e = w->tags))
 		return;
@@ -582,10 +732,57 @@ void freeTags(Window *w)
 	free(w->tags);
 	w->tags = 0;
 	w->numTags = w->allocTags = w->deadTags = 0;
+	freeBlocks(&w->tagBlocks);
+	freeBlocks(&w->coldBlocks);
+	nzFree(w->tagNames);
+	w->tagNames = 0;
+	w->tagNamesSize = w->tagNamesUsed = 0;
 	w->inputlist = w->scriptlist = w->optlist = w->linklist = 0;
 	w->framelist = 0;
 }
 
+static long long strMemory(const char *s)
+{
+	return (s && *s ? strlen(s) + 1 : 0);
+}
+
+// strings is false if the strings in the list are not owned by the list
+static long long listMemory(const char **a, bool strings)
+{
+	long long n;
+	if (!a)
+		return 0;
+	for (n = sizeof(char *); *a; ++a)
+		n += sizeof(char *) + (strings ? strMemory(*a) : 0);
+	return n;
+}
+
+// Bytes held by the tags of a window, for memlist; returns the number of tags.
+int tagMemory(const Window *w, long long *bytes)
+{
+	int i;
+	long long n = w->allocTags * sizeof(Tag *);
+	const struct tagBlock *b;
+// the tags themselves and the names are in the blocks
+	for (b = w->tagBlocks; b; b = b->next)
+		n += sizeof(struct tagBlock) + b->size;
+	for (b = w->coldBlocks; b; b = b->next)
+		n += sizeof(struct tagBlock) + b->size;
+	n += w->tagNamesSize * sizeof(char *);
+	n += w->tagLinesSize * sizeof(int);
+	for (i = 0; i < w->numTags; ++i) {
+		const Tag *t = w->tags[i];
+		n += strMemory(t->textval) + strMemory(t->name) +
+		    strMemory(t->id) + strMemory(t->jclass) +
+		    strMemory(t->value) + strMemory(t->cold->rvalue) +
+		    strMemory(t->href) + strMemory(t->cold->js_file) +
+		    strMemory(t->cold->innerHTML) + strMemory(t->cold->custom_h);
+		n += listMemory(t->attributes, false) + listMemory(t->atvals, true);
+	}
+	*bytes = n;
+	return w->numTags;
+}
+
 // When window first opens, reserve space for 512 tags.
 void initTagArray(void)
 {
@@ -597,6 +794,37 @@ void initTagArray(void)
 					sizeof(Tag *));
 }
 
+/*********************************************************************
+The scanner steps from one interesting byte to the next,
+< > & quotes and newlines, rather than looking at every byte in turn.
+These run 16 or 32 bytes at a time, see memScanSet() in stringfile.c.
+*********************************************************************/
+
+// first byte in [s,e) that is in set, or e if there is none
+static const char *scanTo(const char *s, const char *e, const char *set)
+{
+	return s + memScanSet((const uchar *)s, e - s, set);
+}
+
+static int countLines(const char *s, const char *e)
+{
+	return memCountByte((const uchar *)s, e - s, '\n');
+}
+
+// </script or </style etc, in any case; name is lower case
+static const char *closeTag(const char *s, const char *e, const char *name)
+{
+	return (const char *)memSearch((const uchar *)s, e - s,
+	(const uchar *)name, strlen(name), true);
+}
+
+static bool allWhite(const char *s, const char *e)
+{
+	for(; s < e; ++s)
+		if(!isspace(*s)) return false;
+	return true;
+}
+
 // Now for the scanner, create edbrowse tags corresponding to the html tags.
 void htmlScanner(const char *htmltext, Tag *above, bool isgen)
 {
@@ -604,6 +832,7 @@ void htmlScanner(const char *htmltext, Tag *above, bool isgen)
 	const char *lt; // les than sign
 	const char *gt; // greater than sign
 	const char *seek, *s, *t, *u;
+	const char *end; // end of the html text
 	char *w;
 	bool slash; // </foo>
 	bool ws; // all whitespace
@@ -616,6 +845,7 @@ void htmlScanner(const char *htmltext, Tag *above, bool isgen)
 	backupTags();
 
 	seek = s = htmltext, ln = 1, premode = false;
+	end = htmltext + strlen(htmltext);
 	headbody = 0, bodycount = htmlcount = 0;
 	stack = 0;
 	atWall = false;
@@ -628,7 +858,7 @@ void htmlScanner(const char *htmltext, Tag *above, bool isgen)
 	while(*s) {
 // the next literal < should begin the next tag
 // text like x<y is invalid; you should be using &lt; in this case
-		if(!(lt = strchr(s, '<')))
+		if((lt = scanTo(s, end, "<")) == end)
 			break;
 		slash = false, t = lt + 1;
 		if(*t == '/') ++t, slash = true;
@@ -636,17 +866,15 @@ void htmlScanner(const char *htmltext, Tag *above, bool isgen)
 // bare < just passes through
 		if((!slash && *t != '!' && !isalpha(*t) && !memEqualCI(t, "?xml", 4)) ||
 		(slash && !isalpha(*t))) {
-			s = t + 1;
+			s = (*t ? t + 1 : t); // don't step past the end of the text
 			continue;
 		}
 
 // text fragment between tags
 		if(lt > seek) {
 // adjust line number
-			for(ws = true, u = seek; u < lt; ++u) {
-				if(*u == '\n') ++ln;
-				if(!isspace(*u)) ws = false;
-			}
+			ln += countLines(seek, lt);
+			ws = allWhite(seek, lt);
 // Ignore whitespace that is not in the head or the body.
 // Ignore text after body
 			if(headbody < 5 && (!ws || (headbody == 4 && !atWall))) {
@@ -669,8 +897,7 @@ void htmlScanner(const char *htmltext, Tag *above, bool isgen)
 			}
 			if(dhs) printf("cdata length %d\n", u - t - 8);
 // adjust line number
-			for(t = lt; t < u; ++t)
-				if(*t == '\n') ++ln;
+			ln += countLines(lt, u);
 			seek = s = u + 3;
 			t = lt + 9;
 			w = pullString(t, u - t);
@@ -697,8 +924,7 @@ closecomment:
 // this is a valid comment
 			if(dhs) puts("comment");
 // adjust line number
-			for(t = lt; t < u; ++t)
-				if(*t == '\n') ++ln;
+			ln += countLines(lt, u);
 			seek = s = u + 1;
 // see if this is doctype
 			t = lt + 2 + hyphens;
@@ -764,7 +990,8 @@ But some web pages are all on a line to save bits,
 so also break out at >< like a new tag is starting.
 *********************************************************************/
 
-		for(gt = t, qc = 0; *gt; ++gt) {
+		for(gt = t, qc = 0;
+		(gt = scanTo(gt, end, (qc ? "\"'>\n" : "<>\"'"))) < end; ++gt) {
 			if(qc) {
 				if(qc == *gt) qc = 0; // unquote
 				if(*gt == '>' && !u) u = gt;
@@ -781,8 +1008,7 @@ so also break out at >< like a new tag is starting.
 			goto stop;
 		}
 // adjust line number for this tag
-		for(u = lt; u < gt; ++u)
-			if(*u == '\n') ++ln;
+		ln += countLines(lt, gt);
 		if(*(seek = gt) == '>') ++seek;
 		s = seek; // ready to march on
 
@@ -930,17 +1156,16 @@ Such has to be written
 	var foo = "hello </scr" + "ipt> world";
 With this understanding, we can, and should, scan for </script
 *********************************************************************/
-			if(!(lt = strcasestr(seek, "</script"))) {
+			if(!(lt = closeTag(seek, end, "</script"))) {
 				if(dhs) printf("open script at line %d, html parsing stops here\n", ln);
 				goto stop;
 			}
-			if(!(gt = strpbrk(lt + 1, "<>")) || *gt == '<') {
+			if((gt = scanTo(lt + 1, end, "<>")) == end || *gt == '<') {
 				if(dhs) printf("open script at line %d, html parsing stops here\n", ln);
 				goto stop;
 			}
 // adjust line number
-			for(u = seek; u < gt; ++u)
-				if(*u == '\n') ++ln;
+			ln += countLines(seek, gt);
 			while(isspace(*seek)) ++seek;
 			   if(dhs) printf("script length %d\n", (int)(lt - seek));
 			working_t->doorway = true;
@@ -958,17 +1183,16 @@ With this understanding, we can, and should, scan for </script
 
 		if(stringEqual(lowname, "style")) {
 // this is like script; leave it alone!
-			if(!(lt = strcasestr(seek, "</style"))) {
+			if(!(lt = closeTag(seek, end, "</style"))) {
 				if(dhs) printf("open style at line %d, html parsing stops here\n", ln);
 				goto stop;
 			}
-			if(!(gt = strpbrk(lt + 1, "<>")) || *gt == '<') {
+			if((gt = scanTo(lt + 1, end, "<>")) == end || *gt == '<') {
 				if(dhs) printf("open style at line %d, html parsing stops here\n", ln);
 				goto stop;
 			}
 // adjust line number
-			for(u = seek; u < gt; ++u)
-				if(*u == '\n') ++ln;
+			ln += countLines(seek, gt);
 			while(isspace(*seek)) ++seek;
 			   if(dhs) printf("style length %d\n", (int)(lt - seek));
 			if(lt > seek) {
@@ -991,17 +1215,16 @@ A textarea can contain tags and these are not to be interpreted. In fact a
 textarea is sometimes html code that you are suppose to embed in your web page.
 With this understanding, we can, and should, scan for </textarea
 *********************************************************************/
-			if(!(lt = strcasestr(seek, "</textarea"))) {
+			if(!(lt = closeTag(seek, end, "</textarea"))) {
 				if(dhs) printf("open textarea at line %d, html parsing stops here\n", ln);
 				goto stop;
 			}
-			if(!(gt = strpbrk(lt + 1, "<>")) || *gt == '<') {
+			if((gt = scanTo(lt + 1, end, "<>")) == end || *gt == '<') {
 				if(dhs) printf("open textarea at line %d, html parsing stops here\n", ln);
 				goto stop;
 			}
 // adjust line number
-			for(u = seek; u < gt; ++u)
-				if(*u == '\n') ++ln;
+			ln += countLines(seek, gt);
 			while(isspace(*seek)) ++seek; // should we be doing this?
 			if(lt > seek) {
 // pull out the text and andify.
@@ -1020,13 +1243,11 @@ With this understanding, we can, and should, scan for </textarea
 
 // seek points to the last piece of the buffer, after the last tag
 	if(*seek) {
-		for(ws = true, u = seek; *u; ++u) {
-			if(*u == '\n') ++ln;
-			if(!isspace(*u)) ws = false;
-		}
+		ln += countLines(seek, end);
+		ws = allWhite(seek, end);
 		if(headbody < 5 && !ws) {
 			pushState(seek, true);
-			w = pullAnd(seek, seek + strlen(seek));
+			w = pullAnd(seek, end);
 			if(!premode) compress(w), trimWhite(w);
 			  if(dhs) printf("text{%s}\n", w);
 			makeTag(texttag, texttag, false, 0);
@@ -1112,8 +1333,12 @@ static void findAttributes(const char *start, const char *end)
 		for(v1 = s + 1; isspace(*v1); ++v1)  ;
 		qc = 0;
 		if(*v1 == '"' || *v1 == '\'') qc = *v1++;
-		for(v2 = v1; v2 < end; ++v2)
-			if((!qc && isspace(*v2)) || (qc && *v2 == qc)) break;
+		if(qc) {
+			if(!(v2 = memchr(v1, qc, end - v1))) v2 = end;
+		} else {
+			for(v2 = v1; v2 < end; ++v2)
+				if(isspace(*v2)) break;
+		}
 		setAttrFromHTML(a1, a2, v1, v2);
 		if(*v2 == qc) ++v2;
 		s = v2;
@@ -1174,7 +1399,7 @@ static void findAttributes(const char *start, const char *end)
 		v = t->atvals[j];
 		if (v && !*v) v = 0;
 		t->value = cloneString(v);
-		t->rvalue = cloneString(v);
+		t->cold->rvalue = cloneString(v);
 	}
 // Resolve href against the base, but wait a minute, what if it's <p href=blah>
 // and we're not suppose to resolve it? I don't ask about the parent node.
@@ -1251,7 +1476,7 @@ void setTagAttr(Tag *t, const char *name, char *val)
 		    reallocMem(t->attributes, sizeof(char *) * (nattr + 2));
 		t->atvals = reallocMem(t->atvals, sizeof(char *) * (nattr + 2));
 	}
-	t->attributes[nattr] = cloneString(name);
+	t->attributes[nattr] = internName(cw, name);
 	t->atvals[nattr] = val;
 	++nattr;
 	t->attributes[nattr] = 0;
@@ -1303,8 +1528,11 @@ static char *pullAnd(const char *start, const char *end)
 // the assumption here is that &stuff always encodes to something smaller
 // when represented as utf8.
 // Example: &pi; is pretty short, but the utf8 for pi is 3 bytes, so we're good.
+// Most text has no & at all, and what comes before the first one stays put.
+	if(!(s = strchr(w, '&')))
+		return w;
 
-	for(s = t = w; *s; ++s) {
+	for(t = s; *s; ++s) {
 		if(*s != '&') goto putc;
 		if(s[1] == '#' && (isdigit(s[2]) || ((s[2] == 'x' || s[2] == 'X') && isxdigit(s[3])))) {
 			if(isdigit(s[2])) u = strtol(s+2, &s, 10);
@@ -1337,7 +1565,7 @@ putc:
 
 // entity words and codes taken from
 // https://www.w3schools.com/charsets/ref_html_entities_4.asp
-// then sorted for binary search.
+// tools/buildtaghash.pl reads this list, one entity per line, to build taghash.c
 static const struct entity { unsigned int u; const char *word; } andlist[] = {
 {198, "AElig"},
 {193, "Aacute"},
@@ -3354,21 +3582,17 @@ static const struct entity { unsigned int u; const char *word; } andlist[] = {
 {0, 0},
 };
 
+// entities are case sensitive, &Auml; is not &auml;
 static unsigned andLookup(char *entity, char *v)
 {
-	int i, l, r, d;
-	int n = v - entity;
-// left, right, binary search
-	l = -1;
-	r = sizeof(andlist) / sizeof(struct entity) - 1;
-	while(r - l > 1) {
-		i = (l + r) / 2;
-		d = strncmp(entity, andlist[i].word, n);
-		if(!d && andlist[i].word[n]) d = -1;
-		if(!d) return andlist[i].u;
-		if(d > 0) l = i; else r = i;
-	}
-	return 0; // not found
+	int i, n = v - entity;
+	unsigned h = FNV_BASIS;
+	for(i = 0; i < n; ++i)
+		h = (h ^ (uchar)entity[i]) * FNV_PRIME;
+	i = hashSlot(h, andHashDisp, andHashBuckets, andHashSlot, andHashSize);
+	if(i < 0 || strncmp(entity, andlist[i].word, n) || andlist[i].word[n])
+		return 0; // not found
+	return andlist[i].u;
 }
 
 // Here is a general routine to traverse the tree, with a callback function.
@@ -3646,15 +3870,15 @@ void htmlInputHelper(Tag *t)
 	if (n == INP_FILE) {
 		nzFree(t->value);
 		t->value = 0;
-		cnzFree(t->rvalue);
-		t->rvalue = 0;
+		cnzFree(t->cold->rvalue);
+		t->cold->rvalue = 0;
 	}
 
 /* In this case an empty value should be "", not null */
 	if (t->value == 0)
 		t->value = emptyString;
-	if (t->rvalue == 0)
-		t->rvalue = cloneString(t->value);
+	if (t->cold->rvalue == 0)
+		t->cold->rvalue = cloneString(t->value);
 
 	if (n == INP_RADIO && t->checked && radioCheck && myname) {
 		char namebuf[200];
@@ -3727,7 +3951,7 @@ static void prerenderNode(Tag *t, bool opentag)
 		if (currentTA) {
 			currentTA->value = t->textval;
 			leftClipString(currentTA->value);
-			currentTA->rvalue = cloneString(currentTA->value);
+			currentTA->cold->rvalue = cloneString(currentTA->value);
 			t->textval = 0;
 			t->deleted = true;
 			break;
@@ -3874,7 +4098,7 @@ static void prerenderNode(Tag *t, bool opentag)
 		t->textval = emptyString;
 		if(optg && *optg) {
 // borrow custom_h, opt group is like a custom header
-			t->custom_h = cloneString(optg);
+			t->cold->custom_h = cloneString(optg);
 			optg = 0;
 		}
 		break;
@@ -3911,7 +4135,7 @@ static void prerenderNode(Tag *t, bool opentag)
 			if (!t->value) {
 /* This can only happen it no text inside, <textarea></textarea> */
 /* like the other value fields, it can't be null */
-				t->rvalue = t->value = emptyString;
+				t->cold->rvalue = t->value = emptyString;
 			}
 			currentTA = 0;
 		}
@@ -4526,7 +4750,7 @@ Needless to say that's not good!
 
 /* set innerHTML from the source html, if this tag supports it */
 	if (ti->bits & TAG_INNERHTML)
-		establish_inner(t, t->innerHTML, 0, false);
+		establish_inner(t, t->cold->innerHTML, 0, false);
 
 // If the tag has foo=bar as an attribute, pass this forward to javascript.
 	pushAttributes(t);
@@ -4754,8 +4978,8 @@ void rowspan(void)
 				tr->same = last_tr;
 				last_tr = tr;
 // js_file holds the descriptive string of the cells in the row
-				nzFree(tr->js_file);
-				tr->js_file = 0;
+				nzFree(tr->cold->js_file);
+				tr->cold->js_file = 0;
 				rowspan2(tr, ++ri);
 			}
 		}
@@ -4808,7 +5032,7 @@ static void rowspan2(Tag *tr, int ri)
 		if(td->js_ln <= 0) td->js_ln = 1;
 	}
 
-	ihs = (tr->same ? tr->same->js_file : 0);
+	ihs = (tr->same ? tr->same->cold->js_file : 0);
 	c1 = c2 = 1;
 	ns = initString(&ns_l);
 	last_td = 0;
@@ -4914,7 +5138,7 @@ addcomma:
 
 	if(needstring) {
 		ns[end_l] = 0;
-		tr->js_file = ns;
+		tr->cold->js_file = ns;
 		debugPrint(3, "row %d %s", ri, ns);
 		} else nzFree(ns);
 }
@@ -4928,7 +5152,7 @@ static void rowspan3(Tag *tr, int ri)
 	char *s, *t;
 	bool needstring = false;
 
-	if(!(ihs = tr->js_file)) return;
+	if(!(ihs = tr->cold->js_file)) return;
 
 	s = t = ihs;
 	while(*s) {
@@ -4958,7 +5182,7 @@ static void rowspan3(Tag *tr, int ri)
 
 	if(!needstring) {
 		nzFree(ihs);
-		tr->js_file = 0;
+		tr->cold->js_file = 0;
 	} else
 		debugPrint(3, "row %d %s", ri, ihs);
 }
@@ -615,12 +615,12 @@ void prepareScript(Tag *t)
 			}
 
 			if (jsbg && !demin && !uvw
-			    && !pthread_create(&t->loadthread, NULL,
+			    && !pthread_create(&t->cold->loadthread, NULL,
 					       httpConnectBack2, (void *)t)) {
 				t->js_ln = 1;
 				js_file = realsource;
 				filepart = getFileURL(js_file, true);
-				t->js_file = cloneString(filepart);
+				t->cold->js_file = cloneString(filepart);
 // stop here and wait for the child process to download
 				t->step = 3;
 				return;
@@ -666,7 +666,7 @@ void prepareScript(Tag *t)
 	nzFree(js_text);
 
 	filepart = getFileURL(js_file, true);
-	t->js_file = cloneString(filepart);
+	t->cold->js_file = cloneString(filepart);
 
 // deminimize the code if we're debugging.
 	if (demin)
@@ -874,10 +874,10 @@ passes:
 
 		if (t->step == 3) {
 // waiting for background process to load
-			pthread_join(t->loadthread, NULL);
-			if (!t->loadsuccess || t->hcode != 200) {
+			pthread_join(t->cold->loadthread, NULL);
+			if (!t->cold->loadsuccess || t->cold->hcode != 200) {
 				if (debugLevel >= 3)
-					i_printf(MSG_GetJS, t->href, t->hcode);
+					i_printf(MSG_GetJS, t->href, t->cold->hcode);
 				t->step = 6;
 				continue;
 			}
@@ -931,7 +931,7 @@ I will disconnect here, and also check for inxhr in runOnload().
 		}
 		cnzFree(a);
 
-		js_file = t->js_file;
+		js_file = t->cold->js_file;
 		if (!js_file)
 			js_file = "generated";
 		if (cf != save_cf)
@@ -1149,10 +1149,8 @@ bool htmlTest(void)
 			look[j - 1] = 0;
 			if (j > 1 && (p[j] == '>' || isspaceByte(p[j]))) {
 /* something we recognize? */
-				const struct tagInfo *ti;
-				for (ti = availableTags; ti->name[0]; ++ti)
-					if (stringEqualCI(ti->name, look))
-						return true;
+				if (findTagInfo(look))
+					return true;
 			}	/* leading tag */
 		}		/* leading < */
 		firstline = false;
@@ -1273,8 +1271,8 @@ void infShow(int tagno, const char *search)
 		++cnt;
 		if (*search && !strcasestr(v->textval, search))
 			continue;
-		if(v->custom_h)
-			printf("    %s\n", v->custom_h);
+		if(v->cold->custom_h)
+			printf("    %s\n", v->cold->custom_h);
 		show = true;
 		printf("%3d %s\n", cnt, v->textval);
 	}
@@ -1329,13 +1327,13 @@ updateFieldInBuffer(int tagno, const char *newtext, bool notify, bool fromForm)
 	char *p1, *p2, *s, *t, *new;
 
 	if (locateTagInBuffer(tagno, &ln1, &ln2, &p1, &p2, &s, &t)) {
-		n = (plen = pstLength((pst) p1)) + strlen(newtext) - (t - s);
+		n = (plen = mapLine(cw->map, ln1)->len) + strlen(newtext) - (t - s);
 		new = allocMem(n);
 		memcpy(new, p1, s - p1);
 		strcpy(new + (s - p1), newtext);
 		memcpy(new + strlen(new), t, plen - (t - p1));
-		free(cw->map[ln1].text);
-		cw->map[ln1].text = (pst) new;
+		freeLineText(mapLine(cw->map, ln1)->text);
+		mapSetText(cw->map, ln1, (pst) new, n);
 		if (notify && debugLevel > 0)
 			displayLine(ln1);
 		return;
@@ -1578,7 +1576,7 @@ back to the text buffer, and over to javascript.
 static void resetVar(Tag *t)
 {
 	int itype = t->itype;
-	const char *w = t->rvalue;
+	const char *w = t->cold->rvalue;
 	bool bval;
 
 /* This is a kludge - option looks like INP_SELECT */
@@ -1603,7 +1601,7 @@ static void resetVar(Tag *t)
 
 	if ((itype >= INP_TEXT && itype <= INP_FILE) || itype == INP_TA) {
 		nzFree(t->value);
-		t->value = cloneString(t->rvalue);
+		t->value = cloneString(t->cold->rvalue);
 	}
 
 	if (!t->jslink || !allowJS)
@@ -1660,7 +1658,7 @@ static void formReset(const Tag *form)
 		updateFieldInBuffer(t->seqno, display, false, false);
 		nzFree(t->value);
 		t->value = display;
-/* this should now be the same as t->rvalue, but I guess I'm
+/* this should now be the same as t->cold->rvalue, but I guess I'm
  * not going to check for that, or take advantage of it. */
 	}			/* loop over tags */
 
@@ -3534,21 +3532,21 @@ We need to fix this someday, though it is a very rare corner case.
 // asynchronous script or xhr
 		if (t->step == 3) {	// background load
 			int rc =
-			    pthread_tryjoin_np(t->loadthread, NULL);
+			    pthread_tryjoin_np(t->cold->loadthread, NULL);
 			if (rc != 0 && rc != EBUSY) {
 // should never happen
 				debugPrint(3,
 					   "script background thread test returns %d",
 					   rc);
-				pthread_join(t->loadthread, NULL);
+				pthread_join(t->cold->loadthread, NULL);
 				rc = 0;
 			}
 			if (!rc) {	// it's done
-				if (!t->loadsuccess ||
-				(t->action == TAGACT_SCRIPT &&  t->hcode != 200)) {
+				if (!t->cold->loadsuccess ||
+				(t->action == TAGACT_SCRIPT &&  t->cold->hcode != 200)) {
 					if (debugLevel >= 3)
 						i_printf(MSG_GetJS,
-							 t->href, t->hcode);
+							 t->href, t->cold->hcode);
 					t->step = 6;
 				} else {
 					if (t->action == TAGACT_SCRIPT) {
@@ -3561,7 +3559,7 @@ We need to fix this someday, though it is a very rare corner case.
 			}
 		}
 		if (t->step == 4 && t->action == TAGACT_SCRIPT) {
-			char *js_file = t->js_file;
+			char *js_file = t->cold->js_file;
 			int ln = t->js_ln;
 			t->step = 5;	// running
 			if (!js_file)
@@ -3917,7 +3915,7 @@ static void td2columnHeading(const Tag *tr, const Tag *td)
 	char *prior_p, *last_p;
 	int prior_j;
 	uchar ttype = tableType(tr);
-	char *cs = tr->js_file; // the cellstring
+	char *cs = tr->cold->js_file; // the cellstring
 	if(!cs) cs = emptyString;
 	last_p = cs;
 
@@ -4974,9 +4972,6 @@ bool itext(int d)
 		nzFree(v);
 		change = true;
 		sprintf(newtext, "session %d", t->lic);
-// updateFieldInBuffer is crazy inefficient in that it searches through the
-// whole buffer, and we know it's on the current line, but really, how often
-// do you invoke this command?
 		updateFieldInBuffer(n, newtext, false, false);
 // And now all the pointers are invalid so break out.
 // If there's another textarea on the same line you have to issue the command
@@ -1509,8 +1509,8 @@ void *httpConnectBack2(void *ptr)
 	rc = httpConnect(&g);
 	nzFree(g.cfn);
 	nzFree(g.referrer);
-	t->loadsuccess = rc;
-	t->hcode = g.code;
+	t->cold->loadsuccess = rc;
+	t->cold->hcode = g.code;
 	if (rc) {
 // Rarely, a js file is not in utf8; convert it here, inside the thread.
 		char *b = force_utf8(g.buffer, g.length);
@@ -1535,15 +1535,15 @@ void *httpConnectBack3(void *ptr)
 	g.thisfile = cf->fileName;
 	g.uriEncoded = true;
 	g.url = t->href;
-	g.custom_h = t->custom_h;
+	g.custom_h = t->cold->custom_h;
 	g.headers_p = &outgoing_headers;
 	g.down_force = 2;
 	g.tsn = ++tsn;
 	debugPrint(3, "xhr thread %d", tsn);
 	rc = httpConnect(&g);
 	outgoing_body = g.buffer;
-	t->loadsuccess = rc;
-		t->hcode = g.code;
+	t->cold->loadsuccess = rc;
+		t->cold->hcode = g.code;
 	if(rc) {
 		char *a;
 		int l;
@@ -1570,8 +1570,8 @@ void *httpConnectBack3(void *ptr)
 	nzFree(g.cfn);
 	nzFree(outgoing_headers);
 	nzFree(outgoing_body);
-	nzFree(t->custom_h);
-	t->custom_h = 0;
+	nzFree(t->cold->custom_h);
+	t->cold->custom_h = 0;
 	return NULL;
 }
 
@@ -3033,7 +3033,7 @@ static bool crossOrigin(Tag *t, const char *url2)
 		cnzFree(host1);
 		orig_head = allocMem(strlen(url1) + 10);
 		sprintf(orig_head, "Origin: %s\n", url1);
-		t->custom_h = orig_head;
+		t->cold->custom_h = orig_head;
 		return true;
 	}
 
@@ -3159,7 +3159,7 @@ int frameExpandLine(int ln, Tag *t)
 	if (s) {
 		bool rc = false;
 		if(crossOrigin(t, s))
-			rc = readFileArgv(s, (fromget ? 2 : 1), t->custom_h);
+			rc = readFileArgv(s, (fromget ? 2 : 1), t->cold->custom_h);
 		if (!rc) {
 /* serverData was never set, or was freed do to some other error. */
 /* We just need to pop the frame and return. */
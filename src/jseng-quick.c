@@ -1085,7 +1085,7 @@ void jsRunData(const Tag *t, const char *filename, int lineno)
 // onload handler? Should this run even if the script fails?
 // Right now it does.
 // The script could be removed, replaced by other nodes by innerHTML.
-	if (t->jslink && t->js_file && !isDataURI(t->href) &&
+	if (t->jslink && t->cold->js_file && !isDataURI(t->href) &&
 	typeof_property(cx, *((JSValue*)t->jv), "onload") == EJ_PROP_FUNCTION)
 		run_event(cx, *((JSValue*)t->jv), "script", "onload");
 	debugPrint(5, "< ok");
@@ -2687,13 +2687,13 @@ static JSValue nat_fetchHTTP(JSContext * cx, JSValueConst this, int argc, JSValu
 // No - because t->jv will protect it until it runs.
 		t->href = (char*)incoming_url;
 // t now has responsibility for incoming_url
-		t->custom_h = emptyString;
+		t->cold->custom_h = emptyString;
 		if(JS_IsString(argv[2]))
-			t->custom_h = cloneString(incoming_headers);
+			t->cold->custom_h = cloneString(incoming_headers);
 		JS_FreeCString(cx, incoming_headers);
 		if (cw->browseMode)
 			scriptSetsTimeout(t);
-		pthread_create(&t->loadthread, NULL, httpConnectBack3,
+		pthread_create(&t->cold->loadthread, NULL, httpConnectBack3,
 			       (void *)t);
 		return JS_NewAtomString(cx, "async");
 	}
@@ -3730,6 +3730,17 @@ void freeJSContext(Frame *f)
 	f->jslink = false;
 }
 
+// Bytes used by javascript, for memlist.
+// Quickjs keeps its accounts by runtime, and all our contexts share one.
+long long jsMemory(void)
+{
+	JSMemoryUsage u;
+	if (!jsrt)
+		return 0;
+	JS_ComputeMemoryUsage(jsrt, &u);
+	return u.memory_used_size;
+}
+
 static bool has_property(JSContext *cx, JSValueConst parent, const char *name)
 {
 	JSAtom a = JS_NewAtom(cx, name);
@@ -4022,7 +4033,7 @@ Don't do any of this if the tag is itself <style>. */
 
 // DocType has nodeType = 10, see startwindow.js
 	if(t->action != TAGACT_DOCTYPE) {
-		char *js_node = (t->action == TAGACT_UNKNOWN ? t->nodeName : t->nodeNameU);
+		const char *js_node = (t->action == TAGACT_UNKNOWN ? t->nodeName : t->nodeNameU);
 		set_property_string(cx, io, "nodeName", js_node);
 		set_property_string(cx, io, "tagName", js_node);
 	}
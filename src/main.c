@@ -4,6 +4,10 @@
 
 #include <pthread.h>
 #include <signal.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <glob.h>
 
 // Define the globals that are declared in eb.h.
 // See eb.h for additional comments.
@@ -20,6 +24,7 @@ char *mailDir, *mailUnread, *mailStash, *mailReply;
 char *sigFile, *sigFileEnd;
 char *cacheDir;
 int cacheSize = 1000, cacheCount = 10000;
+int globalThreads;
 char *ebTempDir, *ebUserDir;
 char *userAgents[MAXAGENT + 1];
 char *currentAgent;
@@ -49,6 +54,7 @@ char *dbarea, *dblogin, *dbpw;	// to log into the database
 bool fetchBlobColumns;
 bool caseInsensitive, searchStringsAll, searchWrap = true, ebre = true;
 bool binaryDetect = true;
+bool writeTemp;
 bool inputReadLine;
 bool curlAuthNegotiate = false;
 int context = 1;
@@ -196,6 +202,42 @@ void eeCheck(void)
 		ebClose(1);
 }
 
+// an edbrowse function from the config file, compiled into steps
+struct fnStep {
+	const char *line;	// the line as written, ends in newline
+	int len;
+	int jump;		// where the braces and else go
+	int count;		// loop count
+	uchar code;		// 0 for a command, else 0x81 0x82 0x83
+	char control;		// I i W w U u l
+	uchar depth;		// nesting depth, indexes the loop counters
+	bool tilde;		// has ~ arguments to substitute
+};
+
+struct ebFunction {
+	char *body;
+	struct fnStep *steps;
+	int nsteps;
+	bool nofail, orphan;
+	int busy;		// calls in progress
+	int calls;
+	double elapsed;
+};
+
+static void fnFree(struct ebFunction *fn)
+{
+	if (!fn)
+		return;
+	if (fn->busy) {
+// config reread from within this function, free it on the way out
+		fn->orphan = true;
+		return;
+	}
+	nzFree(fn->steps);
+	nzFree(fn->body);
+	free(fn);
+}
+
 static struct ebhost {
 // j = nojs, v = novs, p = proxy, f = function,
 // s = subject, t = to, r = reply, a = agentsite,
@@ -206,6 +248,8 @@ static struct ebhost {
 	char *host;
 // for proxy entry we also have
 	char *prot, *domain;
+// compiled function
+	struct ebFunction *fn;
 } *ebhosts;
 static size_t ebhosts_avail, ebhosts_max;
 
@@ -220,11 +264,16 @@ static void add_ebhost(char *host, char type)
 		    reallocMem(ebhosts, ebhosts_max * sizeof(struct ebhost));
 	}
 	ebhosts[ebhosts_avail].host = host;
+	ebhosts[ebhosts_avail].fn = 0;
 	ebhosts[ebhosts_avail++].type = type;
 }
 
 static void delete_ebhosts(void)
 {
+	size_t j;
+	for (j = 0; j < ebhosts_avail; ++j)
+		if (ebhosts[j].type == 'f')
+			fnFree(ebhosts[j].fn);
 	nzFree(ebhosts);
 	ebhosts = NULL;
 	ebhosts_avail = ebhosts_max = 0;
@@ -461,14 +510,17 @@ static void setupEdbrowseTempDirectory(void)
 }
 
 static void loadReplacements(void);
+static void batchMode(int jobs, bool autobrowse, bool setDebugOpt,
+		      int argc, char **argv);
 
 int main(int argc, char **argv)
 {
 	int cx, account;
 	bool rc, doConfig = true, autobrowse = false;
 	bool dofetch = false, domail = false, setDebugOpt = false;
+	bool batch = false;
 	char *firstFile = 0;
-	int firstFilePosition = 0, k;
+	int firstFilePosition = 0, k, batchJobs = 0;
 	static char agent0[64] = "edbrowse/";
 
 // In case this is being piped over to a synthesizer, or whatever.
@@ -566,6 +618,9 @@ int main(int argc, char **argv)
 			exit(0);
 		}
 
+		if (stringEqual(s, "bench"))
+			benchMark(argc - 1, argv + 1);
+
 		if (stringEqual(s, "d")) {
 			setDebugOpt = true;
 			debugLevel = 4;
@@ -588,6 +643,12 @@ int main(int argc, char **argv)
 			continue;
 		}
 
+		if (*s == 'j' && (!s[1] || isdigitByte(s[1]))) {
+			batch = true;
+			batchJobs = atoi(s + 1);
+			continue;
+		}
+
 		if (*s == 'p')
 			++s, passMail = true;
 
@@ -702,6 +763,9 @@ int main(int argc, char **argv)
 
 	js_main();
 
+	if (batch)
+		batchMode(batchJobs, autobrowse, setDebugOpt, argc, argv);
+
 // This sanity check on number of files assumes they are all files,
 // not commands to execute.
 	if(argc >= MAXSESSION)
@@ -850,7 +914,11 @@ static void *inputForever(void *ptr)
 {
 	foreground_thread = pthread_self();
 	while (true) {
-		pst p = inputLine();
+		pst p;
+// a big file can finish loading while we wait for the next command
+		loadBackground();
+		indexBackground();
+		p = inputLine();
 		pst save_p = clonePstring(p);
 		if (perl2c((char *)p)) {
 			i_puts(MSG_EnterNull);
@@ -864,50 +932,106 @@ static void *inputForever(void *ptr)
 	return NULL;
 }
 
-/* Find the balancing brace in an edbrowse function */
-static const char *balance(const char *ip, int direction)
-{
-	int nest = 0;
-	uchar code;
+#define MAXNEST 20		// nested blocks
 
-	while (true) {
-		if (direction > 0) {
-			ip = strchr(ip, '\n') + 1;
-		} else {
-			for (ip -= 2; *ip != '\n'; --ip) ;
-			++ip;
-		}
-		code = *ip;
-		if (code == 0x83) {
-			if (nest)
-				continue;
+/*********************************************************************
+Compile an edbrowse function from the config file.
+Each line of the body becomes a step; the braces of if while until and loop
+know where they jump, and each command line knows whether it has ~ arguments
+to substitute. Nothing is rescanned when the function runs.
+Text lines, after a or i or c, are steps like any other,
+and getInputLineFromScript walks through them.
+*********************************************************************/
+
+static struct ebFunction *fnCompile(const char *body, const char *end,
+				    bool nofail)
+{
+	struct ebFunction *fn;
+	struct fnStep *st;
+	const char *s;
+	int n, i, sp;
+	int open[MAXNEST], other[MAXNEST];
+
+	fn = allocZeroMem(sizeof(struct ebFunction));
+	n = end - body;
+	fn->body = allocMem(n + 1);
+	memcpy(fn->body, body, n);
+	fn->body[n] = 0;
+	fn->nofail = nofail;
+	for (n = 0, s = fn->body; *s; ++s)
+		if (*s == '\n')
+			++n;
+	fn->nsteps = n;
+	fn->steps = st = allocZeroMem((n + 1) * sizeof(struct fnStep));
+
+	sp = 0;
+	for (i = 0, s = fn->body; i < n; ++i, ++st) {
+		const char *endl = strchr(s, '\n');
+		st->line = s;
+		st->len = endl - s;
+		st->code = *s;
+		switch (st->code) {
+		case 0x81:
+			if (sp == MAXNEST)
+				break;
+			open[sp] = i, other[sp] = -1;
+			st->control = s[1];
+			st->depth = ++sp;
+			if (st->control == 'l')
+				st->count = atoi(s + 2);
 			break;
-		}
-		if (code == 0x81)
-			nest += direction;
-		if (code == 0x82)
-			nest -= direction;
-		if (nest < 0)
+		case 0x83:
+			if (!sp)
+				break;
+// if false goes to the line after else
+			fn->steps[open[sp - 1]].jump = i + 1;
+			other[sp - 1] = i;
 			break;
+		case 0x82:
+			if (!sp)
+				break;
+			--sp;
+			if (other[sp] >= 0)
+				fn->steps[other[sp]].jump = i + 1;
+			else
+				fn->steps[open[sp]].jump = i + 1;
+// the close of a loop jumps back to the top of the block
+			st->jump = open[sp] + 1;
+			st->control = fn->steps[open[sp]].control;
+			st->depth = fn->steps[open[sp]].depth;
+			break;
+		default:
+			st->code = 0;
+			for (; s < endl; ++s)
+				if (*s == '~' && isdigitByte(s[1]))
+					st->tilde = true;
+		}
+		s = endl + 1;
 	}
 
-	return ip;
+	return fn;
 }
 
-static const char *ip_ptr;
-static const char **endl_ptr;
+static const struct fnStep *steps_ptr;
+static int *pc_ptr, nsteps_ptr;
 static const char **args_ptr;
 static int *argl_ptr;
 
-static char *substituteArgs(void)
+static char *substituteArgs(const struct fnStep *st)
 {
-	const char *ip = ip_ptr;
-	const char *endl = *endl_ptr;
+	const char *ip = st->line;
+	const char *endl = ip + st->len;
 	const char **args = args_ptr;
 	int *argl = argl_ptr;
-		int j, l = endl - ip;
+	int j, l = st->len;
 	const char *s;
 	char *new, *t;
+	if (!st->tilde) {
+		new = allocMem(l + 1);
+		memcpy(new, ip, l);
+		new[l] = 0;
+		return new;
+	}
 // compute length of line, then build the line
 	for (s = ip; s < endl; ++s)
 		if (*s == '~' && isdigitByte(s[1]))
@@ -931,31 +1055,39 @@ static char *substituteArgs(void)
 	return new;
 }
 
-#define MAXNEST 20		// nested blocks
-// Run an edbrowse function, as defined in the config file.
+static struct ebFunction *findFunction(const char *name)
+{
+	unsigned j;
+	for (j = 0; j < ebhosts_avail; ++j)
+		if (ebhosts[j].type == 'f' && ebhosts[j].fn &&
+		    stringEqualCI(name, ebhosts[j].prot + 1))
+			return ebhosts[j].fn;
+	return 0;
+}
+
+// Run an edbrowse function, as defined in the config file,
+// or the given script, which takes the place of the named function.
 // This function must be reentrant, as a script can call another script.
-int runEbFunction(const char *line)
+static int runScript(const char *line, struct ebFunction *script)
 {
 	char *linecopy = cloneString(line);
-	char *fncopy = 0;
 	char *allargs = 0;
 	const char *args[10];
 	int argl[10];		/* lengths of args */
 	const char *s;
 	char *t, *new;
-	int nest;
 	unsigned j;
-	const char *ip;		// think instruction pointer
-	const char *endl;	// end of line to be processed
+	struct ebFunction *fn = 0;
+	const struct fnStep *st;
+	int pc;			// think program counter
 	bool nofail, ok, restore = false;
-	uchar code;
 	int rc = -1;
-	char stack[MAXNEST];
-	int loopcnt[MAXNEST];
+	int loopcnt[MAXNEST + 1];
+	struct timeval tv0, tv1;
 
 // local copies of settings, to restore after function runs.
 	struct {
-		bool rl, endm, lna, H, ci, sg, su8, sw, ebre, bd, iu, hf, hr, vs, sr, can, ftpa, bg, jsbg, js, showall, pg, fbc, ls_reverse, fllo, dno, flow;
+		bool rl, endm, lna, H, ci, sg, su8, sw, ebre, bd, wt, iu, hf, hr, vs, sr, can, ftpa, bg, jsbg, js, showall, pg, fbc, ls_reverse, fllo, dno, flow;
 		uchar dw, ls_sort;
 		char lsformat[12], showProgress;
 		char *currentAgent;
@@ -974,26 +1106,24 @@ int runEbFunction(const char *line)
 	t = strchr(linecopy, ' ');
 	if (t)
 		*t = 0;
-	for (s = linecopy; *s; ++s)
-		if (!isalnumByte(*s)) {
-			setError(MSG_BadFunctionName);
+	if (!(fn = script)) {
+		for (s = linecopy; *s; ++s)
+			if (!isalnumByte(*s)) {
+				setError(MSG_BadFunctionName);
+				goto done;
+			}
+		if (!(fn = findFunction(linecopy))) {
+			setError(MSG_NoSuchFunction, linecopy);
 			goto done;
 		}
-	for (j = 0; j < ebhosts_avail; ++j)
-		if (ebhosts[j].type == 'f' &&
-		    stringEqualCI(linecopy, ebhosts[j].prot + 1))
-			break;
-	if (j == ebhosts_avail) {
-		setError(MSG_NoSuchFunction, linecopy);
-		goto done;
 	}
 // This or a downstream function could invoke config.
 // Don't know why anybody would do that!
-	fncopy = cloneString(ebhosts[j].host);
-/* skip past the leading \n */
-	ip = fncopy + 1;
-	nofail = (ebhosts[j].prot[0] == '+');
-	nest = 0;
+// The compiled function stays put until we are done with it.
+	++fn->busy;
+	++fn->calls;
+	gettimeofday(&tv0, NULL);
+	nofail = fn->nofail;
 	ok = true;
 
 	if(!stringEqual(linecopy, "init") && strncmp(linecopy, "set", 3)) {
@@ -1011,6 +1141,7 @@ int runEbFunction(const char *line)
 		save.jsbg = down_jsbg;
 		save.iu = iuConvert;
 		save.bd = binaryDetect;
+		save.wt = writeTemp;
 		save.rl = inputReadLine;
 		save.can = curlAuthNegotiate;
 		save.lna = listNA;
@@ -1059,85 +1190,69 @@ int runEbFunction(const char *line)
 		argl[j] = strlen(s);
 	}
 
-	while ((code = *ip)) {
+	for (pc = 0; pc < fn->nsteps; ) {
+		bool jump;
+		char ucontrol;
 		if (intFlag) {
 			setError(MSG_Interrupted);
 			goto done;
 		}
-		endl = strchr(ip, '\n');
+		st = fn->steps + pc;
+		ucontrol = toupper(st->control);
 
-		if (code == 0x83) {
-			ip = balance(ip, 1) + 2;
-			--nest;
+		switch (st->code) {
+		case 0x83:
+/* end of the if part, skip past the else part */
+			pc = st->jump;
 			continue;
-		}
 
-		if (code == 0x82) {
-			char control = stack[nest];
-			char ucontrol = toupper(control);
-			const char *start = balance(ip, -1);
-			start = strchr(start, '\n') + 1;
+		case 0x82:
 			if (ucontrol == 'L') {	/* loop */
-				if (--loopcnt[nest])
-					ip = start;
-				else
-					ip = endl + 1, --nest;
+				pc = (--loopcnt[st->depth] ? st->jump : pc + 1);
 				continue;
 			}
 			if (ucontrol == 'W' || ucontrol == 'U') {
-				bool jump = ok;
-				if (islowerByte(control))
+				jump = ok;
+				if (islowerByte(st->control))
 					jump ^= true;
 				if (ucontrol == 'U')
 					jump ^= true;
 				ok = true;
-				if (jump)
-					ip = start;
-				else
-					ip = endl + 1, --nest;
+				pc = (jump ? st->jump : pc + 1);
 				continue;
 			}
 /* Apparently it's the close of an if or an else, just fall through */
-			--nest;
-			goto nextline;
-		}
+			++pc;
+			continue;
 
-		if (code == 0x81) {
-			const char *skip = balance(ip, 1);
-			bool jump;
-			char control = ip[1];
-			char ucontrol = toupper(control);
-			stack[++nest] = control;
+		case 0x81:
 			if (ucontrol == 'L') {
-				loopcnt[nest] = j = atoi(ip + 2);
-				if (j)
-					goto nextline;
-ahead:
-				if (*skip == (char)0x82)
-					--nest;
-				ip = skip + 2;
+				loopcnt[st->depth] = st->count;
+				pc = (st->count ? pc + 1 : st->jump);
+				continue;
+			}
+			if (ucontrol == 'U') {
+				++pc;
 				continue;
 			}
-			if (ucontrol == 'U')
-				goto nextline;
 /* if or while, test on ok */
 			jump = ok;
-			if (isupperByte(control))
+			if (isupperByte(st->control))
 				jump ^= true;
 			ok = true;
-			if (jump)
-				goto ahead;
-			goto nextline;
+			pc = (jump ? st->jump : pc + 1);
+			continue;
 		}
 
 		if (!ok && nofail)
 			goto soft_fail;
 
-		ip_ptr = ip;
-		endl_ptr = &endl;
+		steps_ptr = fn->steps;
+		nsteps_ptr = fn->nsteps;
+		pc_ptr = &pc;
 		args_ptr = args;
 		argl_ptr = argl;
-		new = substituteArgs();
+		new = substituteArgs(st);
 		if(!new) goto done; // substitution failed
 
 // Here we go!
@@ -1151,9 +1266,8 @@ ahead:
 		jClearSync();
 		ok = edbrowseCommand(new, true);
 		free(new);
-
-nextline:
-		ip = endl + 1;
+// pc may have moved on, past lines of text that were read in
+		++pc;
 	}
 
 	if (!ok && nofail)
@@ -1163,8 +1277,14 @@ nextline:
 
 done:
 	nzFree(linecopy);
-	nzFree(fncopy);
 	nzFree(allargs);
+	if (fn) {
+		gettimeofday(&tv1, NULL);
+		fn->elapsed += (tv1.tv_sec - tv0.tv_sec) +
+		    (tv1.tv_usec - tv0.tv_usec) / 1000000.0;
+		if (!--fn->busy && fn->orphan)
+			fnFree(fn);
+	}
 	if(restore) {
 		currentAgent = save.currentAgent, agentIndex = save.agentIndex;
 		debugLevel = save.debugLevel;
@@ -1179,6 +1299,7 @@ done:
 		down_jsbg = save.jsbg;
 		iuConvert = save.iu;
 		binaryDetect = save.bd;
+		writeTemp = save.wt;
 		inputReadLine = save.rl;
 		curlAuthNegotiate = save.can;
 		listNA = save.lna;
@@ -1209,19 +1330,23 @@ soft_fail:
 	goto done;
 }
 
+int runEbFunction(const char *line)
+{
+	return runScript(line, 0);
+}
+
 // so we can append text from within a script, like a here document
 const char *getInputLineFromScript(void)
 {
-	const char *endl = *endl_ptr;
-	const char *ip = endl + 1;
+	const struct fnStep *st;
 	char *new;
 // the script could run out before . terminates the input
-	if(!*ip) return ".\n";
-	endl = strchr(ip, '\n');
-	*endl_ptr = endl;
-	ip_ptr = ip;
-	if(ip[0] == '.' && ip[1] == '\n') return ip;
-	new =  substituteArgs();
+	if (*pc_ptr + 1 >= nsteps_ptr)
+		return ".\n";
+	st = steps_ptr + ++*pc_ptr;
+	if (st->len == 1 && st->line[0] == '.')
+		return st->line;
+	new = substituteArgs(st);
 	if(!new) return 0; // error
 // corner case, becomes . after substitution
 	if(new[0] == '.' && new[1] == 0) {
@@ -1233,6 +1358,269 @@ const char *getInputLineFromScript(void)
 	return new;
 }
 
+// list the edbrowse functions, how often each has run, and the time spent
+void fnList(void)
+{
+	unsigned j;
+	const struct ebFunction *fn;
+	for (j = 0; j < ebhosts_avail; ++j) {
+		if (ebhosts[j].type != 'f' || !(fn = ebhosts[j].fn))
+			continue;
+		printf("%s %d %.3f\n", ebhosts[j].prot + 1, fn->calls,
+		       fn->elapsed);
+	}
+}
+
+/*********************************************************************
+Batch mode: edbrowse -j# script file1 file2 ...
+The script is <function args, or a file of edbrowse commands,
+wherein ~0 is the file being processed.
+A file of - reads the names of files from stdin, one per line,
+and a quoted wildcard is expanded here, in case the list is too long
+for the shell.
+The config file, the init function, and javascript are set up once,
+here in the parent, then a pool of workers is forked.
+Each worker takes the next file off a shared counter,
+reads it into a fresh session 1, runs the script,
+and sends the status and time for that file back over a pipe.
+*********************************************************************/
+
+struct batchResult {
+	int idx;
+	bool ok;
+	double elapsed;
+	char msg[200];
+};
+
+static char **batchList;
+static int batchCount, batchMax;
+
+static void batchAdd(const char *file)
+{
+	if (batchCount == batchMax) {
+		batchMax = (batchMax ? batchMax * 2 : 64);
+		batchList = (batchList ?
+			     reallocMem(batchList, batchMax * sizeof(char *)) :
+			     allocMem(batchMax * sizeof(char *)));
+	}
+	batchList[batchCount++] = cloneString(file);
+}
+
+static void batchFiles(int argc, char **argv)
+{
+	for (; argc; ++argv, --argc) {
+		const char *a = *argv;
+		glob_t g;
+		size_t j;
+		if (stringEqual(a, "-")) {
+			char *line = 0;
+			size_t len = 0;
+			ssize_t n;
+			while ((n = getline(&line, &len, stdin)) >= 0) {
+				if (n && line[n - 1] == '\n')
+					line[--n] = 0;
+				if (n)
+					batchAdd(line);
+			}
+			free(line);
+			continue;
+		}
+		if (strpbrk(a, "*?[") && !isURL(a) && !glob(a, 0, NULL, &g)) {
+			for (j = 0; j < g.gl_pathc; ++j)
+				batchAdd(g.gl_pathv[j]);
+			globfree(&g);
+			continue;
+		}
+		batchAdd(a);
+	}
+}
+
+static bool batchFile(const char *file, bool autobrowse,
+		      const char *fnline, struct ebFunction *script)
+{
+	char *cmd;
+	bool rc;
+
+// Start from a clean session, whatever the last file left behind.
+	cxQuit(1, 3);
+	cxSwitch(1, false);
+	setError(-1);
+	cmd = allocMem(strlen(file) + 7);
+	sprintf(cmd, "%c %s", (autobrowse || isURL(file) ? 'b' : 'e'), file);
+	rc = edbrowseCommand(cmd, true);
+	if (rc) {
+		if (script) {
+			sprintf(cmd, "batch %s", file);
+			rc = (runScript(cmd, script) > 0);
+		} else {
+			rc = (runEbFunction(fnline) > 0);
+		}
+	}
+	nzFree(cmd);
+	return rc;
+}
+
+// A result is less than PIPE_BUF, so it goes through the pipe all at once,
+// but a signal can still cut a write or read short, so finish the record.
+static bool batchWrite(int fd, const struct batchResult *r)
+{
+	const char *p = (const char *)r;
+	size_t n = sizeof(*r);
+	while (n) {
+		ssize_t k = write(fd, p, n);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k <= 0)
+			return false;
+		p += k, n -= k;
+	}
+	return true;
+}
+
+static bool batchRead(int fd, struct batchResult *r)
+{
+	char *p = (char *)r;
+	size_t n = sizeof(*r);
+	while (n) {
+		ssize_t k = read(fd, p, n);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k <= 0)
+			return false;
+		p += k, n -= k;
+	}
+	return true;
+}
+
+static void batchWorker(int fd, int *next, bool autobrowse,
+			const char *fnline, struct ebFunction *script)
+{
+	struct batchResult r;
+	struct timeval tv0, tv1;
+
+	while ((r.idx = __sync_fetch_and_add(next, 1)) < batchCount) {
+		gettimeofday(&tv0, NULL);
+		r.ok = batchFile(batchList[r.idx], autobrowse, fnline, script);
+		gettimeofday(&tv1, NULL);
+		r.elapsed = (tv1.tv_sec - tv0.tv_sec) +
+		    (tv1.tv_usec - tv0.tv_usec) / 1000000.0;
+		r.msg[0] = 0;
+		if (!r.ok) {
+			strncpy(r.msg, errorMsg, sizeof(r.msg) - 1);
+			r.msg[sizeof(r.msg) - 1] = 0;
+		}
+		fflush(stdout);
+// the parent counts this file as failed, with the others this worker didn't get to
+		if (!batchWrite(fd, &r))
+			_exit(1);
+	}
+	fflush(stdout);
+// _exit, not exit; the parent owns the temp files and the cache.
+	_exit(0);
+}
+
+static void batchMode(int jobs, bool autobrowse, bool setDebugOpt,
+		      int argc, char **argv)
+{
+	const char *fnline = 0;
+	struct ebFunction *script = 0;
+	struct batchResult r;
+	char *done;
+	int *next;
+	int fd[2];
+	int k, n, nfail;
+	pid_t pid;
+
+	if (!argc)
+		i_printfExit(MSG_Usage);
+	if (argv[0][0] == '<') {
+		char *name;
+		fnline = argv[0] + 1;
+		name = cloneString(fnline);
+		spaceCrunch(name, true, false);
+		if (strchr(name, ' '))
+			*strchr(name, ' ') = 0;
+		if (!findFunction(name))
+			i_printfExit(MSG_NoSuchFunction, name);
+		nzFree(name);
+	} else {
+		char *buf;
+		int buflen;
+		if (!fileIntoMemory(argv[0], &buf, &buflen, 0))
+			showErrorAbort();
+		if (buflen && buf[buflen - 1] != '\n') {
+			buf = reallocMem(buf, buflen + 2);
+			buf[buflen++] = '\n';
+		}
+		script = fnCompile(buf, buf + buflen, true);
+		nzFree(buf);
+	}
+	batchFiles(argc - 1, argv + 1);
+
+	cxSwitch(1, false);
+	inInitFunction = setDebugOpt;
+	runEbFunction("init");
+	inInitFunction = false;
+	errorExit = false;
+
+	if (jobs <= 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = (ncpu > 0 ? ncpu : 1);
+	}
+	if (jobs > batchCount)
+		jobs = batchCount;
+
+// the counter that hands out files is shared among the workers
+	next = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (next == MAP_FAILED || pipe(fd))
+		i_printfExit(MSG_BatchNoWorker);
+	*next = 0;
+	fflush(stdout);
+	for (k = 0; k < jobs; ++k) {
+		pid = fork();
+		if (pid < 0) {
+			if (!k)
+				i_printfExit(MSG_BatchNoWorker);
+			break;
+		}
+		if (!pid) {
+			close(fd[0]);
+			signal(SIGINT, SIG_DFL);
+			batchWorker(fd[1], next, autobrowse, fnline, script);
+		}
+	}
+	close(fd[1]);
+	debugPrint(3, "batch of %d files, %d workers", batchCount, k);
+
+	done = allocZeroMem(batchCount);
+	n = nfail = 0;
+	while (batchRead(fd[0], &r)) {
+		done[r.idx] = 1;
+		++n;
+		if (r.ok) {
+			i_printf(MSG_BatchOk, batchList[r.idx], r.elapsed);
+		} else {
+			++nfail;
+			i_printf(MSG_BatchFail, batchList[r.idx], r.elapsed,
+				 r.msg);
+		}
+		nl();
+	}
+	while (wait(NULL) > 0) ;
+
+// a worker that died takes its file down with it
+	for (k = 0; k < batchCount; ++k)
+		if (!done[k]) {
+			++nfail;
+			i_printf(MSG_BatchFail, batchList[k], 0.0, "");
+			nl();
+		}
+	i_printf(MSG_BatchDone, batchCount, nfail);
+	nl();
+	ebClose(nfail ? 1 : 0);
+}
+
 struct DBTABLE *findTableDescriptor(const char *sn)
 {
 	int i;
@@ -1323,7 +1711,7 @@ static const char *const keywords[] = {
 	"webtimer", "mailtimer", "certfile", "datasource", "proxy",
 	"agentsite", "localizeweb", "imapfetch", "novs", "cachesize",
 	"adbook", "envelope", "emojis", "emoji",
-"include", "js", "pubkey", 0};
+"include", "js", "pubkey", "gthreads", 0};
 
 /* Read the config file and populate the corresponding data structures. */
 /* This routine succeeds, or aborts via one of these macros. */
@@ -1965,6 +2353,14 @@ inside:
 			pubKey = v;
 			continue;
 
+		case 47:	/* gthreads */
+			globalThreads = atoi(v);
+			if (globalThreads < 0)
+				globalThreads = 0;
+			if (globalThreads > 64)
+				globalThreads = 64;
+			continue;
+
 		default:
 			cfgLine1(MSG_EBRC_KeywordNYI, s);
 		}		/* switch */
@@ -2073,6 +2469,8 @@ nokeyword:
 				goto putback;
 /* This ends the function */
 			*s = 0;	/* null terminate the script */
+			ebhosts[sn].fn = fnCompile(ebhosts[sn].host + 1, s,
+						   ebhosts[sn].prot[0] == '+');
 			continue;
 		}
 
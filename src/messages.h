@@ -813,4 +813,26 @@ enum {
 	MSG_ManyButtons,
 	MSG_ManyImages,
 	MSG_hold715,
+	MSG_NoRedo,
+	MSG_WriteInPlace,
+	MSG_WriteTemp,
+	MSG_SortOption,
+	MSG_SortMode,
+	MSG_TrigramOff,
+	MSG_TrigramOn,
+	MSG_BatchOk,
+	MSG_BatchFail,
+	MSG_BatchDone,
+	MSG_BatchNoWorker,
+	MSG_TimeOff,
+	MSG_TimeOn,
+	MSG_CommandTime,
+	MSG_CommandStats,
+	MSG_NoCommandTimes,
+	MSG_MemWindow,
+	MSG_MemSession,
+	MSG_MemUndo,
+	MSG_MemJS,
+	MSG_MemTotal,
+	MSG_PartLoad,
 };
@@ -19,6 +19,8 @@ bool debugLayout;
 bool demin = false;
 bool gotimers = true;
 bool uvw;
+bool allocCounting;
+long long allocCalls, allocBytes;
 int timerspeed = 1;
 long long fileSize;
 char *downDir, *home;
@@ -35,13 +37,23 @@ Allocate and manage memory.
 Allocate and copy strings.
 If we're out of memory, the program aborts.  No error legs.
 Soooooo much easier! With 32gb of RAM, we shouldn't run out.
+When commands are being timed, dbtime, we also count the calls and bytes.
+Threads allocate too, hence the atomic adds.
 *********************************************************************/
 
+static void allocCount(size_t n)
+{
+	__sync_fetch_and_add(&allocCalls, 1);
+	__sync_fetch_and_add(&allocBytes, n);
+}
+
 void *allocMem(size_t n)
 {
 	void *s;
 	if (!n)
 		return emptyString;
+	if (allocCounting)
+		allocCount(n);
 	if (!(s = malloc(n)))
 		i_printfExit(MSG_MemAllocError, n);
 	return s;
@@ -52,6 +64,8 @@ void *allocZeroMem(size_t n)
 	void *s;
 	if (!n)
 		return emptyString;
+	if (allocCounting)
+		allocCount(n);
 	if (!(s = calloc(n, 1)))
 		i_printfExit(MSG_MemCallocError, n);
 	return s;
@@ -71,6 +85,8 @@ void *reallocMem(void *p, size_t n)
 // that was just read into memory.
 		*(char *)p = 0;
 	}
+	if (allocCounting)
+		allocCount(n);
 	if (!(s = realloc(p, n)))
 		i_printfExit(MSG_ErrorRealloc, n);
 	return s;
@@ -412,6 +428,272 @@ bool memEqualCI(const char *s, const char *t, int len)
 	return true;
 }
 
+/*********************************************************************
+Find a literal string of bytes in a block of text.
+This is the fast path for searches and substitutions that have no
+regular expression characters in them, which is most of them.
+If ci is set, the needle is in lower case, and an ascii letter in the text
+matches in either case. Bytes above 127 have to match exactly.
+Scan for the first and last bytes of the needle together, 16 or 32 bytes
+at a time, and compare the whole needle only where both of them line up.
+There is a plain C version for other machines, and for the tail of the text.
+*********************************************************************/
+
+#if defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define MEMSEARCH_SSE2
+#include <immintrin.h>
+#ifdef __GNUC__
+#define MEMSEARCH_AVX2
+#endif
+#endif
+
+static uchar asciiLower(uchar c)
+{
+	return (c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+}
+
+static bool memEqualFold(const uchar *s, const uchar *needle, int len, bool ci)
+{
+	if (!ci)
+		return !memcmp(s, needle, len);
+	while (len--)
+		if (asciiLower(*s++) != *needle++)
+			return false;
+	return true;
+}
+
+static const uchar *memSearchScalar(const uchar *text, const uchar *end,
+				    const uchar *needle, int nlen, bool ci)
+{
+	uchar first = needle[0];
+	const uchar *last = end - nlen;
+	for (; text <= last; ++text) {
+		if (ci ? asciiLower(*text) != first : *text != first)
+			continue;
+		if (memEqualFold(text, needle, nlen, ci))
+			return text;
+	}
+	return 0;
+}
+
+#ifdef MEMSEARCH_SSE2
+// Bytes that match c, in either case if c is a lower case letter and ci is set.
+// x | 0x20 turns A-Z into a-z and leaves a-z alone, and nothing else maps
+// onto a letter, so one compare finds both cases.
+#define foldMask(ci, c) ((ci) && (c) >= 'a' && (c) <= 'z' ? 0x20 : 0)
+
+static const uchar *memSearchSSE2(const uchar *text, const uchar *end,
+				  const uchar *needle, int nlen, bool ci)
+{
+	uchar f = needle[0], l = needle[nlen - 1];
+	__m128i vf = _mm_set1_epi8(f), vl = _mm_set1_epi8(l);
+	__m128i mf = _mm_set1_epi8(foldMask(ci, f));
+	__m128i ml = _mm_set1_epi8(foldMask(ci, l));
+	for (; text + nlen - 1 + 16 <= end; text += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)text);
+		__m128i b = _mm_loadu_si128((const __m128i *)(text + nlen - 1));
+		a = _mm_cmpeq_epi8(_mm_or_si128(a, mf), vf);
+		b = _mm_cmpeq_epi8(_mm_or_si128(b, ml), vl);
+		unsigned bits = _mm_movemask_epi8(_mm_and_si128(a, b));
+		while (bits) {
+			int j = __builtin_ctz(bits);
+			if (memEqualFold(text + j, needle, nlen, ci))
+				return text + j;
+			bits &= bits - 1;
+		}
+	}
+	return memSearchScalar(text, end, needle, nlen, ci);
+}
+
+#ifdef MEMSEARCH_AVX2
+__attribute__((target("avx2")))
+static const uchar *memSearchAVX2(const uchar *text, const uchar *end,
+				  const uchar *needle, int nlen, bool ci)
+{
+	uchar f = needle[0], l = needle[nlen - 1];
+	__m256i vf = _mm256_set1_epi8(f), vl = _mm256_set1_epi8(l);
+	__m256i mf = _mm256_set1_epi8(foldMask(ci, f));
+	__m256i ml = _mm256_set1_epi8(foldMask(ci, l));
+	for (; text + nlen - 1 + 32 <= end; text += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)text);
+		__m256i b = _mm256_loadu_si256((const __m256i *)(text + nlen - 1));
+		a = _mm256_cmpeq_epi8(_mm256_or_si256(a, mf), vf);
+		b = _mm256_cmpeq_epi8(_mm256_or_si256(b, ml), vl);
+		unsigned bits = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+		while (bits) {
+			int j = __builtin_ctz(bits);
+			if (memEqualFold(text + j, needle, nlen, ci))
+				return text + j;
+			bits &= bits - 1;
+		}
+	}
+	return memSearchSSE2(text, end, needle, nlen, ci);
+}
+#endif
+#endif
+
+const uchar *memSearch(const uchar *text, int tlen,
+		       const uchar *needle, int nlen, bool ci)
+{
+	const uchar *end = text + tlen;
+	if (nlen <= 0 || nlen > tlen)
+		return (nlen == 0 ? text : 0);
+#ifdef MEMSEARCH_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return memSearchAVX2(text, end, needle, nlen, ci);
+#endif
+#ifdef MEMSEARCH_SSE2
+	return memSearchSSE2(text, end, needle, nlen, ci);
+#else
+	return memSearchScalar(text, end, needle, nlen, ci);
+#endif
+}
+
+// Does this block of text have any bytes above 127?
+bool memHighBytes(const uchar *s, int len)
+{
+	const uchar *end = s + len;
+#ifdef MEMSEARCH_SSE2
+	for (; s + 16 <= end; s += 16)
+		if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)s)))
+			return true;
+#endif
+	for (; s < end; ++s)
+		if (*s & 0x80)
+			return true;
+	return false;
+}
+
+// Length of the run of ascii bytes at the start of s.
+// Text is mostly ascii, and the charset conversions copy these runs whole.
+int memAsciiSpan(const uchar *s, int len)
+{
+	const uchar *p = s, *end = s + len;
+#ifdef MEMSEARCH_SSE2
+	for (; p + 16 <= end; p += 16) {
+		int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p));
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+#endif
+	for (; p < end; ++p)
+		if (*p & 0x80)
+			break;
+	return p - s;
+}
+
+// Widen ascii bytes into 16 bit characters, big or little endian.
+// Nothing but ascii comes here, see memAsciiSpan().
+void asciiWiden16(const uchar *s, int len, uchar *out, bool big)
+{
+	int i = 0;
+#ifdef MEMSEARCH_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= len; i += 16, out += 32) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (big) {
+			_mm_storeu_si128((__m128i *) out, _mm_unpacklo_epi8(zero, v));
+			_mm_storeu_si128((__m128i *) (out + 16), _mm_unpackhi_epi8(zero, v));
+		} else {
+			_mm_storeu_si128((__m128i *) out, _mm_unpacklo_epi8(v, zero));
+			_mm_storeu_si128((__m128i *) (out + 16), _mm_unpackhi_epi8(v, zero));
+		}
+	}
+#endif
+	for (; i < len; ++i, out += 2) {
+		out[big] = s[i];
+		out[!big] = 0;
+	}
+}
+
+/*********************************************************************
+Find the first byte of s that is in set, or return len if there is none.
+The set has at most 4 bytes; the html scanner uses this to step
+from one < > & or quote to the next, 16 or 32 bytes at a time.
+The set is padded out to 4 bytes by repeating the first one.
+*********************************************************************/
+
+static int memScanScalar(const uchar *s, int i, int len, const uchar *c)
+{
+	for (; i < len; ++i)
+		if (s[i] == c[0] || s[i] == c[1] || s[i] == c[2] || s[i] == c[3])
+			break;
+	return i;
+}
+
+#ifdef MEMSEARCH_SSE2
+static int memScanSSE2(const uchar *s, int i, int len, const uchar *c)
+{
+	__m128i c0 = _mm_set1_epi8(c[0]), c1 = _mm_set1_epi8(c[1]);
+	__m128i c2 = _mm_set1_epi8(c[2]), c3 = _mm_set1_epi8(c[3]);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, c0),
+						      _mm_cmpeq_epi8(v, c1)),
+					 _mm_or_si128(_mm_cmpeq_epi8(v, c2),
+						      _mm_cmpeq_epi8(v, c3)));
+		unsigned bits = _mm_movemask_epi8(m);
+		if (bits)
+			return i + __builtin_ctz(bits);
+	}
+	return memScanScalar(s, i, len, c);
+}
+
+#ifdef MEMSEARCH_AVX2
+__attribute__((target("avx2")))
+static int memScanAVX2(const uchar *s, int i, int len, const uchar *c)
+{
+	__m256i c0 = _mm256_set1_epi8(c[0]), c1 = _mm256_set1_epi8(c[1]);
+	__m256i c2 = _mm256_set1_epi8(c[2]), c3 = _mm256_set1_epi8(c[3]);
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, c0),
+							    _mm256_cmpeq_epi8(v, c1)),
+					    _mm256_or_si256(_mm256_cmpeq_epi8(v, c2),
+							    _mm256_cmpeq_epi8(v, c3)));
+		unsigned bits = _mm256_movemask_epi8(m);
+		if (bits)
+			return i + __builtin_ctz(bits);
+	}
+	return memScanSSE2(s, i, len, c);
+}
+#endif
+#endif
+
+int memScanSet(const uchar *s, int len, const char *set)
+{
+	uchar c[4];
+	int j, n = strlen(set);
+	for (j = 0; j < 4; ++j)
+		c[j] = set[j < n ? j : 0];
+#ifdef MEMSEARCH_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return memScanAVX2(s, 0, len, c);
+#endif
+#ifdef MEMSEARCH_SSE2
+	return memScanSSE2(s, 0, len, c);
+#else
+	return memScanScalar(s, 0, len, c);
+#endif
+}
+
+// Number of times the byte c appears in s; mostly counting newlines.
+int memCountByte(const uchar *s, int len, uchar c)
+{
+	int i = 0, n = 0;
+#ifdef MEMSEARCH_SSE2
+	__m128i vc = _mm_set1_epi8(c);
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, vc)));
+	}
+#endif
+	for (; i < len; ++i)
+		if (s[i] == c)
+			++n;
+	return n;
+}
+
 bool stringEqual(const char *s, const char *t)
 {
 /* check equality of strings with handling of null pointers */
@@ -842,8 +1124,15 @@ long long bufferSizeW(const Window *w, bool browsing)
 	pst p;
 	if (!w)
 		return -1;
+// The map keeps the total, unless we need to skip past the hidden numbers.
+	if (!(browsing && w->browseMode)) {
+		size = (w->map ? w->map->bytes : 0);
+		if (w->nlMode)
+			--size;
+		return size;
+	}
 	for (ln = 1; ln <= w->dol; ++ln) {
-		p = w->map[ln].text;
+		p = mapLine(w->map, ln)->text;
 		while (*p != '\n') {
 			if (*p == InternalCodeChar && browsing && w->browseMode) {
 				++p;
@@ -893,8 +1182,9 @@ bool unfoldBufferW(const Window *w, bool cr, char **data, int *len)
 	buf = allocMem(size + 4);
 	*data = buf;
 	for (ln = 1; ln <= w->dol; ++ln) {
-		pst line = w->map[ln].text;
-		l = pstLength(line) - 1;
+		const struct lineMap *t = mapLine(w->map, ln);
+		pst line = t->text;
+		l = t->len - 1;
 		if (l) {
 			memcpy(buf, line, l);
 			buf += l;
@@ -1787,6 +2077,10 @@ bool readDirectory(const char *filename, int endline, char cmd, struct lineMap *
 		}
 	}			// loop fixing files in the directory scan
 
+// the lines are done, now they can have their lengths
+	for (j = 0, mptr = *map_p; j < linecount; ++j, ++mptr)
+		mptr->len = pstLength(mptr->text);
+
 	if (innersort) {
 		struct lineMap *tmp;
 		char *dmap2;
@@ -1816,7 +2110,11 @@ bool readDirectory(const char *filename, int endline, char cmd, struct lineMap *
 	}
 
 	addToMap(linecount, endline);
-	cw->r_map = backpiece;
+	cw->r_map = 0;
+	if (backpiece) {
+		cw->r_map = mapCreate(backpiece + 1, linecount);
+		free(backpiece);
+	}
 	if(dmap) {
 		cw->dmap = allocMem((linecount + 1) * DTSIZE);
 		memcpy(cw->dmap + DTSIZE, dmap, linecount*DTSIZE);
@@ -2136,9 +2434,8 @@ moved:
 // if attributes were displayed in that directory - more work to do.
 // I just leave a space for them; I don't try to derive them.
 		if(cw->r_map) {
-			cw->r_map = reallocMem(cw->r_map, LMSIZE * (dol + 2));
-			memset(cw->r_map + dol, 0, LMSIZE*2);
-			cw->r_map[dol].text = (uchar*)emptyString;
+			struct lineMap blank = { (uchar*)emptyString };
+			cw->r_map = mapInsert(cw->r_map, dol - 1, &blank, 1);
 		}
 		cw = cw1; // go back to original window
 		if(origcmd == 't') cw->dot = ln++;
@@ -0,0 +1,141 @@
+#!/usr/bin/perl -w
+# Build perfect hash tables for the html tag names and the html entities.
+# Both lists live in src/html-tags.c, in availableTags[] and andlist[];
+# this reads them from there and writes src/taghash.c.
+# Tag names are folded to lower case as they are hashed, entities are not.
+# The hash is fnv1a over the bytes, that picks a bucket, and each bucket has
+# a displacement that is mixed into the hash to find a free slot.
+# The slot holds the index into availableTags[] or andlist[], or -1.
+# In html-tags.c, findTagInfo() and andLookup() compute the same fnv1a,
+# and hashSlot() mixes in the displacement the same way mix() does here;
+# if you change the hash here you have to change it there.
+
+use strict;
+use warnings;
+
+sub prt($) { print shift; }
+
+my $infile = "src/html-tags.c";
+my $outfile = "src/taghash.c";
+my $outbase = $outfile;
+$outbase =~ s,.*/,,;
+
+if (!open INF, "<$infile") {
+	prt("Error: Unable to open $infile!\n");
+	exit(1);
+}
+my @lines = <INF>;
+close INF;
+
+# pull the words out of the two tables
+my (@tags, @ands);
+my $state = 0;
+foreach my $line (@lines) {
+	if ($line =~ /^const struct tagInfo availableTags\[\] = \{/) { $state = 1; next; }
+	if ($line =~ /^static const struct entity .* andlist\[\] = \{/) { $state = 2; next; }
+	if ($line =~ /^\};/) { $state = 0; next; }
+	if ($state == 1 && $line =~ /^\s*\{"([^"]+)",/) {
+		my $w = $1;
+		if ($w =~ /[A-Z]/) {
+			prt("Error: tag $w is not lower case!\n");
+			exit(1);
+		}
+		push @tags, $w;
+	}
+	push @ands, $1 if $state == 2 && $line =~ /^\{\d+, "([^"]+)"\}/;
+}
+if (!@tags || !@ands) {
+	prt("Error: cannot find availableTags or andlist in $infile!\n");
+	exit(1);
+}
+
+sub fnv($) {
+	my $h = 2166136261;
+	foreach my $c (unpack("C*", shift)) {
+		$h = (($h ^ $c) * 16777619) & 0xffffffff;
+	}
+	return $h;
+}
+
+sub mix($) {
+	my $x = shift;
+	$x ^= $x >> 16;
+	$x = ($x * 0x45d9f3b) & 0xffffffff;
+	$x ^= $x >> 16;
+	$x = ($x * 0x45d9f3b) & 0xffffffff;
+	$x ^= $x >> 16;
+	return $x;
+}
+
+# returns the number of buckets, the displacements, and the slots
+sub perfect(@) {
+	my @words = @_;
+	my $n = @words;
+	my $size = 1;
+	$size *= 2 while $size < $n * 3 / 2;
+	my $nb = 1;
+	$nb *= 2 while $nb < $n / 4;
+	my (@buckets, %seen);
+	for (my $i = 0; $i < $n; ++$i) {
+# first one wins, as it did when the table was searched in order
+		next if $seen{$words[$i]}++;
+		my $h = fnv($words[$i]);
+		push @{$buckets[$h % $nb]}, [$i, $h];
+	}
+	my @slot = (-1) x $size;
+	my @disp = (0) x $nb;
+	my @order = sort { scalar(@{$buckets[$b] || []}) <=> scalar(@{$buckets[$a] || []}) } (0 .. $nb - 1);
+	foreach my $k (@order) {
+		my $list = $buckets[$k] or next;
+		my $d;
+		for ($d = 1; $d < 32768; ++$d) {
+			my %used;
+			my $ok = 1;
+			foreach my $e (@$list) {
+				my $s = mix(($e->[1] + $d) & 0xffffffff) & ($size - 1);
+				if ($slot[$s] >= 0 || $used{$s}++) { $ok = 0; last; }
+			}
+			last if $ok;
+		}
+		if ($d == 32768) {
+			prt("Error: no perfect hash for bucket $k!\n");
+			exit(1);
+		}
+		$disp[$k] = $d;
+		$slot[mix(($_->[1] + $d) & 0xffffffff) & ($size - 1)] = $_->[0] foreach @$list;
+	}
+	return ($nb, \@disp, $size, \@slot);
+}
+
+sub table($$) {
+	my ($name, $v) = @_;
+	my $s = "const short $name\[] = {";
+	for (my $i = 0; $i < @$v; ++$i) {
+		$s .= "\n" if $i % 16 == 0;
+		$s .= "$v->[$i],";
+	}
+	return "$s\n};\n";
+}
+
+if (!open OUTF, ">$outfile") {
+	prt("Error: Unable to create $outfile!\n");
+	exit(1);
+}
+
+print OUTF "/* $outbase: this file is machine generated; */\n";
+print OUTF "/* perfect hash tables for the tags and entities in html-tags.c */\n\n";
+
+my @lc = map { lc } @tags;
+my ($nb, $disp, $size, $slot) = perfect(@lc);
+print OUTF "const int tagHashBuckets = $nb, tagHashSize = $size;\n";
+print OUTF table("tagHashDisp", $disp);
+print OUTF table("tagHashSlot", $slot);
+print OUTF "\n";
+
+($nb, $disp, $size, $slot) = perfect(@ands);
+print OUTF "const int andHashBuckets = $nb, andHashSize = $size;\n";
+print OUTF table("andHashDisp", $disp);
+print OUTF table("andHashSlot", $slot);
+
+close OUTF;
+exit 0;